@@ -74,6 +74,25 @@ class Mobius_Base_Config(ctypes.Structure) :
 		("store_transport_fluxes", ctypes.c_bool),
 		("store_all_series", ctypes.c_bool),
 		("developer_mode", ctypes.c_bool),
+		("jit_step_loop", ctypes.c_bool),
+		("parallel_instances", ctypes.c_bool),
+		("concurrent_batches", ctypes.c_bool),
+		("tiered_compilation", ctypes.c_bool),
+		("aligned_storage", ctypes.c_bool),
+		("store_only", ctypes.POINTER(ctypes.c_char_p)),
+		("store_only_count", ctypes.c_int64),
+		("jit_cache_path", ctypes.c_char_p),
+		("export_code_path", ctypes.c_char_p),
+		("precompiled_code_path", ctypes.c_char_p),
+	]
+
+class Mobius_Batch_Profile(ctypes.Structure) :
+	_fields_ = [
+		("description", ctypes.c_char_p),
+		("milliseconds", ctypes.c_double),
+		("calls", ctypes.c_int64),
+		("rhs_evaluations", ctypes.c_int64),
+		("rejected_steps", ctypes.c_int64),
 	]
 
 class Mobius_New_Index_List(ctypes.Structure) :
@@ -122,7 +141,9 @@ def load_dll() :
 	if not pathlib.Path(dll_file).exists() :
 		raise RuntimeError('mobipy is not properly installed. Please see instructions at https://nivanorge.github.io/Mobius2/mobipydocs/mobipy.html#installation .')
 	
-	dll = ctypes.CDLL(dll_file)
+	# NOTE: The symbols are made global so that precompiled model code (see precompiled_code in build_from_model_and_data_file) can find the
+	# functions it calls in here.
+	dll = ctypes.CDLL(dll_file, mode=ctypes.RTLD_GLOBAL)
 	
 	dll.mobius_encountered_error.argtypes = [ctypes.c_char_p, ctypes.c_int64]
 	dll.mobius_encountered_error.restype = ctypes.c_int64
@@ -145,11 +166,34 @@ def load_dll() :
 	
 	dll.mobius_save_data_set.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
 
+	dll.mobius_set_result_window.argtypes = [ctypes.c_void_p, ctypes.c_int64, ctypes.POINTER(Var_Id), ctypes.c_int64]
+
+	dll.mobius_map_to_file.argtypes = [ctypes.c_void_p, ctypes.c_int32, ctypes.c_char_p]
+	
+	dll.mobius_open_mapped_file.argtypes = [ctypes.c_void_p, ctypes.c_int32, ctypes.c_char_p]
+
+	dll.mobius_set_checkpoint_step.argtypes = [ctypes.c_void_p, ctypes.c_int64]
+	
+	dll.mobius_get_checkpoint.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_int64]
+	dll.mobius_get_checkpoint.restype = ctypes.c_int64
+	
+	dll.mobius_resume_from_checkpoint.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_int64]
+	
+	dll.mobius_set_random_seed.argtypes = [ctypes.c_void_p, ctypes.c_int64]
+	
+	dll.mobius_set_run_profiling.argtypes = [ctypes.c_void_p, ctypes.c_bool]
+	
+	dll.mobius_get_run_profile.argtypes = [ctypes.c_void_p, ctypes.POINTER(Mobius_Batch_Profile), ctypes.c_int64]
+	dll.mobius_get_run_profile.restype = ctypes.c_int64
+
 	dll.mobius_get_steps.argtypes = [ctypes.c_void_p, ctypes.c_int32]
 	dll.mobius_get_steps.restype = ctypes.c_int64
 
 	dll.mobius_run_model.argtypes = [ctypes.c_void_p, ctypes.c_int64, ctypes.CFUNCTYPE(None, ctypes.c_void_p, ctypes.c_double)]
 	dll.mobius_run_model.restype = ctypes.c_bool
+	
+	dll.mobius_rerun_model.argtypes = [ctypes.c_void_p, ctypes.c_int64, ctypes.CFUNCTYPE(None, ctypes.c_void_p, ctypes.c_double), ctypes.POINTER(Entity_Id), ctypes.c_int64]
+	dll.mobius_rerun_model.restype = ctypes.c_bool
 
 	dll.mobius_get_time_step_size.argtypes = [ctypes.c_void_p]
 	dll.mobius_get_time_step_size.restype  = Time_Step_Size
@@ -504,7 +548,9 @@ class Model_Application(Scope) :
 	
 	@classmethod
 	def build_from_model_and_data_file(cls, model_file, data_file, 
-		store_all_series=False, dev_mode=False, store_transport_fluxes=False
+		store_all_series=False, dev_mode=False, store_transport_fluxes=False, store_only=None,
+		jit_step_loop=False, parallel_instances=False, concurrent_batches=False, jit_cache=None,
+		tiered_compilation=False, aligned_storage=False, export_code=None, precompiled_code=None
 	) :
 		
 		base_path = mobius2_path()
@@ -514,6 +560,25 @@ class Model_Application(Scope) :
 		config.store_all_series = store_all_series
 		config.dev_mode = dev_mode
 		config.store_transport_fluxes = store_transport_fluxes
+		config.jit_step_loop = jit_step_loop
+		config.parallel_instances = parallel_instances
+		config.concurrent_batches = concurrent_batches
+		config.tiered_compilation = tiered_compilation
+		config.aligned_storage = aligned_storage
+		if store_only :
+			# Only store these series (given as names or serial names). Other results are only kept in temporary memory during the run when possible.
+			store_only_strs = _c_strs(store_only)
+			config.store_only = ctypes.cast(store_only_strs, ctypes.POINTER(ctypes.c_char_p))
+			config.store_only_count = len(store_only)
+		if jit_cache :
+			# Directory where the compiled model code is kept, so that building the same model again (e.g. in another process) is faster.
+			config.jit_cache_path = _c_str(jit_cache)
+		if export_code :
+			# Write the compiled model code to an object file. Link it to a shared library (e.g. cc -shared model.o -o model.so) to use it as precompiled_code.
+			config.export_code_path = _c_str(export_code)
+		if precompiled_code :
+			# Load the model code from a shared library made from an exported object file instead of compiling it.
+			config.precompiled_code_path = _c_str(precompiled_code)
 		cfgptr = ctypes.POINTER(Mobius_Base_Config)(config)
 		
 		if isinstance(data_file, str) :
@@ -534,20 +599,84 @@ class Model_Application(Scope) :
 		new_ptr = dll.mobius_copy_data(self.data_ptr, copy_results, copy_series)
 		return Model_Application(new_ptr, False, False)
 		
-	def run(self, ms_timeout=-1, log=False, callback=None) :
+	def set_result_window(self, window, kept_vars=[]) :
+		# Only keep 'window' time steps of the full result vector in memory during the run. The full history is only kept for the variables in kept_vars.
+		# Set window to 0 to turn it off again.
+		lst = (Var_Id * len(kept_vars))(*[var.var_id for var in kept_vars])
+		dll.mobius_set_result_window(self.data_ptr, window, lst, len(kept_vars))
+		_check_for_errors()
+		
+	def map_results_to_file(self, file_name, series_file_name=None) :
+		# Put the results (and optionally the input series) in memory mapped files instead of in memory. Use an empty file name to move them back.
+		dll.mobius_map_to_file(self.data_ptr, 0, _c_str(file_name))
+		_check_for_errors()
+		if series_file_name is not None :
+			dll.mobius_map_to_file(self.data_ptr, 2, _c_str(series_file_name))
+			_check_for_errors()
+	
+	def open_result_file(self, file_name) :
+		# Read the results of an earlier run from a file that was written using map_results_to_file. The model must be the same.
+		dll.mobius_open_mapped_file(self.data_ptr, 0, _c_str(file_name))
+		_check_for_errors()
+	
+	def set_checkpoint_step(self, step) :
+		# Save the full run state after this time step in the following runs. A step past the end means the last step. Use -1 to turn it off.
+		dll.mobius_set_checkpoint_step(self.data_ptr, step)
+	
+	def get_checkpoint(self) :
+		# Get the checkpoint from the last run as a bytes object.
+		size = dll.mobius_get_checkpoint(self.data_ptr, None, 0)
+		buf = ctypes.create_string_buffer(size)
+		dll.mobius_get_checkpoint(self.data_ptr, buf, size)
+		return buf.raw
+	
+	def resume_from_checkpoint(self, checkpoint) :
+		# Following runs continue from the checkpoint instead of starting from the start date. Use None to turn it off again.
+		if checkpoint :
+			dll.mobius_resume_from_checkpoint(self.data_ptr, checkpoint, len(checkpoint))
+		else :
+			dll.mobius_resume_from_checkpoint(self.data_ptr, None, 0)
+	
+	def set_random_seed(self, seed) :
+		# Make the random draws in the model the same in every following run. Use -1 to get a new random seed for every run.
+		dll.mobius_set_random_seed(self.data_ptr, seed)
+	
+	def set_run_profiling(self, enable=True) :
+		# Record how much time is spent in each batch of the model in the following runs. See get_run_profile.
+		dll.mobius_set_run_profiling(self.data_ptr, enable)
+	
+	def get_run_profile(self) :
+		# Get a pandas.DataFrame with one row per batch of the model, with where the time went in the last run.
+		count = dll.mobius_get_run_profile(self.data_ptr, None, 0)
+		profile = (Mobius_Batch_Profile * count)()
+		dll.mobius_get_run_profile(self.data_ptr, profile, count)
+		return pd.DataFrame({
+			'batch' : [p.description.decode('utf-8') for p in profile],
+			'milliseconds' : [p.milliseconds for p in profile],
+			'calls' : [p.calls for p in profile],
+			'rhs_evaluations' : [p.rhs_evaluations for p in profile],
+			'rejected_steps' : [p.rejected_steps for p in profile],
+		})
+	
+	def run(self, ms_timeout=-1, log=False, callback=None, changed_pars=None) :
+		# If changed_pars is a list of parameters, only these were changed since the last run, and only what they affect is computed again.
 		if callback :
 			@ctypes.CFUNCTYPE(None, ctypes.c_void_p, ctypes.c_double)
 			def _callback(_p, percent) :
 				callback(percent)
-			finished = dll.mobius_run_model(self.data_ptr, ms_timeout, _callback)
+			cb = _callback
 		elif log :
 			@ctypes.CFUNCTYPE(None, ctypes.c_void_p, ctypes.c_double)
 			def _run_logger(_p, percent) :
 				print("Run progress: %g%%"%percent)
-			finished = dll.mobius_run_model(self.data_ptr, ms_timeout, _run_logger)
+			cb = _run_logger
+		else :
+			cb = ctypes.CFUNCTYPE(None, ctypes.c_void_p, ctypes.c_double)(0)
+		if changed_pars is None :
+			finished = dll.mobius_run_model(self.data_ptr, ms_timeout, cb)
 		else :
-			no_cb = ctypes.CFUNCTYPE(None, ctypes.c_void_p, ctypes.c_double)(0)
-			finished = dll.mobius_run_model(self.data_ptr, ms_timeout, no_cb)
+			ids = (Entity_Id * len(changed_pars))(*[par.entity_id for par in changed_pars])
+			finished = dll.mobius_rerun_model(self.data_ptr, ms_timeout, cb, ids, len(changed_pars))
 		_check_for_errors()
 		return finished
 		
@@ -0,0 +1,3 @@
+#!/bin/bash
+# Builds c_abi.so without LLVM (see MOBIUS_NO_LLVM in src/llvm_jit.h). This build can only run models from precompiled code (see export_model.sh).
+clang -Wno-return-type -Wno-switch -std=c++17 -fPIC -shared -DMOBIUS_ERROR_STREAMS -DMOBIUS_NO_LLVM=1 -fcxx-exceptions -I/usr/local/include/OpenXLSX -I/usr/local/include/OpenXLSX/headers ../src/c_abi.cpp ../src/support/resize_data_set.cpp ../src/resolve_identifier.cpp ../src/model_compilation.cpp  ../src/model_codegen.cpp ../src/differentiation.cpp ../src/tree_pruning.cpp ../src/spreadsheet_inputs_openxlsx.cpp ../src/process_series_data.cpp ../src/data_set.cpp ../src/model_application.cpp ../src/model_composition.cpp ../src/run_model.cpp ../src/lexer.cpp ../src/ast.cpp ../src/model_declaration.cpp ../src/function_tree.cpp  ../src/emulate.cpp ../src/units.cpp ../src/ode_solvers.cpp ../src/jacobian.cpp ../src/file_utils.cpp ../src/connection_regex.cpp ../src/index_data.cpp ../src/catalog.cpp ../src/model_specific/nivafjord_special.cpp ../src/model_specific/nivafjord_jetmix.cpp ../src/model_specific/magic_special.cpp ../src/external_computations.cpp -o c_abi.so -Wl,-undefined,dynamic_lookup -Wl,--export-dynamic -L/usr/lib/ -lOpenXLSX -ldl
@@ -0,0 +1,15 @@
+#!/bin/bash
+# Compiles a model to a shared library that can be loaded with precompiled_code (see Model_Application.build_from_model_and_data_file), also
+# by a build of mobipy without LLVM (see compile_no_llvm.sh). The library only works with data that has the same index structure and the same
+# values for baked parameters as the given data file. This needs a normal build of mobipy (see compile.sh).
+# Usage: ./export_model.sh model.txt data.dat model.so
+set -e
+if [ "$#" -ne 3 ]; then
+	echo "Usage: $0 model_file data_file output_library"
+	exit 1
+fi
+mobipy_dir="$(cd "$(dirname "$0")" && pwd)"
+object_file="$(mktemp --suffix=.o)"
+trap 'rm -f "$object_file"' EXIT
+PYTHONPATH="$mobipy_dir/..:$PYTHONPATH" python3 -c "import sys, mobipy; mobipy.Model_Application.build_from_model_and_data_file(sys.argv[1], sys.argv[2], export_code=sys.argv[3])" "$1" "$2" "$object_file"
+cc -shared "$object_file" -o "$3"
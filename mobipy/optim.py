@@ -293,7 +293,7 @@ def run_latin_hypercube_sample(app, params, set_params, target_stat, n_samples,
         
         success = data.run(run_timeout)
         if success :
-            stat = target_stat(data, pars, n_run)
+            stat = target_stat(data, params, n_run)
         else :
             stat = -np.inf
         del data
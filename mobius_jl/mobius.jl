@@ -82,9 +82,19 @@ struct Entity_Ref
 end
 
 struct Mobius_Base_Config
-	store_transport_fluxes::Cint
-	store_all_series::Cint
-	developer_mode::Cint
+	store_transport_fluxes::Bool
+	store_all_series::Bool
+	developer_mode::Bool
+	jit_step_loop::Bool
+	parallel_instances::Bool
+	concurrent_batches::Bool
+	tiered_compilation::Bool
+	aligned_storage::Bool
+	store_only::Ptr{Cstring}
+	store_only_count::Clonglong
+	jit_cache_path::Cstring
+	export_code_path::Cstring
+	precompiled_code_path::Cstring
 end
 
 invalid_entity_id = Entity_Id(-1, -1)
@@ -122,7 +132,7 @@ function setup_model(model_file::String, data_file::String, ; store_transport_fl
 	#mobius_path = string(dirname(dirname(Base.source_path())), "\\") # Doesn't work in IJulia
 	mobius_path = string(dirname(dirname(@__FILE__)), Base.Filesystem.path_separator)
 	
-	cfg = Mobius_Base_Config(store_transport_fluxes, store_all_series, dev_mode)
+	cfg = Mobius_Base_Config(store_transport_fluxes, store_all_series, dev_mode, false, false, false, false, false, C_NULL, 0, C_NULL, C_NULL, C_NULL)
 	cfgptr = Ref(cfg)
 	
 	result =  ccall(setup_model_h, Ptr{Cvoid}, (Cstring, Cstring, Cstring, Ptr{Mobius_Base_Config}), 
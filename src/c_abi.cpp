@@ -170,6 +170,92 @@ mobius_run_model(Model_Data *data, s64 ms_timeout, run_callback_type run_callbac
 	return false;
 }
 
+DLLEXPORT bool
+mobius_rerun_model(Model_Data *data, s64 ms_timeout, run_callback_type run_callback, Entity_Id *changed_pars, s64 changed_count) {
+	// The same as mobius_run_model, but the caller promises that only these parameters changed since the last run, so that only what they affect
+	// has to be recomputed.
+	try {
+		std::vector<Entity_Id> changed(changed_pars, changed_pars + changed_count);
+		return run_model(data, ms_timeout, false, run_callback, nullptr, &changed);
+	} catch(int) {}
+	return false;
+}
+
+DLLEXPORT void
+mobius_set_result_window(Model_Data *data, s64 window, Var_Id *kept_vars, s64 kept_count) {
+	try {
+		std::vector<Var_Id> kept(kept_vars, kept_vars + kept_count);
+		data->set_result_window(window, kept);
+	} catch(int) {}
+}
+
+DLLEXPORT void
+mobius_map_to_file(Model_Data *data, Var_Id::Type type, char *file_name) {
+	try {
+		data->map_to_file(type, file_name);
+	} catch(int) {}
+}
+
+DLLEXPORT void
+mobius_open_mapped_file(Model_Data *data, Var_Id::Type type, char *file_name) {
+	try {
+		data->open_mapped_file(type, file_name);
+	} catch(int) {}
+}
+
+DLLEXPORT void
+mobius_set_checkpoint_step(Model_Data *data, s64 step) {
+	// Save the run state after this step during the following runs. A negative value turns it off.
+	data->checkpoint_step = step;
+}
+
+DLLEXPORT s64
+mobius_get_checkpoint(Model_Data *data, char *buf, s64 buf_len) {
+	// Returns the size of the checkpoint. It is only copied to buf if buf_len is large enough, so you can call this with buf=nullptr first to get the size.
+	s64 size = (s64)data->checkpoint.size();
+	if(buf && buf_len >= size)
+		memcpy(buf, data->checkpoint.data(), size);
+	return size;
+}
+
+DLLEXPORT void
+mobius_resume_from_checkpoint(Model_Data *data, char *checkpoint, s64 size) {
+	// Following runs start from this checkpoint. Pass size=0 to start from the start date again.
+	if(checkpoint && size > 0)
+		data->resume_from.assign(checkpoint, size);
+	else
+		data->resume_from.clear();
+}
+
+DLLEXPORT void
+mobius_set_random_seed(Model_Data *data, s64 seed) {
+	// With a seed >= 0, the following runs draw the same random numbers every time. Pass -1 to get a new random seed for every run.
+	data->rand_seed = seed;
+}
+
+DLLEXPORT void
+mobius_set_run_profiling(Model_Data *data, bool enable) {
+	data->profile_run = enable;
+}
+
+DLLEXPORT s64
+mobius_get_run_profile(Model_Data *data, Mobius_Batch_Profile *profile_out, s64 max_count) {
+	// Returns the number of batches that were profiled in the last run, and copies up to max_count of them to profile_out.
+	// The descriptions are owned by the model application.
+	s64 count = (s64)data->run_profile.size();
+	if(!profile_out) return count;
+	for(s64 idx = 0; idx < std::min(count, max_count); ++idx) {
+		auto &prof = data->run_profile[idx];
+		auto &out  = profile_out[idx];
+		out.description     = (char *)data->app->batches[idx].description.data();
+		out.milliseconds    = 1e-6*(double)prof.nanoseconds;
+		out.calls           = prof.calls;
+		out.rhs_evaluations = prof.rhs_evaluations;
+		out.rejected_steps  = prof.rejected_steps;
+	}
+	return count;
+}
+
 DLLEXPORT s64
 mobius_get_steps(Model_Data *data, Var_Id::Type type) {
 	
@@ -292,6 +378,17 @@ mobius_get_index_set_count(Model_Data *data, Entity_Id id) {
 	return 0;
 }
 
+void
+check_is_stored(Model_Data *data, Var_Id var_id) {
+	bool stored = var_id.type != Var_Id::Type::temp_var;
+	if(stored) {
+		auto &storage = data->get_storage(var_id.type);
+		stored = storage.structure->handle_is_in_array.find(var_id) != storage.structure->handle_is_in_array.end();
+	}
+	if(!stored)
+		fatal_error(Mobius_Error::api_usage, "The time series for the variable \"", data->app->vars[var_id]->name, "\" is not stored.");
+}
+
 DLLEXPORT void
 mobius_get_series_data(Model_Data *data, Var_Id var_id, Mobius_Index_Value *indexes, s64 indexes_count, double *series_out, s64 time_steps) {
 	
@@ -300,8 +397,7 @@ mobius_get_series_data(Model_Data *data, Var_Id var_id, Mobius_Index_Value *inde
 		if(!is_valid(var_id))
 			fatal_error(Mobius_Error::api_usage, "Tried to get data for an invalid id.");
 	
-		if(var_id.type == Var_Id::Type::temp_var)
-			fatal_error(Mobius_Error::api_usage, "The time series for the variable \"", app->vars[var_id]->name, "\" is not stored.");
+		check_is_stored(data, var_id);
 		
 		if(!time_steps) return;
 	
@@ -351,6 +447,7 @@ mobius_resolve_slice(Model_Data *data, Var_Id var_id, Mobius_Index_Slice *indexe
 	try {
 	// TODO: Maybe generalize so that it can also be used for parameters for instance.
 	auto app = data->app;
+	check_is_stored(data, var_id);
 	Indexes indexes;
 	auto &storage = data->get_storage(var_id.type);
 	const auto &index_sets = storage.structure->get_index_sets(var_id);
@@ -419,8 +516,7 @@ mobius_get_series_data_slice(Model_Data *data, Var_Id var_id, Mobius_Index_Range
 	try {
 	auto app = data->app;
 	
-	if(var_id.type == Var_Id::Type::temp_var)
-		fatal_error(Mobius_Error::api_usage, "The time series for the variable \"", app->vars[var_id]->name, "\" is not stored.");
+	check_is_stored(data, var_id);
 		
 	if(!time_steps) return;
 	
@@ -55,6 +55,15 @@ Mobius_Entity_Metadata {
 	Parameter_Value max;
 };
 
+struct
+Mobius_Batch_Profile {
+	char *description;
+	double milliseconds;
+	s64 calls;
+	s64 rhs_evaluations;
+	s64 rejected_steps;
+};
+
 struct
 Mobius_New_Index_List {
 	Mobius_Index_Value parent_idx;
@@ -100,6 +109,36 @@ mobius_save_data_set(Model_Data *data, char *data_file);
 DLLEXPORT bool
 mobius_run_model(Model_Data *data, s64 ms_timeout, run_callback_type run_callback);
 
+DLLEXPORT bool
+mobius_rerun_model(Model_Data *data, s64 ms_timeout, run_callback_type run_callback, Entity_Id *changed_pars, s64 changed_count);
+
+DLLEXPORT void
+mobius_set_result_window(Model_Data *data, s64 window, Var_Id *kept_vars, s64 kept_count);
+
+DLLEXPORT void
+mobius_map_to_file(Model_Data *data, Var_Id::Type type, char *file_name);
+
+DLLEXPORT void
+mobius_open_mapped_file(Model_Data *data, Var_Id::Type type, char *file_name);
+
+DLLEXPORT void
+mobius_set_checkpoint_step(Model_Data *data, s64 step);
+
+DLLEXPORT s64
+mobius_get_checkpoint(Model_Data *data, char *buf, s64 buf_len);
+
+DLLEXPORT void
+mobius_resume_from_checkpoint(Model_Data *data, char *checkpoint, s64 size);
+
+DLLEXPORT void
+mobius_set_random_seed(Model_Data *data, s64 seed);
+
+DLLEXPORT void
+mobius_set_run_profiling(Model_Data *data, bool enable);
+
+DLLEXPORT s64
+mobius_get_run_profile(Model_Data *data, Mobius_Batch_Profile *profile_out, s64 max_count);
+
 DLLEXPORT s64
 mobius_get_steps(Model_Data *data, Var_Id::Type type);
 
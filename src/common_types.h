@@ -176,6 +176,8 @@ Variable_Type {
 	#include "time_values.incl"
 	#undef TIME_VALUE
 	time_fractional_step,
+	// Only used in generated code for the Jacobian (see differentiation.cpp)
+	solver_workspace,
 };
 
 inline const char *
@@ -188,6 +190,7 @@ name(Variable_Type type) {
 	if(type == Variable_Type::no_override) return "no_override";
 	if(type == Variable_Type::connection) return "connection";
 	if(type == Variable_Type::time_fractional_step) return "time.fractional_step";
+	if(type == Variable_Type::solver_workspace) return "solver_workspace";
 	#define TIME_VALUE(name, bits) if(type == Variable_Type::time_##name) return "time."#name;
 	#include "time_values.incl"
 	#undef TIME_VALUE
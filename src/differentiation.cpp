@@ -0,0 +1,418 @@
+
+#include "model_codegen.h"
+#include "model_application.h"
+
+#include <unordered_map>
+#include <cmath>
+
+// Generation of code for the exact Jacobian of the ODE system of a solver batch.
+// This is forward mode differentiation applied to the code of the batch: every real valued expression gets a tangent expression that computes its
+// derivative in a given direction of the ODE variables. The generated function does everything the batch function does, but it also stores the
+// tangents of the state and temp variables it computes, and instead of the derivatives of the ODE variables it outputs their tangents.
+// Columns of the Jacobian that don't share any rows can be computed from the same direction, exactly like for the finite difference
+// estimate (see jacobian.cpp).
+//
+// Tangents are stored in the solver workspace that is passed to the generated function. With S the number of state variables in a time step and
+// T the number of temp variables, the layout is
+//   [0, S)             : Always 0. These are the tangents of values from the previous time step (they are looked up at a negative offset).
+//   [S, 2S)            : Tangents of state variables. The caller puts the direction of the ODE variables here.
+//   [2S, 2S+T)         : Tangents of temp variables.
+//   [2S+T, 2S+T+n_ode) : The resulting tangents of the derivatives of the ODE variables.
+
+struct
+Differentiation_Context {
+	s64 state_offset;
+	s64 temp_offset;
+	s64 output_offset;
+	
+	std::set<Var_Id> has_tangent;                   // ODE variables of the batch, and variables computed in it.
+	std::unordered_map<s32, s32> tangent_local_id;  // For each scope, what to add to the id of a local variable to get the id of its tangent.
+	
+	bool failed = false;
+};
+
+static void
+find_differentiation_data(Math_Expr_FT *expr, Differentiation_Context *context) {
+	for(auto arg : expr->exprs)
+		find_differentiation_data(arg, context);
+	
+	if(expr->expr_type == Math_Expr_Type::block) {
+		auto block = static_cast<Math_Block_FT *>(expr);
+		s32 max_id = 0;
+		for(auto sub_expr : block->exprs) {
+			if(sub_expr->expr_type == Math_Expr_Type::local_var)
+				max_id = std::max(max_id, static_cast<Local_Var_FT *>(sub_expr)->id + 1);
+		}
+		auto &offset = context->tangent_local_id[block->unique_block_id];
+		offset = std::max(offset, max_id);
+	} else if(expr->expr_type == Math_Expr_Type::state_var_assignment || expr->expr_type == Math_Expr_Type::derivative_assignment) {
+		auto assign = static_cast<Assignment_FT *>(expr);
+		context->has_tangent.insert(assign->var_id);
+	} else if(expr->expr_type == Math_Expr_Type::external_computation || expr->expr_type == Math_Expr_Type::tuple
+		|| expr->expr_type == Math_Expr_Type::access_tuple_element) {
+		// TODO: We could support tuples, but they don't appear in any solver batches yet.
+		context->failed = true;
+	}
+}
+
+static Math_Expr_FT *
+make_workspace_lookup(Math_Expr_FT *offset, s64 base) {
+	auto ident = new Identifier_FT();
+	ident->variable_type = Variable_Type::solver_workspace;
+	ident->value_type = Value_Type::real;
+	ident->exprs.push_back(make_binop('+', offset, make_literal(base)));
+	return ident;
+}
+
+static Math_Expr_FT *
+make_workspace_assignment(Var_Id var_id, Math_Expr_FT *offset, s64 base, Math_Expr_FT *value) {
+	auto assignment = new Assignment_FT(Math_Expr_Type::derivative_assignment, var_id);
+	assignment->exprs.push_back(make_binop('+', offset, make_literal(base)));
+	assignment->exprs.push_back(value);
+	return assignment;
+}
+
+inline Math_Expr_FT *
+zero_if_null(Math_Expr_FT *expr) {
+	return expr ? expr : make_literal((double)0.0);
+}
+
+inline Math_Expr_FT *
+make_product(Math_Expr_FT *factor, Math_Expr_FT *tangent) {
+	// NOTE: a nullptr tangent means that it is 0.
+	if(!tangent) {
+		delete factor;
+		return nullptr;
+	}
+	return make_binop('*', factor, tangent);
+}
+
+inline Math_Expr_FT *
+make_sum(Math_Expr_FT *a, Math_Expr_FT *b, char oper = '+') {
+	if(!a && !b) return nullptr;
+	if(!b) return a;
+	if(!a) return oper == '-' ? make_unary('-', b) : b;
+	return make_binop(oper, a, b);
+}
+
+static Math_Expr_FT *
+make_tangent(Math_Expr_FT *expr, Differentiation_Context *context);
+
+static Math_Expr_FT *
+make_differentiated_statement(Math_Expr_FT *expr, Differentiation_Context *context);
+
+static Math_Expr_FT *
+make_tangent_local(Local_Var_FT *local, s32 scope_id, Differentiation_Context *context) {
+	
+	auto value = local->exprs[0];
+	if(value->value_type != Value_Type::real) return nullptr;
+	
+	auto tangent = new Local_Var_FT();
+	tangent->id              = local->id + context->tangent_local_id[scope_id];
+	tangent->name            = std::string("d_") + local->name;
+	tangent->is_used         = local->is_used;
+	tangent->is_reassignable = local->is_reassignable;
+	tangent->value_type      = local->value_type;
+	tangent->exprs.push_back(zero_if_null(make_tangent(value, context)));
+	return tangent;
+}
+
+static Math_Block_FT *
+make_differentiated_block(Math_Block_FT *block, Differentiation_Context *context, bool is_value) {
+	
+	auto result = new Math_Block_FT();
+	result->unique_block_id = block->unique_block_id; // NOTE: Must be the same since references to the locals of the block use it.
+	result->iter_tag        = block->iter_tag;
+	result->is_for_loop     = block->is_for_loop;
+	result->n_locals        = block->n_locals;
+	result->value_type      = is_value ? Value_Type::real : block->value_type;
+	result->source_loc      = block->source_loc;
+	
+	if(block->is_for_loop) {
+		result->exprs.push_back(copy(block->exprs[0]));
+		result->exprs.push_back(make_differentiated_statement(block->exprs[1], context));
+		return result;
+	}
+	
+	for(int idx = 0; idx < block->exprs.size(); ++idx) {
+		auto sub_expr = block->exprs[idx];
+		bool is_last = (idx == block->exprs.size()-1);
+		if(sub_expr->expr_type == Math_Expr_Type::local_var) {
+			result->exprs.push_back(copy(sub_expr));
+			auto tangent = make_tangent_local(static_cast<Local_Var_FT *>(sub_expr), block->unique_block_id, context);
+			if(tangent) {
+				result->exprs.push_back(tangent);
+				++result->n_locals;
+			}
+		} else if(is_last && is_value)
+			result->exprs.push_back(zero_if_null(make_tangent(sub_expr, context)));
+		else
+			result->exprs.push_back(make_differentiated_statement(sub_expr, context));
+	}
+	return result;
+}
+
+static Math_Expr_FT *
+make_differentiated_statement(Math_Expr_FT *expr, Differentiation_Context *context) {
+	
+	switch(expr->expr_type) {
+		case Math_Expr_Type::block : {
+			return make_differentiated_block(static_cast<Math_Block_FT *>(expr), context, false);
+		} break;
+		
+		case Math_Expr_Type::if_chain : {
+			auto result = new Math_Expr_FT(Math_Expr_Type::if_chain);
+			result->value_type = expr->value_type;
+			for(int idx = 0; idx < expr->exprs.size(); ++idx) {
+				bool is_cond = (idx % 2 == 1);
+				result->exprs.push_back(is_cond ? copy(expr->exprs[idx]) : make_differentiated_statement(expr->exprs[idx], context));
+			}
+			return result;
+		} break;
+		
+		case Math_Expr_Type::state_var_assignment : {
+			auto assign = static_cast<Assignment_FT *>(expr);
+			auto result = new Math_Block_FT();
+			result->value_type = Value_Type::none;
+			s64 base = (assign->var_id.type == Var_Id::Type::state_var) ? context->state_offset : context->temp_offset;
+			auto tangent = zero_if_null(make_tangent(expr->exprs[1], context));
+			result->exprs.push_back(make_workspace_assignment(assign->var_id, copy(expr->exprs[0]), base, tangent));
+			result->exprs.push_back(copy(expr));
+			return result;
+		} break;
+		
+		case Math_Expr_Type::derivative_assignment : {
+			auto assign = static_cast<Assignment_FT *>(expr);
+			auto tangent = zero_if_null(make_tangent(expr->exprs[1], context));
+			return make_workspace_assignment(assign->var_id, copy(expr->exprs[0]), context->output_offset, tangent);
+		} break;
+		
+		case Math_Expr_Type::local_var_assignment : {
+			auto assign = static_cast<Assignment_FT *>(expr);
+			if(expr->exprs[0]->value_type != Value_Type::real)
+				return copy(expr);
+			// NOTE: The tangent is assigned first since it could depend on the old value of the variable.
+			auto result = new Math_Block_FT();
+			result->value_type = Value_Type::none;
+			Local_Var_Id tangent_id = assign->local_var;
+			tangent_id.id += context->tangent_local_id[tangent_id.scope_id];
+			auto tangent = new Assignment_FT(tangent_id);
+			tangent->exprs.push_back(zero_if_null(make_tangent(expr->exprs[0], context)));
+			result->exprs.push_back(tangent);
+			result->exprs.push_back(copy(expr));
+			return result;
+		} break;
+		
+		case Math_Expr_Type::iterate :
+		case Math_Expr_Type::no_op : {
+			return copy(expr);
+		} break;
+	}
+	
+	// Anything else is a value that is not used for anything.
+	return make_no_op();
+}
+
+static Math_Expr_FT *
+make_intrinsic_tangent(Function_Call_FT *fun, Differentiation_Context *context) {
+	
+	if(fun->fun_type != Function_Type::intrinsic) {
+		context->failed = true;
+		return nullptr;
+	}
+	
+	auto &name = fun->fun_name;
+	auto a = fun->exprs[0];
+	
+	if(fun->exprs.size() == 2) {
+		auto b = fun->exprs[1];
+		if(name == "min" || name == "max") {
+			auto da = make_tangent(a, context);
+			auto db = make_tangent(b, context);
+			if(!da && !db) return nullptr;
+			auto cond = make_binop(name == "min" ? '<' : '>', copy(a), copy(b));
+			return make_simple_if(zero_if_null(da), cond, zero_if_null(db));
+		} else if(name == "copysign") {
+			// d copysign(a, b) = sign(a)*sign(b)*da   (except where b changes sign)
+			auto sign = make_intrinsic_function_call(Value_Type::real, "copysign", make_intrinsic_function_call(Value_Type::real, "copysign", make_literal(1.0), copy(a)), copy(b));
+			return make_product(sign, make_tangent(a, context));
+		}
+		// NOTE: The random functions are just treated as constants.
+		return nullptr;
+	}
+	
+	auto da = make_tangent(a, context);
+	if(!da) return nullptr;
+	
+	auto call = [&](const char *fun_name, Math_Expr_FT *arg) { return make_intrinsic_function_call(Value_Type::real, fun_name, arg); };
+	
+	Math_Expr_FT *factor = nullptr;
+	if(name == "sqrt")
+		factor = make_binop('/', make_literal(0.5), copy(fun));
+	else if(name == "abs")
+		factor = make_intrinsic_function_call(Value_Type::real, "copysign", make_literal(1.0), copy(a));
+	else if(name == "exp")
+		factor = copy(fun);
+	else if(name == "pow2")
+		factor = make_binop('*', copy(fun), make_literal(std::log(2.0)));
+	else if(name == "ln")
+		factor = make_binop('/', make_literal(1.0), copy(a));
+	else if(name == "log10")
+		factor = make_binop('/', make_literal(1.0/std::log(10.0)), copy(a));
+	else if(name == "log2")
+		factor = make_binop('/', make_literal(1.0/std::log(2.0)), copy(a));
+	else if(name == "cos")
+		factor = make_unary('-', call("sin", copy(a)));
+	else if(name == "sin")
+		factor = call("cos", copy(a));
+	else if(name == "tan") {
+		auto c = call("cos", copy(a));
+		factor = make_binop('/', make_literal(1.0), make_binop('*', c, copy(c)));
+	} else if(name == "acos" || name == "asin") {
+		auto root = call("sqrt", make_binop('-', make_literal(1.0), make_binop('*', copy(a), copy(a))));
+		factor = make_binop('/', make_literal(name == "acos" ? -1.0 : 1.0), root);
+	} else if(name == "atan")
+		factor = make_binop('/', make_literal(1.0), make_binop('+', make_literal(1.0), make_binop('*', copy(a), copy(a))));
+	else if(name == "tanh")
+		factor = make_binop('-', make_literal(1.0), make_binop('*', copy(fun), copy(fun)));
+	else if(name == "sinh")
+		factor = call("cosh", copy(a));
+	else if(name == "cosh")
+		factor = call("sinh", copy(a));
+	else if(name == "cbrt")
+		factor = make_binop('/', make_literal(1.0/3.0), make_binop('*', copy(fun), copy(fun)));
+	else if(name == "floor" || name == "ceil") {
+		delete da;
+		return nullptr;
+	} else
+		fatal_error(Mobius_Error::internal, "Unhandled intrinsic \"", name, "\" in make_intrinsic_tangent().");
+	
+	return make_binop('*', factor, da);
+}
+
+static Math_Expr_FT *
+make_tangent(Math_Expr_FT *expr, Differentiation_Context *context) {
+	// Returns an expression for the tangent of a real valued expression, or nullptr if the tangent is always 0.
+	
+	if(context->failed || expr->value_type != Value_Type::real) return nullptr;
+	
+	switch(expr->expr_type) {
+		case Math_Expr_Type::block : {
+			return make_differentiated_block(static_cast<Math_Block_FT *>(expr), context, true);
+		} break;
+		
+		case Math_Expr_Type::identifier : {
+			auto ident = static_cast<Identifier_FT *>(expr);
+			if(ident->variable_type == Variable_Type::local) {
+				auto id = ident->local_var;
+				return make_local_var_reference(id.id + context->tangent_local_id[id.scope_id], id.scope_id, Value_Type::real);
+			} else if(ident->variable_type == Variable_Type::series && ident->var_id.type != Var_Id::Type::series) {
+				if(context->has_tangent.find(ident->var_id) == context->has_tangent.end())
+					return nullptr; // Computed in an earlier batch, so it doesn't depend on the ODE variables.
+				s64 base = (ident->var_id.type == Var_Id::Type::state_var) ? context->state_offset : context->temp_offset;
+				return make_workspace_lookup(copy(expr->exprs[0]), base);
+			}
+			// Parameters, input series and time values.
+			return nullptr;
+		} break;
+		
+		case Math_Expr_Type::unary_operator : {
+			auto unary = static_cast<Operator_FT *>(expr);
+			if((char)unary->oper != '-') return nullptr;
+			auto da = make_tangent(expr->exprs[0], context);
+			return da ? make_unary('-', da) : nullptr;
+		} break;
+		
+		case Math_Expr_Type::binary_operator : {
+			auto binary = static_cast<Operator_FT *>(expr);
+			auto a = expr->exprs[0];
+			auto b = expr->exprs[1];
+			char op = (char)binary->oper;
+			if(op == '+' || op == '-')
+				return make_sum(make_tangent(a, context), make_tangent(b, context), op);
+			else if(op == '*')
+				return make_sum(make_product(copy(b), make_tangent(a, context)), make_product(copy(a), make_tangent(b, context)));
+			else if(op == '/') {
+				// d(a/b) = (da - (a/b)*db) / b
+				auto num = make_sum(make_tangent(a, context), make_product(copy(expr), make_tangent(b, context)), '-');
+				return num ? make_binop('/', num, copy(b)) : nullptr;
+			} else if(op == '^') {
+				// d(a^b) = b*a^(b-1)*da + ln(a)*a^b*db
+				if(a->value_type != Value_Type::real) return nullptr;
+				Math_Expr_FT *db = (b->value_type == Value_Type::real) ? make_tangent(b, context) : nullptr;
+				Math_Expr_FT *b_minus_1;
+				if(b->value_type == Value_Type::integer)
+					b_minus_1 = make_binop('-', copy(b), make_literal((s64)1));
+				else
+					b_minus_1 = make_binop('-', copy(b), make_literal(1.0));
+				auto b_real = (b->value_type == Value_Type::integer) ? make_cast(copy(b), Value_Type::real) : copy(b);
+				auto factor_a = make_binop('*', b_real, make_binop('^', copy(a), b_minus_1));
+				auto factor_b = make_binop('*', make_intrinsic_function_call(Value_Type::real, "ln", copy(a)), copy(expr));
+				return make_sum(make_product(factor_a, make_tangent(a, context)), make_product(factor_b, db));
+			}
+			fatal_error(Mobius_Error::internal, "Unhandled operator ", name(binary->oper), " in make_tangent().");
+		} break;
+		
+		case Math_Expr_Type::function_call : {
+			return make_intrinsic_tangent(static_cast<Function_Call_FT *>(expr), context);
+		} break;
+		
+		case Math_Expr_Type::if_chain : {
+			std::vector<Math_Expr_FT *> tangents;
+			bool any = false;
+			for(int idx = 0; idx < expr->exprs.size(); idx += 2) {
+				tangents.push_back(make_tangent(expr->exprs[idx], context));
+				any = any || tangents.back();
+			}
+			if(!any) return nullptr;
+			// NOTE: The conditions are piecewise constant, so they don't contribute to the derivative.
+			auto result = new Math_Expr_FT(Math_Expr_Type::if_chain);
+			result->value_type = Value_Type::real;
+			for(int idx = 0; idx < expr->exprs.size(); ++idx) {
+				if(idx % 2 == 1)
+					result->exprs.push_back(copy(expr->exprs[idx]));
+				else
+					result->exprs.push_back(zero_if_null(tangents[idx/2]));
+			}
+			return result;
+		} break;
+		
+		case Math_Expr_Type::literal :
+		case Math_Expr_Type::cast : {
+			// NOTE: A cast to real is from an integer or boolean, which don't have tangents.
+			return nullptr;
+		} break;
+	}
+	
+	context->failed = true;
+	return nullptr;
+}
+
+Math_Expr_FT *
+generate_jacobian_code(Model_Application *app, Math_Expr_FT *run_code) {
+	
+	Differentiation_Context context;
+	auto layout = jacobian_workspace_layout(app);
+	context.state_offset  = layout.state_offset;
+	context.temp_offset   = layout.temp_offset;
+	context.output_offset = layout.output_offset;
+	
+	find_differentiation_data(run_code, &context);
+	if(context.failed) return nullptr;
+	
+	auto result = make_differentiated_statement(run_code, &context);
+	if(context.failed) {
+		delete result;
+		return nullptr;
+	}
+	return result;
+}
+
+Jacobian_Workspace_Layout
+jacobian_workspace_layout(Model_Application *app) {
+	Jacobian_Workspace_Layout layout;
+	layout.state_offset  = app->result_structure.total_count;
+	layout.temp_offset   = 2*app->result_structure.total_count;
+	layout.output_offset = layout.temp_offset + app->temp_result_structure.total_count;
+	return layout;
+}
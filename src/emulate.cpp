@@ -1,6 +1,6 @@
 
 #include <cmath>
-#include <random>
+#include <unordered_map>
 
 #include "function_tree.h"
 #include "emulate.h"
@@ -135,27 +135,20 @@ apply_intrinsic(Typed_Value a, Typed_Value b, String_View function, Model_Run_St
 	} else if (function == "copysign") {
 		result.type = Value_Type::real;
 		result.val_real = std::copysign(a.val_real, b.val_real);
-	} else if (function == "uniform_real") {
-		std::uniform_real_distribution<double> dist(a.val_real, b.val_real);
-		result.type = Value_Type::real;
-		if(state)
-			result.val_real = dist(state->rand_state);
-		else
-			fatal_error(Mobius_Error::internal, "apply_intrinsic without random state");
-	} else if (function == "normal") {
-		std::normal_distribution<double> dist(a.val_real, b.val_real);
-		result.type = Value_Type::real;
-		if(state)
-			result.val_real = dist(state->rand_state);
-		else
-			fatal_error(Mobius_Error::internal, "apply_intrinsic without random state");
-	} else if (function == "uniform_int") {
-		std::uniform_int_distribution<s64> dist(a.val_integer, b.val_integer);
-		result.type = Value_Type::integer;
-		if(state)
-			result.val_integer = dist(state->rand_state);
-		else
+	} else if (function == "uniform_real" || function == "normal" || function == "uniform_int") {
+		if(!state)
 			fatal_error(Mobius_Error::internal, "apply_intrinsic without random state");
+		state->rand_state.set_step(state->date_time.step);
+		if (function == "uniform_real") {
+			result.type = Value_Type::real;
+			result.val_real = state->rand_state.uniform(a.val_real, b.val_real);
+		} else if (function == "normal") {
+			result.type = Value_Type::real;
+			result.val_real = state->rand_state.normal(a.val_real, b.val_real);
+		} else {
+			result.type = Value_Type::integer;
+			result.val_integer = state->rand_state.uniform_int(a.val_integer, b.val_integer);
+		}
 	} else
 		fatal_error(Mobius_Error::internal, "Unhandled intrinsic \"", function, "\" in apply_intrinsic(a, b).");
 	return result;
@@ -234,7 +227,8 @@ emulate_expression(Math_Expr_FT *expr, Model_Run_State *state, Scope_Local_Vars<
 			result.type = expr->value_type;
 			s64 offset = 0;
 			if(ident->variable_type == Variable_Type::parameter || ident->variable_type == Variable_Type::series
-				|| ident->variable_type == Variable_Type::connection_info || ident->variable_type == Variable_Type::index_count) {
+				|| ident->variable_type == Variable_Type::connection_info || ident->variable_type == Variable_Type::index_count
+				|| ident->variable_type == Variable_Type::solver_workspace) {
 				DEBUG(warning_print("lookup var offset.\n"))
 				offset = emulate_expression(expr->exprs[0], state, locals).val_integer;
 			}
@@ -269,6 +263,10 @@ emulate_expression(Math_Expr_FT *expr, Model_Run_State *state, Scope_Local_Vars<
 					result.val_integer = state->index_counts[offset];
 				} break;
 				
+				case Variable_Type::solver_workspace : {
+					result.val_real = state->solver_workspace[offset];
+				} break;
+				
 				#define TIME_VALUE(name, bits)\
 				case Variable_Type::time_##name : { \
 					val.val_integer = state->date_time.name; \
@@ -371,3 +369,401 @@ emulate_expression(Math_Expr_FT *expr, Model_Run_State *state, Scope_Local_Vars<
 	return {Parameter_Value(), Value_Type::unresolved};
 }
 
+
+// Dependency emulation.
+// This walks the code of an ODE batch in the same way as emulate_expression, but instead of computing values it only keeps track of which of the
+// ODE state variables each value could depend on. Integer and boolean values that don't depend on anything that can change between runs
+// (loop indexes, connection data, index counts, literals) are still computed exactly, so that we know which instance of each variable is accessed.
+// Parameters are treated as unknown, since they can be changed without recompiling the model.
+
+struct
+Dependency_Value {
+	bool          known = false;
+	Typed_Value   value;
+	std::set<int> deps;                    // Which ODE variables (counted from the first one in the batch) the value could depend on.
+	std::vector<Dependency_Value> elements; // Used if it is a tuple.
+};
+
+struct
+Dependency_Emulation {
+	s64 first_ode_offset;
+	int n_ode;
+	s32 *connection_info;
+	s64 connection_info_count;
+	s32 *index_counts;
+	s64 index_count_count;
+	
+	// What the state and temp vars written so far in the batch depend on, keyed by their offset.
+	std::unordered_map<s64, std::set<int>> state_var_deps;
+	std::unordered_map<s64, std::set<int>> temp_var_deps;
+	std::vector<std::set<int>>            *derivative_deps;
+	
+	std::set<int> control_deps;     // What the conditions of the branches we are currently inside depend on.
+	int           uncertain_depth = 0; // Larger than 0 if we are inside a branch that may or may not be taken.
+	std::set<s32> iterated_scopes;
+	bool          changed = false;
+	bool          failed  = false;
+};
+
+static bool
+merge_deps(std::set<int> &into, const std::set<int> &from) {
+	auto before = into.size();
+	into.insert(from.begin(), from.end());
+	return into.size() != before;
+}
+
+static Dependency_Value
+join(const Dependency_Value &a, const Dependency_Value &b) {
+	Dependency_Value result;
+	result.value = a.value;
+	result.known = a.known && b.known && (a.value.val_integer == b.value.val_integer);
+	if(!result.known) {
+		result.deps = a.deps;
+		result.deps.insert(b.deps.begin(), b.deps.end());
+	}
+	if(a.elements.size() == b.elements.size()) {
+		for(int idx = 0; idx < a.elements.size(); ++idx)
+			result.elements.push_back(join(a.elements[idx], b.elements[idx]));
+	}
+	return result;
+}
+
+static bool
+operator==(const Dependency_Value &a, const Dependency_Value &b) {
+	if(a.known != b.known || a.deps != b.deps || a.elements.size() != b.elements.size()) return false;
+	if(a.known && a.value.val_integer != b.value.val_integer) return false;
+	for(int idx = 0; idx < a.elements.size(); ++idx)
+		if(!(a.elements[idx] == b.elements[idx])) return false;
+	return true;
+}
+
+static Dependency_Value
+make_known(Typed_Value value) {
+	Dependency_Value result;
+	result.known = true;
+	result.value = value;
+	return result;
+}
+
+static Dependency_Value
+make_unknown(Value_Type type, const std::set<int> &deps = {}) {
+	Dependency_Value result;
+	result.value.type = type;
+	result.deps = deps;
+	return result;
+}
+
+static bool
+is_random(String_View fun_name) {
+	return fun_name == "uniform_real" || fun_name == "normal" || fun_name == "uniform_int";
+}
+
+Dependency_Value
+emulate_dependencies(Math_Expr_FT *expr, Dependency_Emulation *emul, Scope_Local_Vars<Dependency_Value> *locals);
+
+static Dependency_Value
+emulate_block_dependencies(Math_Block_FT *block, Dependency_Emulation *emul, Scope_Local_Vars<Dependency_Value> *new_locals, bool rerun) {
+	Dependency_Value result;
+	for(auto sub_expr : block->exprs) {
+		result = emulate_dependencies(sub_expr, emul, new_locals);
+		if(sub_expr->expr_type == Math_Expr_Type::local_var) {
+			auto local = static_cast<Local_Var_FT *>(sub_expr);
+			auto find = new_locals->values.find(local->id);
+			if(rerun && find != new_locals->values.end())
+				find->second = join(find->second, result);
+			else
+				new_locals->values[local->id] = result;
+		}
+	}
+	return result;
+}
+
+Dependency_Value
+emulate_dependencies(Math_Expr_FT *expr, Dependency_Emulation *emul, Scope_Local_Vars<Dependency_Value> *locals) {
+	if(!expr)
+		fatal_error(Mobius_Error::internal, "Got a nullptr expression in emulate_dependencies().");
+	
+	if(emul->failed) return make_unknown(expr->value_type);
+	
+	switch(expr->expr_type) {
+		case Math_Expr_Type::block : {
+			auto block = static_cast<Math_Block_FT *>(expr);
+			Dependency_Value result = make_unknown(Value_Type::none);
+			Scope_Local_Vars<Dependency_Value> new_locals;
+			new_locals.scope_id = block->unique_block_id;
+			new_locals.scope_up = locals;
+			if(!block->is_for_loop) {
+				result = emulate_block_dependencies(block, emul, &new_locals, false);
+				
+				// If the block was iterated on, run it again with everything that was reassigned merged with what it was before until
+				// nothing changes any more.
+				int n_reruns = 0;
+				while(emul->iterated_scopes.find(block->unique_block_id) != emul->iterated_scopes.end()) {
+					emul->iterated_scopes.erase(block->unique_block_id);
+					auto before = new_locals.values;
+					++emul->uncertain_depth;
+					result = join(result, emulate_block_dependencies(block, emul, &new_locals, true));
+					--emul->uncertain_depth;
+					if(new_locals.values == before) break;
+					emul->iterated_scopes.insert(block->unique_block_id);
+					if(++n_reruns > 100) {
+						emul->failed = true;
+						break;
+					}
+				}
+			} else {
+				auto n = emulate_dependencies(expr->exprs[0], emul, locals);
+				if(!n.known) {
+					emul->failed = true;
+					break;
+				}
+				for(s64 i = 0; i < n.value.val_integer; ++i) {
+					Typed_Value index;
+					index.type = Value_Type::integer;
+					index.val_integer = i;
+					new_locals.values[0] = make_known(index);
+					emulate_dependencies(expr->exprs[1], emul, &new_locals);
+				}
+			}
+			return result;
+		} break;
+		
+		case Math_Expr_Type::local_var : {
+			return emulate_dependencies(expr->exprs[0], emul, locals);
+		} break;
+		
+		case Math_Expr_Type::identifier : {
+			auto ident = static_cast<Identifier_FT *>(expr);
+			
+			switch(ident->variable_type) {
+				case Variable_Type::local : {
+					return find_local_var(locals, ident->local_var);
+				} break;
+				
+				case Variable_Type::connection_info :
+				case Variable_Type::index_count : {
+					auto offset = emulate_dependencies(expr->exprs[0], emul, locals);
+					bool is_conn = (ident->variable_type == Variable_Type::connection_info);
+					s64 count = is_conn ? emul->connection_info_count : emul->index_count_count;
+					if(!offset.known || offset.value.val_integer < 0 || offset.value.val_integer >= count)
+						return make_unknown(Value_Type::integer, offset.deps);
+					Typed_Value value;
+					value.type = Value_Type::integer;
+					value.val_integer = is_conn ? emul->connection_info[offset.value.val_integer] : emul->index_counts[offset.value.val_integer];
+					return make_known(value);
+				} break;
+				
+				case Variable_Type::series : {
+					if(ident->var_id.type == Var_Id::Type::series)
+						return make_unknown(Value_Type::real);
+					auto offset = emulate_dependencies(expr->exprs[0], emul, locals);
+					if(!offset.known) {
+						emul->failed = true;
+						break;
+					}
+					s64 offs = offset.value.val_integer;
+					if(ident->var_id.type == Var_Id::Type::state_var) {
+						if(offs >= emul->first_ode_offset && offs < emul->first_ode_offset + emul->n_ode)
+							return make_unknown(Value_Type::real, {(int)(offs - emul->first_ode_offset)});
+						auto find = emul->state_var_deps.find(offs);
+						if(find != emul->state_var_deps.end())
+							return make_unknown(Value_Type::real, find->second);
+					} else {
+						auto find = emul->temp_var_deps.find(offs);
+						if(find != emul->temp_var_deps.end())
+							return make_unknown(Value_Type::real, find->second);
+					}
+					// Computed before this batch, so it doesn't depend on the ODE variables.
+					return make_unknown(Value_Type::real);
+				} break;
+				
+				default : {
+					// Parameters and time values
+					return make_unknown(expr->value_type);
+				}
+			}
+		} break;
+		
+		case Math_Expr_Type::literal : {
+			auto literal = static_cast<Literal_FT *>(expr);
+			return make_known({literal->value, literal->value_type});
+		} break;
+		
+		case Math_Expr_Type::unary_operator : {
+			auto unary = static_cast<Operator_FT *>(expr);
+			auto a = emulate_dependencies(expr->exprs[0], emul, locals);
+			if(a.known)
+				return make_known(apply_unary(a.value, unary->oper));
+			return make_unknown(expr->value_type, a.deps);
+		} break;
+		
+		case Math_Expr_Type::binary_operator : {
+			auto binary = static_cast<Operator_FT *>(expr);
+			auto a = emulate_dependencies(expr->exprs[0], emul, locals);
+			auto b = emulate_dependencies(expr->exprs[1], emul, locals);
+			char op = (char)binary->oper;
+			bool div_zero = (op == '/' || op == '%') && (b.value.type == Value_Type::integer) && (b.value.val_integer == 0); // Could happen in a branch that is not taken.
+			if(a.known && b.known && !div_zero)
+				return make_known(apply_binary(a.value, b.value, binary->oper));
+			a.deps.insert(b.deps.begin(), b.deps.end());
+			return make_unknown(expr->value_type, a.deps);
+		} break;
+		
+		case Math_Expr_Type::function_call : {
+			auto fun = static_cast<Function_Call_FT *>(expr);
+			std::vector<Dependency_Value> args;
+			bool all_known = !is_random(fun->fun_name) && (fun->fun_type == Function_Type::intrinsic) && (expr->exprs.size() <= 2);
+			std::set<int> deps;
+			for(auto arg : expr->exprs) {
+				args.push_back(emulate_dependencies(arg, emul, locals));
+				all_known = all_known && args.back().known;
+				deps.insert(args.back().deps.begin(), args.back().deps.end());
+			}
+			if(all_known && args.size() == 1)
+				return make_known(apply_intrinsic(args[0].value, fun->fun_name));
+			else if(all_known && args.size() == 2)
+				return make_known(apply_intrinsic(args[0].value, args[1].value, fun->fun_name));
+			return make_unknown(expr->value_type, deps);
+		} break;
+		
+		case Math_Expr_Type::if_chain : {
+			Dependency_Value result;
+			bool has_result = false;
+			bool uncertain  = false;
+			auto control_before = emul->control_deps;
+			
+			auto emulate_branch = [&](Math_Expr_FT *branch) {
+				auto value = emulate_dependencies(branch, emul, locals);
+				result = has_result ? join(result, value) : value;
+				has_result = true;
+			};
+			
+			bool done = false;
+			for(int idx = 0; idx < expr->exprs.size()-1; idx+=2) {
+				auto cond = emulate_dependencies(expr->exprs[idx+1], emul, locals);
+				if(cond.known) {
+					if(!cond.value.val_boolean) continue;
+					emulate_branch(expr->exprs[idx]);
+					done = true;
+					break;
+				}
+				if(!uncertain) {
+					uncertain = true;
+					++emul->uncertain_depth;
+				}
+				emul->control_deps.insert(cond.deps.begin(), cond.deps.end());
+				emulate_branch(expr->exprs[idx]);
+			}
+			if(!done)
+				emulate_branch(expr->exprs.back());
+			
+			if(uncertain) {
+				--emul->uncertain_depth;
+				result.known = false;
+				result.deps.insert(emul->control_deps.begin(), emul->control_deps.end());
+			}
+			emul->control_deps = control_before;
+			
+			return result;
+		} break;
+		
+		case Math_Expr_Type::local_var_assignment : {
+			auto assign = static_cast<Assignment_FT *>(expr);
+			auto value = emulate_dependencies(expr->exprs[0], emul, locals);
+			if(emul->uncertain_depth > 0) {
+				value = join(find_local_var(locals, assign->local_var), value);
+				value.deps.insert(emul->control_deps.begin(), emul->control_deps.end());
+			}
+			replace_local_var(locals, assign->local_var, value);
+			return make_unknown(Value_Type::none);
+		} break;
+		
+		case Math_Expr_Type::state_var_assignment :
+		case Math_Expr_Type::derivative_assignment : {
+			auto assign = static_cast<Assignment_FT *>(expr);
+			auto offset = emulate_dependencies(expr->exprs[0], emul, locals);
+			auto value  = emulate_dependencies(expr->exprs[1], emul, locals);
+			if(!offset.known) {
+				emul->failed = true;
+				break;
+			}
+			value.deps.insert(emul->control_deps.begin(), emul->control_deps.end());
+			s64 offs = offset.value.val_integer;
+			if(expr->expr_type == Math_Expr_Type::derivative_assignment) {
+				if(offs < 0 || offs >= emul->n_ode)
+					fatal_error(Mobius_Error::internal, "Derivative index out of bounds in emulate_dependencies().");
+				emul->changed |= merge_deps((*emul->derivative_deps)[offs], value.deps);
+			} else if(assign->var_id.type == Var_Id::Type::state_var)
+				emul->changed |= merge_deps(emul->state_var_deps[offs], value.deps);
+			else
+				emul->changed |= merge_deps(emul->temp_var_deps[offs], value.deps);
+			return make_unknown(Value_Type::none);
+		} break;
+		
+		case Math_Expr_Type::cast : {
+			auto a = emulate_dependencies(expr->exprs[0], emul, locals);
+			if(a.known)
+				return make_known(apply_cast(a.value, expr->value_type));
+			return make_unknown(expr->value_type, a.deps);
+		} break;
+		
+		case Math_Expr_Type::iterate : {
+			auto iter = static_cast<Iterate_FT *>(expr);
+			emul->iterated_scopes.insert(iter->scope_id);
+			return make_unknown(Value_Type::none);
+		} break;
+		
+		case Math_Expr_Type::tuple : {
+			Dependency_Value result;
+			for(auto elem : expr->exprs)
+				result.elements.push_back(emulate_dependencies(elem, emul, locals));
+			return result;
+		} break;
+		
+		case Math_Expr_Type::access_tuple_element : {
+			auto access = static_cast<Access_Tuple_Element_FT *>(expr);
+			auto tuple = find_local_var(locals, access->tuple_id);
+			if(access->element_index < 0 || access->element_index >= tuple.elements.size())
+				fatal_error(Mobius_Error::internal, "Tuple element access out of bounds in emulate_dependencies().");
+			return tuple.elements[access->element_index];
+		} break;
+		
+		case Math_Expr_Type::no_op : {
+			return make_unknown(Value_Type::none);
+		} break;
+		
+		default : {
+			// NOTE: We don't know what external computations read and write, so we can't say anything about the sparsity.
+			emul->failed = true;
+		}
+	}
+	
+	return make_unknown(expr->value_type);
+}
+
+bool
+emulate_ode_dependencies(Math_Expr_FT *code, s64 first_ode_offset, int n_ode, s32 *connection_info, s64 connection_info_count,
+	s32 *index_counts, s64 index_count_count, std::vector<std::set<int>> &derivative_deps) {
+	
+	derivative_deps.clear();
+	derivative_deps.resize(n_ode);
+	
+	Dependency_Emulation emul;
+	emul.first_ode_offset      = first_ode_offset;
+	emul.n_ode                 = n_ode;
+	emul.connection_info       = connection_info;
+	emul.connection_info_count = connection_info_count;
+	emul.index_counts          = index_counts;
+	emul.index_count_count     = index_count_count;
+	emul.derivative_deps       = &derivative_deps;
+	
+	// NOTE: The batch could read something it writes later in the code, in which case the value is from the previous evaluation.
+	// Running it until nothing changes also catches those dependencies.
+	do {
+		emul.changed = false;
+		emulate_dependencies(code, &emul, nullptr);
+		if(emul.failed) return false;
+	} while(emul.changed);
+	
+	return true;
+}
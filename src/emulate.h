@@ -4,6 +4,9 @@
 
 #include "common_types.h"
 
+#include <set>
+#include <vector>
+
 #include "function_tree.h"
 
 struct Typed_Value : Parameter_Value {
@@ -36,4 +39,11 @@ struct Model_Run_State;
 Typed_Value
 emulate_expression(Math_Expr_FT *expr, Model_Run_State *state, Scope_Local_Vars<Typed_Value> *locals);
 
+// Find which of the n_ode ODE variables (starting at first_ode_offset in the state vars) each of the derivatives computed by the code of a solver batch
+// could depend on. Returns false if that could not be determined (e.g. because the code has external computations), in which case the
+// derivatives should be assumed to depend on all the variables.
+bool
+emulate_ode_dependencies(Math_Expr_FT *code, s64 first_ode_offset, int n_ode, s32 *connection_info, s64 connection_info_count,
+	s32 *index_counts, s64 index_count_count, std::vector<std::set<int>> &derivative_deps);
+
 #endif // MOBIUS_EMULATE_H
\ No newline at end of file
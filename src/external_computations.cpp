@@ -17,3 +17,12 @@ _special_test_(Value_Access *values) {
 	for(int idx = 0; idx < result.count; ++idx)
 		result.at(idx) = 5.0*par.at(idx);
 }
+
+// NOTE: Functions that the generated code calls by name have to be in here and not in llvm_jit.cpp, since precompiled code can be run with a
+// build that doesn't have llvm_jit.cpp (see MOBIUS_NO_LLVM).
+extern "C" DLLEXPORT double
+_test_fun_(double a) {
+	// Fibonacci
+	if(a <= 1.0) return 1.0;
+	return _test_fun_(a-1) + _test_fun_(a-2);
+}
@@ -5,6 +5,19 @@
 #include <codecvt>
 #include "file_utils.h"
 
+#ifdef _WIN32
+	#define WIN32_LEAN_AND_MEAN
+	#define NOMINMAX
+	#include <windows.h>
+	#include <winioctl.h>
+#else
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <dlfcn.h>
+#endif
+
 FILE *
 open_file(String_View file_name, String_View mode) {
 	// Wrapper to allow for non-ascii names on Windows. Assumes file_name is UTF8 formatted.
@@ -203,4 +216,201 @@ standardize_base_path(String_View path) {
 		new_path += '/';
 	
 	return new_path;
-}
\ No newline at end of file
+}
+
+#ifdef _WIN32
+
+static void
+set_mapped_file_size(Mapped_File *file, size_t size, const std::string &file_name) {
+	LARGE_INTEGER sz;
+	sz.QuadPart = size;
+	if(!SetFilePointerEx(file->file_handle, sz, nullptr, FILE_BEGIN) || !SetEndOfFile(file->file_handle))
+		fatal_error(Mobius_Error::file, "Unable to resize the file \"", file_name, "\" to ", size, " bytes.");
+}
+
+static void
+create_mapping(Mapped_File *file) {
+	DWORD protect = file->read_only ? PAGE_READONLY : PAGE_READWRITE;
+	file->map_handle = CreateFileMappingW(file->file_handle, nullptr, protect, (DWORD)((u64)file->size >> 32), (DWORD)(file->size & 0xffffffff), nullptr);
+	if(file->map_handle)
+		file->data = (char *)MapViewOfFile(file->map_handle, file->read_only ? FILE_MAP_READ : FILE_MAP_WRITE, 0, 0, 0);
+	if(!file->data)
+		fatal_error(Mobius_Error::file, "Unable to memory map a file (", file->size, " bytes).");
+}
+
+static void
+destroy_mapping(Mapped_File *file) {
+	if(file->data)       UnmapViewOfFile(file->data);
+	if(file->map_handle) CloseHandle(file->map_handle);
+	file->data = nullptr;
+	file->map_handle = nullptr;
+}
+
+Mapped_File *
+map_file(const std::string &file_name, size_t size, bool read_only, bool clear) {
+	auto file = new Mapped_File();
+	file->read_only = read_only;
+	
+	std::u16string filename16 = std::wstring_convert<std::codecvt_utf8_utf16<char16_t>, char16_t>{}.from_bytes(file_name.data(), file_name.data()+file_name.size());
+	DWORD access = read_only ? GENERIC_READ : (GENERIC_READ | GENERIC_WRITE);
+	// NOTE: A reader has to allow writing, or it can't open a file that a running model still has open for writing.
+	DWORD share  = read_only ? (FILE_SHARE_READ | FILE_SHARE_WRITE) : FILE_SHARE_READ;
+	file->file_handle = CreateFileW((wchar_t *)filename16.data(), access, share, nullptr, read_only ? OPEN_EXISTING : OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if(file->file_handle == INVALID_HANDLE_VALUE) {
+		delete file;
+		fatal_error(Mobius_Error::file, "Unable to open the file \"", file_name, "\" for memory mapping.");
+	}
+	
+	if(read_only) {
+		LARGE_INTEGER sz;
+		GetFileSizeEx(file->file_handle, &sz);
+		size = (size_t)sz.QuadPart;
+	} else {
+		// NOTE: NTFS only leaves unwritten space unallocated if we ask for it explicitly.
+		DWORD ret;
+		DeviceIoControl(file->file_handle, FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0, &ret, nullptr);
+		if(clear) set_mapped_file_size(file, 0, file_name);
+		set_mapped_file_size(file, size, file_name);
+	}
+	file->size = size;
+	if(size > 0) create_mapping(file);
+	return file;
+}
+
+void
+resize_mapped_file(Mapped_File *file, size_t size) {
+	if(file->read_only)
+		fatal_error(Mobius_Error::internal, "Tried to resize a read-only mapped file.");
+	destroy_mapping(file);
+	set_mapped_file_size(file, size, "");
+	file->size = size;
+	if(size > 0) create_mapping(file);
+}
+
+void
+flush_mapped_file(Mapped_File *file, size_t from, size_t to, bool wait) {
+	if(!file->data || file->read_only) return;
+	to = std::min(to, file->size);
+	if(to > from)
+		FlushViewOfFile(file->data + from, to - from);
+	if(wait)
+		FlushFileBuffers(file->file_handle);
+}
+
+void
+unmap_file(Mapped_File *file) {
+	if(!file) return;
+	destroy_mapping(file);
+	if(file->file_handle) CloseHandle(file->file_handle);
+	delete file;
+}
+
+void *
+load_shared_library(const std::string &file_name) {
+	std::u16string filename16 = std::wstring_convert<std::codecvt_utf8_utf16<char16_t>, char16_t>{}.from_bytes(file_name.data(), file_name.data()+file_name.size());
+	return (void *)LoadLibraryW((wchar_t *)filename16.data());
+}
+
+void *
+find_library_symbol(void *library, const std::string &symbol) {
+	return (void *)GetProcAddress((HMODULE)library, symbol.data());
+}
+
+std::string
+shared_library_error() {
+	DWORD code = GetLastError();
+	char *message = nullptr;
+	FormatMessageA(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS, nullptr, code, 0, (LPSTR)&message, 0, nullptr);
+	std::string result = message ? message : "";
+	if(message) LocalFree(message);
+	while(!result.empty() && (result.back() == '\n' || result.back() == '\r')) result.pop_back();
+	return result + " (error code " + std::to_string(code) + ")";
+}
+
+#else
+
+static void
+create_mapping(Mapped_File *file) {
+	int prot = file->read_only ? PROT_READ : (PROT_READ | PROT_WRITE);
+	void *data = mmap(nullptr, file->size, prot, MAP_SHARED, file->fd, 0);
+	if(data == MAP_FAILED)
+		fatal_error(Mobius_Error::file, "Unable to memory map a file (", file->size, " bytes).");
+	file->data = (char *)data;
+}
+
+Mapped_File *
+map_file(const std::string &file_name, size_t size, bool read_only, bool clear) {
+	auto file = new Mapped_File();
+	file->read_only = read_only;
+	
+	file->fd = open(file_name.data(), read_only ? O_RDONLY : (O_RDWR | O_CREAT), 0644);
+	if(file->fd < 0) {
+		delete file;
+		fatal_error(Mobius_Error::file, "Unable to open the file \"", file_name, "\" for memory mapping.");
+	}
+	
+	if(read_only) {
+		struct stat st;
+		fstat(file->fd, &st);
+		size = (size_t)st.st_size;
+	} else if((clear && ftruncate(file->fd, 0) != 0) || ftruncate(file->fd, size) != 0) {
+		close(file->fd);
+		delete file;
+		fatal_error(Mobius_Error::file, "Unable to resize the file \"", file_name, "\" to ", size, " bytes.");
+	}
+	file->size = size;
+	if(size > 0) create_mapping(file);
+	return file;
+}
+
+void
+resize_mapped_file(Mapped_File *file, size_t size) {
+	if(file->read_only)
+		fatal_error(Mobius_Error::internal, "Tried to resize a read-only mapped file.");
+	if(file->data) munmap(file->data, file->size);
+	file->data = nullptr;
+	if(ftruncate(file->fd, size) != 0)
+		fatal_error(Mobius_Error::file, "Unable to resize a memory mapped file to ", size, " bytes.");
+	file->size = size;
+	if(size > 0) create_mapping(file);
+}
+
+void
+flush_mapped_file(Mapped_File *file, size_t from, size_t to, bool wait) {
+	if(!file->data || file->read_only) return;
+	static size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+	from -= from % page_size;  // msync requires the address to be page aligned.
+	to = std::min(to, file->size);
+	if(to > from)
+		msync(file->data + from, to - from, wait ? MS_SYNC : MS_ASYNC);
+}
+
+void
+unmap_file(Mapped_File *file) {
+	if(!file) return;
+	if(file->data) munmap(file->data, file->size);
+	if(file->fd >= 0) close(file->fd);
+	delete file;
+}
+
+void *
+load_shared_library(const std::string &file_name) {
+	// NOTE: dlopen only looks in the system library paths if there is no slash in the name.
+	std::string path = file_name;
+	if(path.find('/') == std::string::npos)
+		path = "./" + path;
+	return dlopen(path.data(), RTLD_NOW | RTLD_LOCAL);
+}
+
+void *
+find_library_symbol(void *library, const std::string &symbol) {
+	return dlsym(library, symbol.data());
+}
+
+std::string
+shared_library_error() {
+	const char *message = dlerror();
+	return message ? message : "";
+}
+
+#endif
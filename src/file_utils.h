@@ -30,6 +30,48 @@ standardize_base_path(String_View path);
 bool
 bottom_directory_is(String_View path, String_View directory);
 
+struct
+Mapped_File {
+	char   *data = nullptr;
+	size_t  size = 0;
+	bool    read_only = false;
+#ifdef _WIN32
+	void   *file_handle = nullptr;
+	void   *map_handle  = nullptr;
+#else
+	int     fd = -1;
+#endif
+};
+
+// Map a file into memory. If it is not read_only, the file is created if it doesn't exist, and resized to the given size (new space reads as zeros and
+// is not allocated on disk before it is written to, if the file system supports sparse files). If read_only, the size is that of the existing file.
+Mapped_File *
+map_file(const std::string &file_name, size_t size, bool read_only, bool clear = false);
+
+// Resize a writable mapping. Note that the data pointer can move.
+void
+resize_mapped_file(Mapped_File *file, size_t size);
+
+// Write a range of the mapped memory back to the file. If !wait, this only schedules the write.
+void
+flush_mapped_file(Mapped_File *file, size_t from, size_t to, bool wait);
+
+void
+unmap_file(Mapped_File *file);
+
+// Load a shared library (.dll or .so). Returns nullptr if it could not be loaded. The library is never unloaded, since functions from it can be in
+// use until the process exits.
+void *
+load_shared_library(const std::string &file_name);
+
+// Returns nullptr if the library doesn't have the symbol.
+void *
+find_library_symbol(void *library, const std::string &symbol);
+
+// The reason the last load_shared_library call failed, as reported by the system.
+std::string
+shared_library_error();
+
 struct
 File_Data_Handler {
 
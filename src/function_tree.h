@@ -29,10 +29,11 @@ Math_Block_FT : Math_Expr_FT {
 	s32 unique_block_id;
 	int n_locals;
 	bool is_for_loop;
+	bool is_parallel;  // Only for for loops: The iterations don't interact, so they can be run on separate threads.
 	std::string iter_tag;
 	
 	void set_id();
-	Math_Block_FT() : Math_Expr_FT(Math_Expr_Type::block), n_locals(0), is_for_loop(false) { set_id(); };
+	Math_Block_FT() : Math_Expr_FT(Math_Expr_Type::block), n_locals(0), is_for_loop(false), is_parallel(false) { set_id(); };
 };
 
 
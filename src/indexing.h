@@ -33,7 +33,10 @@ Multi_Array_Structure<Handle_T>::get_stride(Handle_T handle) {
 template<typename Handle_T> s64
 Multi_Array_Structure<Handle_T>::get_offset(Handle_T handle, Indexes &indexes, Model_Application *app) {
 	
-	s64 offset = handle_location[handle];
+	// NOTE: The instances of each handle are stored in a block of size block_size, which can be larger than the instance count (see
+	// Storage_Structure::set_up).
+	s64 offset = 0;
+	s64 base = begin_offset + handle_location[handle]*block_size;
 	
 	//TODO: Refactor this to make better use of the new index data system!
 	if(indexes.lookup_ordered) {
@@ -49,7 +52,7 @@ Multi_Array_Structure<Handle_T>::get_offset(Handle_T handle, Indexes &indexes, M
 			offset += (s64)index.index;
 			++idx;
 		}
-		return offset + begin_offset;
+		return offset + base;
 	} else {
 
 		for(auto &index_set : index_sets) {
@@ -58,14 +61,14 @@ Multi_Array_Structure<Handle_T>::get_offset(Handle_T handle, Indexes &indexes, M
 			offset *= (s64)app->index_data.get_max_count(index_set).index;
 			offset += (s64)index.index;
 		}
-		return offset + begin_offset;
+		return offset + base;
 	}
 }
 
 template<typename Handle_T> Math_Expr_FT *
 Multi_Array_Structure<Handle_T>::get_offset_code(Handle_T handle, Index_Exprs &indexes, Model_Application *app, Entity_Id &err_idx_set_out) {
 	
-	Math_Expr_FT *result = make_literal((s64)handle_location[handle]);
+	Math_Expr_FT *result = nullptr;
 	int sz = index_sets.size();
 	for(int idx = 0; idx < index_sets.size(); ++idx) {
 		auto &index_set = index_sets[idx];
@@ -77,11 +80,15 @@ Multi_Array_Structure<Handle_T>::get_offset_code(Handle_T handle, Index_Exprs &i
 			return nullptr;
 		}
 		
-		result = make_binop('*', result, make_literal((s64)app->index_data.get_max_count(index_set).index));
-		result = make_binop('+', result, index);
+		if(result) {
+			result = make_binop('*', result, make_literal((s64)app->index_data.get_max_count(index_set).index));
+			result = make_binop('+', result, index);
+		} else
+			result = index;
 	}
-	result = make_binop('+', result, make_literal((s64)begin_offset));
-	return result;
+	auto base = make_literal((s64)(begin_offset + handle_location[handle]*block_size));
+	if(!result) return base;
+	return make_binop('+', result, base);
 }
 
 template<typename Handle_T> Offset_Stride_Code
@@ -89,7 +96,7 @@ Multi_Array_Structure<Handle_T>::get_special_offset_stride_code(Handle_T handle,
 	
 	Offset_Stride_Code result = {};
 	
-	result.offset = make_literal((s64)handle_location[handle]);
+	result.offset = make_literal((s64)0);
 
 	s64 stride = 1;
 	bool undetermined_found = false;
@@ -128,7 +135,7 @@ Multi_Array_Structure<Handle_T>::get_special_offset_stride_code(Handle_T handle,
 	}
 	if(!result.count)
 		result.count  = make_literal((s64)1);
-	result.offset = make_binop('+', result.offset, make_literal((s64)begin_offset));
+	result.offset = make_binop('+', result.offset, make_literal((s64)(begin_offset + handle_location[handle]*block_size)));
 	result.stride = make_literal(stride);
 
 	return result;
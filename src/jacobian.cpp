@@ -1,91 +1,177 @@
+#include "ode_solvers.h"
 
-#include "run_model.h"
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
 
-// Attempt at very simple estimate of jacobian matrix.
-// However, it is very inefficient as it computes very many terms that will always be 0...
+// Forward difference estimate of the Jacobian matrix, or the exact Jacobian if code for it could be generated for the batch.
+// If the sparsity pattern is known, columns that don't have nonzeros in the same rows are perturbed together, so that we only need one evaluation
+// of the right hand side per group of columns instead of one per column (Curtis, Powell and Reid 1974). For models with many index set instances
+// the groups are typically much fewer than the columns, since each instance only interacts with a few others.
 
 void
-estimate_jacobian(batch_function *fun, Model_Run_state *run_state, double t, double *x, s64 N, s64 Nstate, s64 Ntemp, s64 ode_offset, double *temp_storage) {
+set_up_jacobian_sparsity(Jacobian_Sparsity *sparsity, const std::vector<std::set<int>> &derivative_deps) {
 	
-	double *fbasevec = temp_storage;
-	double *state = fbasevec + N;
-	double *tempstate = state + Nstate;
+	int n = derivative_deps.size();
 	
-	// Create a copy of the state to work with
-	for(s64 i = 0; i < Nstate; ++i) {
-		state[i] = run_state->state_vars[i];
+	std::vector<std::vector<int>> col_rows(n);
+	for(int row = 0; row < n; ++row) {
+		for(int col : derivative_deps[row])
+			col_rows[col].push_back(row);
 	}
-	for(s64 i = 0; i < Ntemp; ++i) {
-		tempstate[i] = run_state->temp_vars[i];
+	
+	sparsity->col_start.clear();
+	sparsity->rows.clear();
+	for(int col = 0; col < n; ++col) {
+		sparsity->col_start.push_back(sparsity->rows.size());
+		sparsity->rows.insert(sparsity->rows.end(), col_rows[col].begin(), col_rows[col].end());
 	}
+	sparsity->col_start.push_back(sparsity->rows.size());
 	
+	// Greedy colouring: Give each column the lowest group that doesn't already have a column with a nonzero in any of the same rows.
+	std::vector<int> col_group(n, -1);
+	std::vector<int> used_by(n, -1); // Which column last marked the group as taken.
+	int n_groups = 0;
+	for(int col = 0; col < n; ++col) {
+		for(int row : col_rows[col]) {
+			for(int other : derivative_deps[row]) {
+				if(col_group[other] >= 0)
+					used_by[col_group[other]] = col;
+			}
+		}
+		int group = 0;
+		while(used_by[group] == col) ++group;
+		col_group[col] = group;
+		n_groups = std::max(n_groups, group+1);
+	}
 	
-	// Set the state of the ODE variables to be at the base point
-	// (note, ODE variables are never in temp_vars).
-	for(s64 i = 0; i < N; ++i) {
-		state[i + ode_offset] = x[i];
-	}		
-	
-	fun(
-		reinterpret_cast<double *>(run_state->parameters), 
-		run_state->series, 
-		state, 
-		tempstate,
-		run_state->asserts,
-		run_state->solver_workspace, 
-		&run_state->date_time,
-		&run_state->rand_state,
-		t
-	);
-	
-	// Store the derivatives at the base point
-	for(s64 i = 0; i < N; ++i) {
-		fbasevec[i] = run_state->solver_workspace[i];
+	sparsity->group_start.clear();
+	sparsity->group_cols.clear();
+	for(int group = 0; group < n_groups; ++group) {
+		sparsity->group_start.push_back(sparsity->group_cols.size());
+		for(int col = 0; col < n; ++col)
+			if(col_group[col] == group) sparsity->group_cols.push_back(col);
 	}
+	sparsity->group_start.push_back(sparsity->group_cols.size());
+}
+
+inline double
+perturbation(double x) {
+	const double sqrt_eps = std::sqrt(DBL_EPSILON);
+	// NOTE: The 0.001 is the same as the floor of the error scale in the solvers, so that we don't use unnecessarily small perturbations of
+	// values that are close to 0.
+	volatile double temp = x + sqrt_eps*std::max(std::abs(x), 0.001);
+	return temp - x; // Attempt to improve numerical accuracy by making dx exactly representable.
+}
+
+static void
+exact_jacobian(double *J, int n, double *x0, Model_Run_State *run_state, double t) {
+	
+	// The generated function computes the derivatives in the direction we put in the tangents of the ODE variables (see differentiation.cpp).
+	// Like for the estimate, we can compute several columns at a time if they don't have nonzeros in the same rows.
+	double *ws = run_state->jacobian_workspace;
+	double *dx = ws + run_state->jacobian_state_offset + (x0 - run_state->state_vars);
+	double *df = ws + run_state->jacobian_output_offset;
+	
+	double *solver_workspace = run_state->solver_workspace;
+	run_state->solver_workspace = ws;
 	
-	double h0 = std::numeric_limits<double>::infinity();
-	for(s64 i = 0; i < N; ++i)
-		h0 = std::min(std::max(1e-6*x[i], 1e-9), h0);
+	auto sparsity = run_state->jacobian_sparsity;
 	
-	for(s64 i = 0; i < N; ++i) {
+	if(!sparsity || sparsity->empty()) {
+		for(int col = 0; col < n; ++col) {
+			dx[col] = 1.0;
+			call_fun(run_state->jacobian_fun, run_state, t);
+			++run_state->rhs_evaluations;
+			for(int row = 0; row < n; ++row)
+				J[row*n + col] = df[row];
+			dx[col] = 0.0;
+		}
+	} else {
+		for(int idx = 0; idx < n*n; ++idx) J[idx] = 0.0;
 		
-		// Reset the state (TODO: Maybe unnecessary??)
-		for(s64 j = 0; j < Nstate; ++j) {
-			state[j] = run_state->state_vars[j];
+		int n_groups = (int)sparsity->group_start.size() - 1;
+		for(int group = 0; group < n_groups; ++group) {
+			int first = sparsity->group_start[group];
+			int last  = sparsity->group_start[group+1];
+			for(int idx = first; idx < last; ++idx)
+				dx[sparsity->group_cols[idx]] = 1.0;
+			
+			call_fun(run_state->jacobian_fun, run_state, t);
+			++run_state->rhs_evaluations;
+			
+			for(int idx = first; idx < last; ++idx) {
+				int col = sparsity->group_cols[idx];
+				for(int r = sparsity->col_start[col]; r < sparsity->col_start[col+1]; ++r) {
+					int row = sparsity->rows[r];
+					J[row*n + col] = df[row];
+				}
+				dx[col] = 0.0;
+			}
 		}
-		for(s64 j = 0; j < Ntemp; ++j) {
-			tempstate[j] = run_state->temp_vars[j];
+	}
+	
+	run_state->solver_workspace = solver_workspace;
+}
+
+void
+estimate_jacobian(double *J, const double *f0, int n, double *x0, Model_Run_State *run_state, batch_function ode_fun, double t) {
+	
+	if(run_state->jacobian_fun) {
+		exact_jacobian(J, n, x0, run_state, t);
+		return;
+	}
+	
+	double *wk = run_state->solver_workspace; // The batch function writes the derivatives here.
+	
+	auto sparsity = run_state->jacobian_sparsity;
+	
+	if(!sparsity || sparsity->empty()) {
+		for(int col = 0; col < n; ++col) {
+			double x = x0[col];
+			double dx = perturbation(x);
+			x0[col] = x + dx;
+			
+			call_fun(ode_fun, run_state, t);
+			++run_state->rhs_evaluations;
+			
+			for(int row = 0; row < n; ++row)
+				J[row*n + col] = (wk[row] - f0[row]) / dx;
+			
+			x0[col] = x;
 		}
+		return;
+	}
+	
+	for(int idx = 0; idx < n*n; ++idx) J[idx] = 0.0;
+	
+	int n_groups = (int)sparsity->group_start.size() - 1;
+	for(int group = 0; group < n_groups; ++group) {
+		int first = sparsity->group_start[group];
+		int last  = sparsity->group_start[group+1];
 		
-		// Set the ODE variables to be at the base point, but permute variable i to estimate derivatives in that direction.
-		for(s64 j = 0; j < N; ++j) {
-			state[j + ode_offset] = x[j];
+		// NOTE: We store the unperturbed value on the diagonal of J while we evaluate. It is not overwritten by the other columns of the group since
+		// each column has its own diagonal entry, and we read it back before the column is filled in.
+		for(int idx = first; idx < last; ++idx) {
+			int col = sparsity->group_cols[idx];
+			double x = x0[col];
+			J[col*n + col] = x;
+			x0[col] = x + perturbation(x);
 		}
 		
-		// Note: attempt to improve numerical accuracy of adding h0 to xi
-		volatile double temp = x[i] + h0;
-		double h = temp - x[i];
-		state[i + ode_offset] = x[i] + h;
-			
-		fun(
-			reinterpret_cast<double *>(run_state->parameters), 
-			run_state->series, 
-			state, 
-			tempstate,
-			run_state->asserts,
-			run_state->solver_workspace, 
-			&run_state->date_time,
-			&run_state->rand_state,
-			t
-		);
+		call_fun(ode_fun, run_state, t);
+		++run_state->rhs_evaluations;
 		
-		for(s64 j = 0; j < N; ++j) {
-			double fbase = fbasevec[j];
-			double fpermute = run_state->solver_workspace[j];
-			double derivative = (fpermute - fbase) / h;
-			
-			// TODO; insert into jacobi matrix the value "derivative" at row j and column i.
+		for(int idx = first; idx < last; ++idx) {
+			int col = sparsity->group_cols[idx];
+			double x = J[col*n + col];
+			double dx = x0[col] - x;
+			J[col*n + col] = 0.0;
+			for(int r = sparsity->col_start[col]; r < sparsity->col_start[col+1]; ++r) {
+				int row = sparsity->rows[r];
+				J[row*n + col] = (wk[row] - f0[row]) / dx;
+			}
+			x0[col] = x;
 		}
 	}
-
-}
\ No newline at end of file
+}
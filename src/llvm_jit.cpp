@@ -1,6 +1,4 @@
 
-#include <random>
-
 #include "../third_party/kaleidoscope/KaleidoscopeJIT.h"
 #include "llvm/ADT/APFloat.h"
 #include "llvm/ADT/STLExtras.h"
@@ -14,6 +12,7 @@
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Transforms/InstCombine/InstCombine.h"
@@ -29,6 +28,11 @@
 
 #include "llvm/MC/TargetRegistry.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Config/llvm-config.h"
 //#include "llvm/Support/Host.h"
 //#include "llvm/Support/TargetSelect.h"
 //#include "llvm/Support/raw_ostream.h"
@@ -41,35 +45,10 @@
 
 #include "llvm_jit.h"
 #include "external_computations.h"
+#include "worker_pool.h"
 
-
-extern "C" DLLEXPORT double
-_test_fun_(double a) {
-	// Fibonacci
-	if(a <= 1.0) return 1.0;
-	return _test_fun_(a-1) + _test_fun_(a-2);
-}
-
-extern "C" DLLEXPORT double
-_uniform_random_real_(void *rand_state, double mn, double mx) {
-	std::mt19937 *gen = reinterpret_cast<std::mt19937 *>(rand_state);
-	std::uniform_real_distribution<double> dist(mn, mx);
-	return dist(*gen);
-}
-
-extern "C" DLLEXPORT double
-_normal_random_real_(void *rand_state, double m, double s) {
-	std::mt19937 *gen = reinterpret_cast<std::mt19937 *>(rand_state);
-	std::normal_distribution<double> dist(m, s);
-	return dist(*gen);
-}
-
-extern "C" DLLEXPORT s64
-_uniform_random_int_(void *rand_state, s64 mn, s64 mx) {
-	std::mt19937 *gen = reinterpret_cast<std::mt19937 *>(rand_state);
-	std::uniform_int_distribution<s64> dist(mn, mx);
-	return dist(*gen);
-}
+#include <atomic>
+#include <unordered_map>
 
 
 #define ADD_EXT_COMP(name) extern "C" DLLEXPORT void name(Value_Access *values);
@@ -77,7 +56,53 @@ _uniform_random_int_(void *rand_state, s64 mn, s64 mx) {
 #undef ADD_EXT_COMP
 
 
+// Compiled modules can be stored on disk so that a model that was compiled before doesn't have to be optimized and compiled again (see
+// jit_compile_module). The identifier of a module that should be cached is set to the prefix followed by the path of its object file.
+static const std::string cached_module_prefix = "mobius2_cached:";
+
+static std::string
+cached_object_path(const llvm::Module *module) {
+	const std::string &id = module->getModuleIdentifier();
+	if(id.rfind(cached_module_prefix, 0) != 0) return "";
+	return id.substr(cached_module_prefix.size());
+}
+
+struct
+Mobius_Object_Cache : llvm::ObjectCache {
+	
+	void
+	notifyObjectCompiled(const llvm::Module *module, llvm::MemoryBufferRef obj) override {
+		std::string path = cached_object_path(module);
+		if(path.empty()) return;
+		
+		// Write to a temporary file first so that other processes that use the same cache never see a partially written object.
+		int fd;
+		llvm::SmallString<256> tmp_path;
+		if(llvm::sys::fs::createUniqueFile(path + ".%%%%%%.tmp", fd, tmp_path)) {
+			log_print("Unable to write to the JIT cache \"", path, "\".\n");
+			return;
+		}
+		{
+			llvm::raw_fd_ostream out(fd, true);
+			out << obj.getBuffer();
+		}
+		if(llvm::sys::fs::rename(tmp_path, path))
+			llvm::sys::fs::remove(tmp_path);
+	}
+	
+	std::unique_ptr<llvm::MemoryBuffer>
+	getObject(const llvm::Module *module) override {
+		std::string path = cached_object_path(module);
+		if(path.empty()) return nullptr;
+		
+		auto buffer = llvm::MemoryBuffer::getFile(path);
+		if(!buffer) return nullptr;
+		return std::move(*buffer);
+	}
+};
+
 static bool llvm_initialized = false;
+static Mobius_Object_Cache object_cache;
 static std::unique_ptr<llvm::orc::KaleidoscopeJIT> global_jit;
 
 void
@@ -88,7 +113,7 @@ initialize_llvm() {
 	llvm::InitializeNativeTargetAsmPrinter();
 	llvm::InitializeNativeTargetAsmParser();
 	
-	auto result = llvm::orc::KaleidoscopeJIT::Create();
+	auto result = llvm::orc::KaleidoscopeJIT::Create(&object_cache);
 	if(result)
 		global_jit = std::move(*result);
 	else
@@ -116,6 +141,17 @@ initialize_llvm() {
 	// TODO: Handle error
 	llvm::Error err = jd.define(materializer);
 #endif
+
+	{
+		// The functions called by the step loop are not exported, so they must be added manually on all platforms.
+		auto &jd = global_jit->getMainJITDylib();
+		auto mangle = llvm::orc::MangleAndInterner(jd.getExecutionSession(), global_jit->getDataLayout());
+		llvm::orc::SymbolMap symbol_map;
+		symbol_map[mangle("_solver_batch_step_")] = llvm::orc::ExecutorSymbolDef(llvm::orc::ExecutorAddr::fromPtr(&_solver_batch_step_), llvm::JITSymbolFlags());
+		symbol_map[mangle("_advance_date_time_")] = llvm::orc::ExecutorSymbolDef(llvm::orc::ExecutorAddr::fromPtr(&_advance_date_time_), llvm::JITSymbolFlags());
+		symbol_map[mangle("_parallel_for_")] = llvm::orc::ExecutorSymbolDef(llvm::orc::ExecutorAddr::fromPtr(&_parallel_for_), llvm::JITSymbolFlags());
+		llvm::Error err = jd.define(llvm::orc::absoluteSymbols(symbol_map));
+	}
 	
 	llvm_initialized = true;
 }
@@ -126,6 +162,7 @@ LLVM_Module_Data {
 	std::unique_ptr<llvm::Module>              module;
 	std::unique_ptr<llvm::IRBuilder<>>         builder;
 	llvm::orc::ResourceTrackerSP               resource_tracker;
+	int                                        module_instance;   // See instance_dylib.
 	
 	std::unique_ptr<llvm::TargetLibraryInfoImpl> libinfoimpl;
 	std::unique_ptr<llvm::TargetLibraryInfo>     libinfo;
@@ -135,15 +172,20 @@ LLVM_Module_Data {
 	
 	llvm::Type                                *dt_struct_type;
 	llvm::FunctionType                        *batch_fun_type;
+	
+	bool                                       aligned_data = false;
+	llvm::MDNode                              *tbaa_root = nullptr;
+	std::unordered_map<std::string, llvm::MDNode *> tbaa_tags;  // See set_access_tag
 };
 
 LLVM_Module_Data *
-create_llvm_module() {
+create_llvm_module(int module_instance) {
 	
 	if(!llvm_initialized)
 		fatal_error(Mobius_Error::internal, "Tried to create LLVM module before the JIT was initialized.");
 	
 	LLVM_Module_Data *data = new LLVM_Module_Data();
+	data->module_instance = module_instance;
 	
 	data->context = std::make_unique<llvm::LLVMContext>();
 	data->module  = std::make_unique<llvm::Module>("Mobius2 batch JIT", *data->context);
@@ -223,14 +265,27 @@ create_llvm_module() {
 	return data;
 }
 
-void
-jit_compile_module(LLVM_Module_Data *data, std::string *output_string) {
+// The JIT compiles for the host CPU so that the optimizer and code generator can use all of its vector instructions. Exported code is for the
+// generic CPU of the target instead, so that it can be used on other machines.
+static llvm::orc::JITTargetMachineBuilder
+target_machine_builder(bool for_host) {
+	
+	if(for_host) {
+		auto jtmb = llvm::orc::JITTargetMachineBuilder::detectHost();
+		if(jtmb) return std::move(*jtmb);
+		llvm::consumeError(jtmb.takeError());
+	}
+	return llvm::orc::JITTargetMachineBuilder(global_jit->getTargetTriple());
+}
+
+static void
+optimize_module(LLVM_Module_Data *data, llvm::TargetMachine *target_machine) {
 	
 	// It seems like forcing vectorization does not improve the speed of most models.
 	// Probably since we could only go 2-4 wide with float64 on most currently common architectures?
 	// Also, it may not be good at vectorizing branches using masks.
-	// There is also the issue that the base ptr of each individual state variable is not necessarily aligned (even if the whole vector is).
-	// So we would need to do a lot of work to make it efficient.
+	// There is also the issue that the base ptr of each individual state variable is not necessarily aligned (even if the whole vector is),
+	// unless the model is configured with aligned_storage.
 	//llvm::VectorizerParams::VectorizationFactor = 4;
 	
 
@@ -240,7 +295,13 @@ jit_compile_module(LLVM_Module_Data *data, std::string *output_string) {
 	llvm::CGSCCAnalysisManager    cgam;
 	llvm::ModuleAnalysisManager   mam;
 
-	llvm::PassBuilder pb;
+	// NOTE: Without the TargetMachine the passes use a default cost model that doesn't know of any vector registers, so the loop vectorizer
+	// never vectorizes anything.
+	llvm::PassBuilder pb(target_machine);
+	
+	// These have to be registered before the default analyses, since the first registration of an analysis is the one that is used.
+	fam.registerPass([&] { return target_machine->getTargetIRAnalysis(); });
+	fam.registerPass([&] { return llvm::TargetLibraryAnalysis(*data->libinfoimpl); });
 
 	pb.registerModuleAnalyses(mam);
 	pb.registerCGSCCAnalyses(cgam);
@@ -250,26 +311,185 @@ jit_compile_module(LLVM_Module_Data *data, std::string *output_string) {
 
 	llvm::ModulePassManager mpm = pb.buildPerModuleDefaultPipeline(llvm::OptimizationLevel::O2);
 	mpm.run(*data->module, mam);
+}
+
+static std::unique_ptr<llvm::MemoryBuffer>
+find_cached_object(LLVM_Module_Data *data, const std::string &cache_path, llvm::orc::JITTargetMachineBuilder &jtmb) {
+	
+	// The key is a hash of the unoptimized IR. It contains everything the compiled code depends on, like the model equations, the index
+	// set structure and the constants that are baked into the code, so we don't have to track all of those separately. The code is compiled
+	// for the host CPU, so that is part of the key too, in case the cache directory is shared between machines.
+	// NOTE: The names in the IR don't depend on the module instance (see instance_dylib), so the same model gets the same key every time.
+	std::string ir_text;
+	llvm::raw_string_ostream os(ir_text);
+	os << LLVM_VERSION_STRING << "\n" << jtmb.getCPU() << "\n" << jtmb.getFeatures().getString() << "\n" << *data->module;
+	os.flush();
+	auto hash = llvm::SHA1::hash(llvm::ArrayRef<uint8_t>((const uint8_t *)ir_text.data(), ir_text.size()));
+	
+	if(llvm::sys::fs::create_directories(cache_path)) {
+		log_print("Unable to create the JIT cache directory \"", cache_path, "\".\n");
+		return nullptr;
+	}
+	llvm::SmallString<256> path(cache_path);
+	llvm::sys::path::append(path, llvm::toHex(hash, true) + ".o");
 	
-	if(output_string) {
-		std::string module_ir_text;
-		llvm::raw_string_ostream os(module_ir_text);
+	// This makes the object cache store the object when the module is compiled, if it isn't found now.
+	data->module->setModuleIdentifier(cached_module_prefix + path.str().str());
+	
+	return object_cache.getObject(data->module.get());
+}
+
+struct
+Module_Compile_Job {
+	LLVM_Module_Data                    *data;
+	std::unique_ptr<llvm::MemoryBuffer>  object;
+	std::string                          ir_text;
+	std::string                          error;
+};
+
+struct
+Module_Compile_Context {
+	std::vector<Module_Compile_Job> jobs;
+	std::atomic<s64>                next_job;
+	bool                            keep_ir;
+	bool                            optimize;
+	std::string                     cache_path;
+};
+
+static llvm::orc::JITDylib &
+instance_dylib(int module_instance) {
+	// The modules from each compilation of a model application go in their own JITDylib, so the function names only have to be unique within
+	// one of them. Several applications can then be compiled in the same process (or the same one twice) with the same names, and the same
+	// cached objects.
+	return global_jit->getOrCreateJITDylib(std::string("mobius_instance_") + std::to_string(module_instance));
+}
+
+static void
+compile_module_object(Module_Compile_Job *job, Module_Compile_Context *compile) {
+	
+	auto data = job->data;
+	
+	// NOTE: Each module gets its own TargetMachine, so several modules can be compiled at the same time.
+	auto jtmb = target_machine_builder(true);
+	if(!compile->optimize)
+		jtmb.setCodeGenOptLevel(llvm::CodeGenOptLevel::None);
+	
+	// If we want to print the IR, we need the optimized module, so we don't use the cache then.
+	if(!compile->cache_path.empty() && !compile->keep_ir && compile->optimize)
+		job->object = find_cached_object(data, compile->cache_path, jtmb);
+	if(job->object) return;
+	
+	if(compile->optimize) {
+		auto target_machine = jtmb.createTargetMachine();
+		if(!target_machine) {
+			job->error = llvm::toString(target_machine.takeError());
+			return;
+		}
+		optimize_module(data, target_machine->get());
+	}
+	
+	if(compile->keep_ir) {
+		llvm::raw_string_ostream os(job->ir_text);
 		os << *data->module;
-		*output_string = os.str();
+		os.flush();
 	}
+	
+	// NOTE: This also stores the object in the cache if the module identifier was set by find_cached_object.
+	llvm::orc::ConcurrentIRCompiler compiler(std::move(jtmb), &object_cache);
+	auto object = compiler(*data->module);
+	if(object)
+		job->object = std::move(*object);
+	else
+		job->error = llvm::toString(object.takeError());
+}
+
+static void
+compile_module_range(void *context, s64 first, s64 last) {
+	// The modules can have very different sizes, so instead of doing the given range, each thread takes the next module that is not
+	// started yet until there are none left.
+	auto compile = reinterpret_cast<Module_Compile_Context *>(context);
+	s64 count = compile->jobs.size();
+	for(s64 idx = compile->next_job++; idx < count; idx = compile->next_job++)
+		compile_module_object(&compile->jobs[idx], compile);
+}
 
-	data->resource_tracker = global_jit->getMainJITDylib().createResourceTracker();
-	auto tsm = llvm::orc::ThreadSafeModule(std::move(data->module), std::move(data->context));
-	auto maybe_error = global_jit->addModule(std::move(tsm), data->resource_tracker);
-	if(maybe_error) {
-		std::string errstr;
-		llvm::raw_string_ostream errstream(errstr);
-		errstream << maybe_error;
-		fatal_error(Mobius_Error::internal, "Failed to jit compile module: ", errstream.str(), " .");
+void
+jit_compile_modules(const std::vector<LLVM_Module_Data *> &modules, std::string *output_string, const std::string &cache_path, bool optimize, bool parallel) {
+	
+	Module_Compile_Context compile;
+	compile.next_job   = 0;
+	compile.keep_ir    = (output_string != nullptr);
+	compile.optimize   = optimize;
+	compile.cache_path = cache_path;
+	for(auto data : modules)
+		compile.jobs.push_back({data});
+	
+	if(parallel)
+		global_worker_pool()->parallel_for(compile_module_range, &compile, compile.jobs.size());
+	else
+		compile_module_range(&compile, 0, compile.jobs.size());
+	
+	if(output_string) {
+		output_string->clear();
+		for(auto &job : compile.jobs)
+			*output_string += job.ir_text;
+	}
+	
+	for(auto &job : compile.jobs) {
+		if(!job.error.empty())
+			fatal_error(Mobius_Error::internal, "Failed to jit compile module: ", job.error, " .");
+		
+		auto data = job.data;
+		data->resource_tracker = instance_dylib(data->module_instance).createResourceTracker();
+		auto maybe_error = global_jit->addObjectFile(std::move(job.object), data->resource_tracker);
+		if(maybe_error) {
+			std::string errstr;
+			llvm::raw_string_ostream errstream(errstr);
+			errstream << maybe_error;
+			fatal_error(Mobius_Error::internal, "Failed to jit compile module: ", errstream.str(), " .");
+		}
+		
+		// The IR is not needed any more after it is compiled.
+		data->builder.reset();
+		data->module.reset();
+		data->context.reset();
 	}
 	//TODO: Put a flag on the data to signify that it is now compiled (can't add more stuff to it), and properly error handle in other procs.
 }
 
+void
+jit_export_object_file(LLVM_Module_Data *data, Compiled_Code_Info *info, const std::string &file_name) {
+	
+	auto int_64_ty = llvm::Type::getInt64Ty(*data->context);
+	std::vector<llvm::Constant *> info_values = {
+		llvm::ConstantInt::get(int_64_ty, info->format),
+		llvm::ConstantInt::get(int_64_ty, info->batch_count),
+		llvm::ConstantInt::get(int_64_ty, info->has_step_loop),
+		llvm::ConstantInt::get(int_64_ty, info->signature),
+	};
+	auto info_ty = llvm::ArrayType::get(int_64_ty, info_values.size());
+	//NOTE: we are not responsible for the ownership of this one even though we allocate it with new.
+	new llvm::GlobalVariable(*data->module, info_ty, true, llvm::GlobalValue::ExternalLinkage, llvm::ConstantArray::get(info_ty, info_values), "mobius_compiled_code_info");
+	
+	auto jtmb = target_machine_builder(false);
+	jtmb.setRelocationModel(llvm::Reloc::PIC_);
+	auto target_machine = jtmb.createTargetMachine();
+	if(!target_machine)
+		fatal_error(Mobius_Error::internal, "Failed to create the target machine for export: ", llvm::toString(target_machine.takeError()), " .");
+	optimize_module(data, target_machine->get());
+	
+	llvm::orc::ConcurrentIRCompiler compiler(std::move(jtmb));
+	auto object = compiler(*data->module);
+	if(!object)
+		fatal_error(Mobius_Error::internal, "Failed to compile module for export: ", llvm::toString(object.takeError()), " .");
+	
+	std::error_code err;
+	llvm::raw_fd_ostream out(file_name, err, llvm::sys::fs::OF_None);
+	if(err)
+		fatal_error(Mobius_Error::api_usage, "Unable to open the file \"", file_name, "\" for writing.");
+	out << (*object)->getBuffer();
+}
+
 void
 free_llvm_module(LLVM_Module_Data *data) {
 	if(!data) return;
@@ -283,22 +503,35 @@ free_llvm_module(LLVM_Module_Data *data) {
 	delete data;
 }
 
-batch_function *
-get_jitted_batch_function(const std::string &fun_name) {
+static void *
+get_jitted_function(int module_instance, const std::string &fun_name) {
 	//warning_print("Lookup of function from jitted module.\n");
 	
-	auto result = global_jit->lookup(fun_name);
+	auto result = global_jit->lookup(instance_dylib(module_instance), fun_name);
 	if(result) {
-		// Get the symbol's address and cast it to the right type so we can call it as a native function.
-		batch_function *fun_ptr = (batch_function *)result->getAddress().getValue();
-
-		return fun_ptr;
+		// Get the symbol's address so that the caller can cast it to the right type and call it as a native function.
+		return (void *)result->getAddress().getValue();
 	} else
 		fatal_error(Mobius_Error::internal, "Failed to find function ", fun_name, " in LLVM module.");
 
 	return nullptr;
 }
 
+batch_function *
+get_jitted_batch_function(int module_instance, const std::string &fun_name) {
+	return (batch_function *)get_jitted_function(module_instance, fun_name);
+}
+
+step_loop_function *
+get_jitted_step_loop(int module_instance, const std::string &fun_name) {
+	return (step_loop_function *)get_jitted_function(module_instance, fun_name);
+}
+
+parallel_loop_function *
+get_jitted_instance_function(int module_instance, const std::string &fun_name) {
+	return (parallel_loop_function *)get_jitted_function(module_instance, fun_name);
+}
+
 struct
 LLVM_Local_Var {
 	llvm::Value *val;
@@ -320,19 +553,28 @@ jit_create_constant_array(LLVM_Module_Data *data, s32 *vals, s64 count, const st
 	//NOTE: we are not responsible for the ownership of this one even though we allocate it with new.
 	return new llvm::GlobalVariable(
 		*data->module, conn_array_ty, true,
-		llvm::GlobalValue::ExternalLinkage,
-		//llvm::GlobalValue::InternalLinkage,
+		// NOTE: Each module has its own copy of the data, so it must not be visible to the other modules.
+		llvm::GlobalValue::InternalLinkage,
 		const_array_init, name);
 }
 
 void
-jit_add_global_data(LLVM_Module_Data *data, LLVM_Constant_Data *constants, int llvm_module_instance) {
-	std::string conn_name = std::string("global_connection_data_") + std::to_string(llvm_module_instance);
-	std::string count_name = std::string("global_index_count_data_") + std::to_string(llvm_module_instance);
-	data->global_connection_data  = jit_create_constant_array(data, constants->connection_data, constants->connection_data_count, conn_name);
-	data->global_index_count_data = jit_create_constant_array(data, constants->index_count_data, constants->index_count_data_count, count_name);
+jit_add_global_data(LLVM_Module_Data *data, LLVM_Constant_Data *constants) {
+	data->global_connection_data  = jit_create_constant_array(data, constants->connection_data, constants->connection_data_count, "global_connection_data");
+	data->global_index_count_data = jit_create_constant_array(data, constants->index_count_data, constants->index_count_data_count, "global_index_count_data");
+	data->aligned_data = constants->aligned_data;
 }
 
+#define BATCH_FUN_ARG(name, llvm_ty, cpp_ty) name##_idx,
+enum argindex {
+	#include "batch_fun_args.incl"
+	// The step loop has these in place of fractional_step:
+	run_state_idx = fractional_step_idx,
+	batch_data_idx,
+	n_steps_idx,
+};
+#undef BATCH_FUN_ARG
+
 void
 jit_add_batch(Math_Expr_FT *batch_code, const std::string &fun_name, LLVM_Module_Data *data) {
 	
@@ -350,8 +592,9 @@ jit_add_batch(Math_Expr_FT *batch_code, const std::string &fun_name, LLVM_Module
 	for(auto &arg : fun->args()) {
 		if(idx <= 5)
 			fun->addParamAttr(idx, llvm::Attribute::NoAlias);
-		//if(idx <= 5)
-		//	fun->addParamAttr(idx, llvm::Attribute::get(*data->context, llvm::Attribute::Alignment, data_alignment));
+		// NOTE: The solver workspace is not allocated by us, so we don't know if it is aligned.
+		if(data->aligned_data && idx < solver_workspace_idx)
+			fun->addParamAttr(idx, llvm::Attribute::get(*data->context, llvm::Attribute::Alignment, data_alignment));
 		
 		arg.setName(argnames[idx++]);
 		args.push_back(&arg);
@@ -374,11 +617,131 @@ jit_add_batch(Math_Expr_FT *batch_code, const std::string &fun_name, LLVM_Module
 	}
 }
 
-#define BATCH_FUN_ARG(name, llvm_ty, cpp_ty) name##_idx,
-enum argindex {
-	#include "batch_fun_args.incl"
-};
-#undef BATCH_FUN_ARG
+llvm::Function *
+get_linked_function(LLVM_Module_Data *data, const std::string &fun_name, llvm::Type *ret_ty, std::vector<llvm::Type *> &arguments_ty);
+
+void
+jit_add_step_loop(const std::vector<Step_Loop_Batch> &batches, s64 var_count, s64 series_count, const std::string &fun_name, LLVM_Module_Data *data) {
+	
+	auto double_ty     = llvm::Type::getDoubleTy(*data->context);
+	auto int_64_ty     = llvm::Type::getInt64Ty(*data->context);
+	auto double_ptr_ty = llvm::PointerType::getUnqual(double_ty);
+	auto void_ptr_ty   = llvm::PointerType::getUnqual(int_64_ty);
+	auto void_ty       = llvm::Type::getVoidTy(*data->context);
+	
+	std::vector<llvm::Type *> arg_types;
+	for(int idx = 0; idx < fractional_step_idx; ++idx)
+		arg_types.push_back(data->batch_fun_type->getParamType(idx));
+	arg_types.push_back(void_ptr_ty);
+	arg_types.push_back(void_ptr_ty);
+	arg_types.push_back(int_64_ty);
+	auto fun_type = llvm::FunctionType::get(void_ty, arg_types, false);
+	
+	llvm::Function *fun = llvm::Function::Create(fun_type, llvm::Function::ExternalLinkage, fun_name, data->module.get());
+	
+	#define BATCH_FUN_ARG(name, llvm_ty, cpp_ty) #name,
+	#define BATCH_FUN_ARG_LAST(name, llvm_ty, cpp_ty)
+	const char *argnames[] = {
+		#include "batch_fun_args.incl"
+		"run_state", "batch_data", "n_steps",
+	};
+	#undef BATCH_FUN_ARG
+	std::vector<llvm::Value *> args;
+	int idx = 0;
+	for(auto &arg : fun->args()) {
+		arg.setName(argnames[idx++]);
+		args.push_back(&arg);
+	}
+	
+	std::vector<llvm::Type *> solver_step_args = { void_ptr_ty, void_ptr_ty, int_64_ty, double_ptr_ty, double_ptr_ty };
+	auto solver_step_fun = get_linked_function(data, "_solver_batch_step_", void_ty, solver_step_args);
+	std::vector<llvm::Type *> advance_args = { arg_types[date_time_idx] };
+	auto advance_fun = get_linked_function(data, "_advance_date_time_", void_ty, advance_args);
+	
+	llvm::BasicBlock *entry_block = llvm::BasicBlock::Create(*data->context, "entry", fun);
+	llvm::BasicBlock *loop_block  = llvm::BasicBlock::Create(*data->context, "loop", fun);
+	llvm::BasicBlock *after_block = llvm::BasicBlock::Create(*data->context, "afterloop", fun);
+	
+	data->builder->SetInsertPoint(entry_block);
+	auto zero = llvm::ConstantInt::get(*data->context, llvm::APInt(64, 0, true));
+	auto any_steps = data->builder->CreateICmpSGT(args[n_steps_idx], zero, "anysteps");
+	data->builder->CreateCondBr(any_steps, loop_block, after_block);
+	
+	data->builder->SetInsertPoint(loop_block);
+	auto step       = data->builder->CreatePHI(int_64_ty, 2, "step");
+	auto prev_state = data->builder->CreatePHI(double_ptr_ty, 2, "prev_state");
+	auto series     = data->builder->CreatePHI(double_ptr_ty, 2, "series");
+	step->addIncoming(zero, entry_block);
+	prev_state->addIncoming(args[state_vars_idx], entry_block);
+	series->addIncoming(args[series_idx], entry_block);
+	
+	// Copy in the last step's values as the initial state of the current step (same as in run_model).
+	auto var_count_val = llvm::ConstantInt::get(*data->context, llvm::APInt(64, var_count, true));
+	auto state = data->builder->CreateGEP(double_ty, prev_state, var_count_val, "state");
+	data->builder->CreateMemCpy(state, llvm::MaybeAlign(8), prev_state, llvm::MaybeAlign(8), var_count*sizeof(double));
+	
+	std::vector<llvm::Value *> batch_args(args.begin(), args.begin() + fractional_step_idx);
+	batch_args[state_vars_idx] = state;
+	batch_args[series_idx]     = series;
+	batch_args.push_back(llvm::ConstantFP::get(*data->context, llvm::APFloat(0.0)));
+	
+	for(s64 batch_idx = 0; batch_idx < batches.size(); ++batch_idx) {
+		auto &batch = batches[batch_idx];
+		if(batch.on_solver) {
+			auto batch_idx_val = llvm::ConstantInt::get(*data->context, llvm::APInt(64, batch_idx, true));
+			data->builder->CreateCall(solver_step_fun, { args[run_state_idx], args[batch_data_idx], batch_idx_val, state, series });
+		} else {
+			// The batch function is in a different module, and is linked in when the modules are added to the JIT.
+			auto batch_fun = data->module->getOrInsertFunction(batch.function_name, data->batch_fun_type);
+			data->builder->CreateCall(batch_fun, batch_args);
+		}
+	}
+	data->builder->CreateCall(advance_fun, { args[date_time_idx] });
+	
+	auto series_count_val = llvm::ConstantInt::get(*data->context, llvm::APInt(64, series_count, true));
+	auto next_series = data->builder->CreateGEP(double_ty, series, series_count_val, "next_series");
+	auto next_step = data->builder->CreateAdd(step, llvm::ConstantInt::get(*data->context, llvm::APInt(64, 1, true)), "next_step");
+	auto loop_cond = data->builder->CreateICmpNE(next_step, args[n_steps_idx], "loopcond");
+	data->builder->CreateCondBr(loop_cond, loop_block, after_block);
+	
+	step->addIncoming(next_step, loop_block);
+	prev_state->addIncoming(state, loop_block);
+	series->addIncoming(next_series, loop_block);
+	
+	data->builder->SetInsertPoint(after_block);
+	data->builder->CreateRetVoid();
+	
+	std::string errmsg = "";
+	llvm::raw_string_ostream errstream(errmsg);
+	bool errors = llvm::verifyFunction(*fun, &errstream);
+	if(errors)
+		fatal_error(Mobius_Error::internal, "LLVM function verification failed for function \"", fun_name, "\" : ", errstream.str(), " .");
+}
+
+// With aligned storage every value in the model data belongs to one parameter or variable (the padding is never accessed), and the generated
+// code only reaches it through that one. Giving each of them its own TBAA type tells LLVM that accesses to different ones don't alias, even
+// when it can't tell the offsets apart (e.g. when they depend on connection data), so that loops over index sets can be vectorized.
+static void
+set_access_tag(LLVM_Module_Data *data, llvm::Instruction *inst, const std::string &name) {
+	
+	if(!data->aligned_data) return;
+	
+	llvm::MDBuilder md_builder(*data->context);
+	if(!data->tbaa_root)
+		data->tbaa_root = md_builder.createTBAARoot("Mobius2 model data");
+	
+	auto &tag = data->tbaa_tags[name];
+	if(!tag) {
+		auto type = md_builder.createTBAAScalarTypeNode(name, data->tbaa_root);
+		tag = md_builder.createTBAAStructTagNode(type, type, 0);
+	}
+	inst->setMetadata(llvm::LLVMContext::MD_tbaa, tag);
+}
+
+inline std::string
+access_tag_name(Var_Id var_id) {
+	return std::string("var_") + std::to_string((int)var_id.type) + "_" + std::to_string(var_id.id);
+}
 
 argindex
 get_arg_index(Var_Id::Type type) {
@@ -599,10 +962,10 @@ build_intrinsic_ir(llvm::Value *a, Value_Type type1, llvm::Value *b, Value_Type
 		
 		auto val_ty = (function == "uniform_int") ? int_64_ty : double_ty;
 		
-		std::vector<llvm::Type *> arguments_ty = {int_64_ptr_ty, val_ty, val_ty};
+		std::vector<llvm::Type *> arguments_ty = {int_64_ptr_ty, args[date_time_idx]->getType(), val_ty, val_ty};
 		auto *linked_fun = get_linked_function(data, callname, val_ty, arguments_ty);
 	
-		std::vector<llvm::Value *> fun_args = { args[rand_state_idx], a, b};
+		std::vector<llvm::Value *> fun_args = { args[rand_state_idx], args[date_time_idx], a, b};
 		return data->builder->CreateCall(linked_fun, fun_args, "calltmp");
 	} else
 		fatal_error(Mobius_Error::internal, "Unhandled intrinsic \"", function, "\" in build_intrinsic_ir().");
@@ -726,6 +1089,144 @@ build_for_loop_ir(Math_Expr_FT *n, Math_Expr_FT *body, Scope_Data *loop_local, s
 	return nullptr;//llvm::ConstantInt::get(*data->context, llvm::APInt(64, 0, true));  // NOTE: This is a dummy, it should not be used by anyone.
 }
 
+bool
+can_split_out_loop(Math_Block_FT *block, Scope_Data *loop_local) {
+	// The body of the loop is put in a separate function, so it can't refer to local variables (or loop indexes) from outside the loop.
+	if(!block->iter_tag.empty()) return false;
+	for(auto scope = loop_local->scope_up; scope; scope = scope->scope_up)
+		if(!scope->values.empty()) return false;
+	return true;
+}
+
+static llvm::Function *
+create_parallel_loop_function(const std::string &fun_name, llvm::GlobalValue::LinkageTypes linkage, std::vector<llvm::Value *> &fun_args, llvm::Value **first, llvm::Value **last, LLVM_Module_Data *data) {
+	// Create a function of type parallel_loop_function. fun_args receives the batch function arguments, and first and last the iteration range.
+	auto int_64_ty   = llvm::Type::getInt64Ty(*data->context);
+	auto void_ty     = llvm::Type::getVoidTy(*data->context);
+	
+	std::vector<llvm::Type *> arg_types(data->batch_fun_type->param_begin(), data->batch_fun_type->param_end());
+	arg_types.push_back(int_64_ty);
+	arg_types.push_back(int_64_ty);
+	auto fun_type = llvm::FunctionType::get(void_ty, arg_types, false);
+	
+	llvm::Function *fun = llvm::Function::Create(fun_type, linkage, fun_name, data->module.get());
+	
+	fun_args.clear();
+	int idx = 0;
+	for(auto &arg : fun->args()) {
+		if(idx <= 5)
+			fun->addParamAttr(idx, llvm::Attribute::NoAlias);
+		fun_args.push_back(&arg);
+		++idx;
+	}
+	*first = fun_args[fun_args.size()-2];
+	*last  = fun_args[fun_args.size()-1];
+	fun_args.resize(fun_args.size()-2);
+	
+	return fun;
+}
+
+static void
+build_loop_range_ir(Math_Block_FT *block, llvm::Value *first, llvm::Value *last, std::vector<llvm::Value *> &fun_args, LLVM_Module_Data *data) {
+	// Build the iterations [first, last) of the for loop block at the current insertion point. The loop body can't refer to local variables from
+	// outside the loop (see can_split_out_loop).
+	auto int_64_ty   = llvm::Type::getInt64Ty(*data->context);
+	
+	llvm::Function *fun = data->builder->GetInsertBlock()->getParent();
+	llvm::BasicBlock *entry_block = data->builder->GetInsertBlock();
+	llvm::BasicBlock *loop_block  = llvm::BasicBlock::Create(*data->context, "loop", fun);
+	llvm::BasicBlock *after_block = llvm::BasicBlock::Create(*data->context, "afterloop", fun);
+	
+	data->builder->CreateCondBr(data->builder->CreateICmpSLT(first, last, "isloop"), loop_block, after_block);
+	
+	data->builder->SetInsertPoint(loop_block);
+	llvm::PHINode *iter = data->builder->CreatePHI(int_64_ty, 2, "index");
+	iter->addIncoming(first, entry_block);
+	
+	Scope_Data fun_local;
+	fun_local.scope_id    = block->unique_block_id;
+	fun_local.scope_up    = nullptr;
+	fun_local.scope_value = nullptr;
+	fun_local.values[0]   = {iter, nullptr};
+	
+	build_expression_ir(block->exprs[1], &fun_local, fun_args, data);
+	
+	llvm::Value *next_iter = data->builder->CreateAdd(iter, llvm::ConstantInt::get(*data->context, llvm::APInt(64, 1, true)), "next_iter");
+	llvm::Value *loop_cond = data->builder->CreateICmpNE(next_iter, last, "loopcond");
+	iter->addIncoming(next_iter, data->builder->GetInsertBlock());
+	data->builder->CreateCondBr(loop_cond, loop_block, after_block);
+	
+	data->builder->SetInsertPoint(after_block);
+}
+
+llvm::Value *
+build_parallel_for_loop_ir(Math_Block_FT *block, Scope_Data *loop_local, std::vector<llvm::Value *> &args, LLVM_Module_Data *data) {
+	
+	// Put the loop in a separate function that does the iterations [first, last), and let _parallel_for_ split the iterations between threads.
+	
+	auto int_64_ty   = llvm::Type::getInt64Ty(*data->context);
+	auto void_ty     = llvm::Type::getVoidTy(*data->context);
+	auto void_ptr_ty = llvm::PointerType::getUnqual(int_64_ty);
+	
+	llvm::Value *count = build_expression_ir(block->exprs[0], loop_local, args, data);
+	
+	llvm::BasicBlock *caller_block = data->builder->GetInsertBlock();
+	llvm::Function *caller = caller_block->getParent();
+	
+	int loop_idx = 0;
+	std::string fun_name;
+	do {
+		fun_name = caller->getName().str() + "_par" + std::to_string(loop_idx++);
+	} while(data->module->getFunction(fun_name));
+	
+	std::vector<llvm::Value *> fun_args;
+	llvm::Value *first, *last;
+	llvm::Function *fun = create_parallel_loop_function(fun_name, llvm::Function::InternalLinkage, fun_args, &first, &last, data);
+	
+	data->builder->SetInsertPoint(llvm::BasicBlock::Create(*data->context, "entry", fun));
+	build_loop_range_ir(block, first, last, fun_args, data);
+	data->builder->CreateRetVoid();
+	
+	std::string errmsg = "";
+	llvm::raw_string_ostream errstream(errmsg);
+	if(llvm::verifyFunction(*fun, &errstream))
+		fatal_error(Mobius_Error::internal, "LLVM function verification failed for function \"", fun_name, "\" : ", errstream.str(), " .");
+	
+	// Call it from the original function.
+	data->builder->SetInsertPoint(caller_block);
+	std::vector<llvm::Type *> parallel_for_args = { void_ptr_ty };
+	parallel_for_args.insert(parallel_for_args.end(), data->batch_fun_type->param_begin(), data->batch_fun_type->param_end());
+	parallel_for_args.push_back(int_64_ty);
+	auto parallel_for_fun = get_linked_function(data, "_parallel_for_", void_ty, parallel_for_args);
+	
+	std::vector<llvm::Value *> call_args = { fun };
+	call_args.insert(call_args.end(), args.begin(), args.end());
+	call_args.push_back(count);
+	data->builder->CreateCall(parallel_for_fun, call_args);
+	
+	return nullptr;
+}
+
+void
+jit_add_instance_batch(Math_Expr_FT *instance_code, const std::string &fun_name, LLVM_Module_Data *data) {
+	
+	// The instance code is a block of for loops over the same index set (see generate_instance_code). The function runs the iterations
+	// [first, last) of each of them in order.
+	std::vector<llvm::Value *> fun_args;
+	llvm::Value *first, *last;
+	llvm::Function *fun = create_parallel_loop_function(fun_name, llvm::Function::ExternalLinkage, fun_args, &first, &last, data);
+	
+	data->builder->SetInsertPoint(llvm::BasicBlock::Create(*data->context, "entry", fun));
+	for(auto expr : instance_code->exprs)
+		build_loop_range_ir(static_cast<Math_Block_FT *>(expr), first, last, fun_args, data);
+	data->builder->CreateRetVoid();
+	
+	std::string errmsg = "";
+	llvm::raw_string_ostream errstream(errmsg);
+	if(llvm::verifyFunction(*fun, &errstream))
+		fatal_error(Mobius_Error::internal, "LLVM function verification failed for function \"", fun_name, "\" : ", errstream.str(), " .");
+}
+
 llvm::Value *
 build_external_computation_ir(Math_Expr_FT *expr, Scope_Data *locals, std::vector<llvm::Value *> &args, LLVM_Module_Data *data) {
 	
@@ -835,7 +1336,9 @@ build_expression_ir(Math_Expr_FT *expr, Scope_Data *locals, std::vector<llvm::Va
 					} else
 						result = build_expression_ir(sub_expr, &new_locals, args, data);
 				}
-			} else
+			} else if(block->is_parallel && can_split_out_loop(block, &new_locals))
+				result = build_parallel_for_loop_ir(block, &new_locals, args, data);
+			else
 				result = build_for_loop_ir(expr->exprs[0], expr->exprs[1], &new_locals, args, data);
 			return result;
 		} break;
@@ -867,7 +1370,8 @@ build_expression_ir(Math_Expr_FT *expr, Scope_Data *locals, std::vector<llvm::Va
 			
 			llvm::Value *offset = nullptr;
 			if(ident->variable_type == Variable_Type::parameter || ident->variable_type == Variable_Type::series
-				|| ident->variable_type == Variable_Type::connection_info || ident->variable_type == Variable_Type::index_count) {
+				|| ident->variable_type == Variable_Type::connection_info || ident->variable_type == Variable_Type::index_count
+				|| ident->variable_type == Variable_Type::solver_workspace) {
 				if(expr->exprs.size() != 1)
 					fatal_error(Mobius_Error::internal, "An identifier was not properly indexed before LLVM codegen.");
 				offset = build_expression_ir(expr->exprs[0], locals, args, data);
@@ -882,7 +1386,9 @@ build_expression_ir(Math_Expr_FT *expr, Scope_Data *locals, std::vector<llvm::Va
 				result = data->builder->CreateGEP(double_ty, args[parameters_idx], offset, "par_ptr");
 				
 				//auto par = model->parameters[ident->par_id];   //Hmm, we don't have that here. Could maybe store a debug symbol in the identifier? Useful in several instances.
-				result = data->builder->CreateLoad(double_ty, result, "par");//std::string("par_")+par->symbol);
+				auto load = data->builder->CreateLoad(double_ty, result, "par");//std::string("par_")+par->symbol);
+				set_access_tag(data, load, std::string("par_") + std::to_string(ident->par_id.id));
+				result = load;
 				if(ident->value_type == Value_Type::integer || ident->value_type == Value_Type::boolean) {
 					result = data->builder->CreateBitCast(result, llvm::Type::getInt64Ty(*data->context));
 					if(ident->value_type == Value_Type::boolean)
@@ -893,7 +1399,9 @@ build_expression_ir(Math_Expr_FT *expr, Scope_Data *locals, std::vector<llvm::Va
 				int argidx = get_arg_index(ident->var_id.type);
 				
 				result = data->builder->CreateGEP(double_ty, args[argidx], offset, "var_ptr");
-				result = data->builder->CreateLoad(double_ty, result, "var");
+				auto load = data->builder->CreateLoad(double_ty, result, "var");
+				set_access_tag(data, load, access_tag_name(ident->var_id));
+				result = load;
 		
 			} else if(ident->variable_type == Variable_Type::local) {
 				auto local = find_local_var(locals, ident->local_var);
@@ -912,6 +1420,9 @@ build_expression_ir(Math_Expr_FT *expr, Scope_Data *locals, std::vector<llvm::Va
 				result = data->builder->CreateGEP(int_32_ty, data->global_index_count_data, offset, "index_count_ptr");
 				result = data->builder->CreateLoad(int_32_ty, result, "index_count");
 				result = data->builder->CreateSExt(result, int_64_ty, "index_count_cast");
+			} else if(ident->variable_type == Variable_Type::solver_workspace) {
+				result = data->builder->CreateGEP(double_ty, args[solver_workspace_idx], offset, "workspace_ptr");
+				result = data->builder->CreateLoad(double_ty, result, "workspace_value");
 			}
 			#define TIME_VALUE(name, bits) \
 			else if(++struct_pos, ident->variable_type == Variable_Type::time_##name) { \
@@ -1024,7 +1535,8 @@ build_expression_ir(Math_Expr_FT *expr, Scope_Data *locals, std::vector<llvm::Va
 			llvm::Value *offset = build_expression_ir(expr->exprs[0], locals, args, data);
 			llvm::Value *value  = build_expression_ir(expr->exprs[1], locals, args, data);
 			auto ptr = data->builder->CreateGEP(var_ty, args[argidx], offset, "var_ptr");
-			data->builder->CreateStore(value, ptr);
+			auto store = data->builder->CreateStore(value, ptr);
+			set_access_tag(data, store, access_tag_name(assign->var_id));
 			return nullptr;
 		} break;
 		
@@ -5,7 +5,13 @@
 #include "function_tree.h"
 #include "run_model.h"
 
-constexpr int data_alignment = 32;
+// If MOBIUS_NO_LLVM is set, the framework can be built without llvm_jit.cpp (and without linking to LLVM). It can then only run models from
+// precompiled code (see jit_export_object_file).
+#ifndef MOBIUS_NO_LLVM
+#define MOBIUS_NO_LLVM 0
+#endif
+
+constexpr int data_alignment = 64; // Cache line size, and also enough for the widest vector loads.
 
 struct
 LLVM_Constant_Data {
@@ -13,28 +19,75 @@ LLVM_Constant_Data {
 	s64 connection_data_count;
 	s32 *index_count_data;
 	s64 index_count_data_count;
+	bool aligned_data = false; // If the model data is aligned and padded (see Mobius_Config::aligned_storage).
 };
 
 void initialize_llvm();
 
 struct LLVM_Module_Data;
 
+// The modules that are created with the same module_instance are compiled into the same JITDylib, and can call each other's functions.
+// Functions in modules with different instances can have the same names.
 LLVM_Module_Data *
-create_llvm_module();
+create_llvm_module(int module_instance);
 
+// Optimize and compile the modules on separate threads, and add them to the JIT. Functions in one module can call functions in the others.
+// If cache_path is not empty, the compiled objects are stored in that directory, and if the same module was compiled before, it is loaded from
+// there instead of being optimized and compiled again.
+// If optimize is false, the code is compiled as fast as possible instead, without using the cache. If parallel is false, everything is done on
+// the calling thread.
 void
-jit_compile_module(LLVM_Module_Data *data, std::string *output_string);
+jit_compile_modules(const std::vector<LLVM_Module_Data *> &modules, std::string *output_string, const std::string &cache_path = "",
+	bool optimize = true, bool parallel = true);
 
 void
 free_llvm_module(LLVM_Module_Data *data);
 
 void
-jit_add_global_data(LLVM_Module_Data *data, LLVM_Constant_Data *constants, int llvm_module_instance);
+jit_add_global_data(LLVM_Module_Data *data, LLVM_Constant_Data *constants);
 
 void
 jit_add_batch(Math_Expr_FT *expr, const std::string &function_name, LLVM_Module_Data *data);
 
+// Add a function (of type parallel_loop_function) that computes the given instances of a batch that was split up by generate_instance_code.
+void
+jit_add_instance_batch(Math_Expr_FT *instance_code, const std::string &function_name, LLVM_Module_Data *data);
+
+struct
+Step_Loop_Batch {
+	std::string function_name;   // Only used if the batch is not on a solver.
+	bool        on_solver;
+};
+
+// Add a function (of type step_loop_function) that runs the given batches in order for each time step, and also moves the state and series
+// pointers along and advances the date. The batch functions can be in other modules.
+void
+jit_add_step_loop(const std::vector<Step_Loop_Batch> &batches, s64 var_count, s64 series_count, const std::string &function_name, LLVM_Module_Data *data);
+
+// This is stored in precompiled code as the symbol mobius_compiled_code_info, so that we can check that the code was made for the model
+// application it is loaded into.
+struct
+Compiled_Code_Info {
+	s64 format;            // compiled_code_format
+	s64 batch_count;
+	s64 has_step_loop;
+	u64 signature;         // Hash of the model code and the index structure (see compiled_code_signature in model_compilation.cpp).
+};
+
+constexpr s64 compiled_code_format = 2;
+
+// Optimize the module and write it to an object file with position independent code instead of adding it to the JIT. The object file can be
+// linked into a shared library that can be loaded without LLVM. The module can't be used after this.
+void
+jit_export_object_file(LLVM_Module_Data *data, Compiled_Code_Info *info, const std::string &file_name);
+
 batch_function *
-get_jitted_batch_function(const std::string &function_name);
+get_jitted_batch_function(int module_instance, const std::string &function_name);
+
+step_loop_function *
+get_jitted_step_loop(int module_instance, const std::string &function_name);
+
+parallel_loop_function *
+get_jitted_instance_function(int module_instance, const std::string &function_name);
 
 #endif // MOBIUS_LLVM_JIT_H
\ No newline at end of file
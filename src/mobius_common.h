@@ -150,6 +150,11 @@ Timer {
 		auto   end = std::chrono::high_resolution_clock::now();
 		return std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count();
 	}
+	
+	s64 get_nanoseconds() {
+		auto   end = std::chrono::high_resolution_clock::now();
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count();
+	}
 };
 
 #endif //MOBIUS_COMMON_H
\ No newline at end of file
@@ -81,8 +81,8 @@ void
 prelim_compose(Model_Application *app, std::vector<std::string> &input_names);
 
 Model_Application::Model_Application(Mobius_Model *model) :
-	model(model), parameter_structure(this), series_structure(this), result_structure(this), temp_result_structure(this), connection_structure(this),
-	additional_series_structure(this), assert_structure(this), index_counts_structure(this), data_set(nullptr), data(this), llvm_data(nullptr), index_data(model) {
+	model(model), parameter_structure(this), series_structure(this), result_structure(this), temp_result_structure(this), kept_result_structure(this), connection_structure(this),
+	additional_series_structure(this), assert_structure(this), index_counts_structure(this), data_set(nullptr), data(this), index_data(model) {
 	
 	
 	// NOTE: This is only because of how we implement Index_Set_Tuple. That could easily be amended if necessary.
@@ -95,8 +95,9 @@ Model_Application::Model_Application(Mobius_Model *model) :
 	time_step_unit.declared_form.push_back({0, 1, Compound_Unit::day});
 	time_step_unit.set_standard_form();
 	
+#if !MOBIUS_NO_LLVM
 	initialize_llvm();
-	llvm_data = create_llvm_module();
+#endif
 }
 
 Model_Application::Edit_Form
@@ -156,7 +157,7 @@ Model_Application::set_up_parameter_structure(std::unordered_map<Entity_Id, std:
 		structure.push_back(std::move(array));
 	}
 	
-	parameter_structure.set_up(std::move(structure));
+	parameter_structure.set_up(std::move(structure), true);
 	data.parameters.allocate();
 	
 	// Write default parameter values
@@ -210,7 +211,39 @@ Model_Application::set_up_series_structure(Var_Id::Type type, Series_Metadata *m
 		structure.push_back(std::move(array));
 	}
 	
-	data.set_up(std::move(structure));
+	data.set_up(std::move(structure), true);
+}
+
+void
+Model_Application::set_up_kept_result_structure(const std::vector<Var_Id> &kept_vars) {
+	
+	std::set<Var_Id> kept(kept_vars.begin(), kept_vars.end());
+	
+	// NOTE: All Model_Data for this app share the same structure, so we can only allow one set of kept variables.
+	if(kept_result_structure.has_been_set_up) {
+		bool same = kept.size() == kept_result_structure.handle_is_in_array.size();
+		for(auto var_id : kept)
+			same = same && kept_result_structure.handle_is_in_array.find(var_id) != kept_result_structure.handle_is_in_array.end();
+		if(!same)
+			fatal_error(Mobius_Error::api_usage, "The set of kept variables for windowed results can't be changed after it was first set.");
+		return;
+	}
+	
+	std::map<std::vector<Entity_Id>, std::vector<Var_Id>> kept_by_index_sets;
+	for(auto var_id : kept) {
+		if(!is_valid(var_id) || var_id.type != Var_Id::Type::state_var)
+			fatal_error(Mobius_Error::api_usage, "Only variables with stored results can be kept when the results are windowed.");
+		kept_by_index_sets[result_structure.get_index_sets(var_id)].push_back(var_id);
+	}
+	
+	std::vector<Multi_Array_Structure<Var_Id>> structure;
+	for(auto pair : kept_by_index_sets) {
+		std::vector<Entity_Id> index_sets = pair.first;
+		std::vector<Var_Id>    handles    = pair.second;
+		Multi_Array_Structure<Var_Id> array(std::move(index_sets), std::move(handles));
+		structure.push_back(std::move(array));
+	}
+	kept_result_structure.set_up(std::move(structure));
 }
 
 void
@@ -1274,7 +1307,7 @@ Model_Data::get_end_date_parameter() {
 
 Model_Data::Model_Data(Model_Application *app) :
 	app(app), parameters(&app->parameter_structure), series(&app->series_structure),
-	results(&app->result_structure, 1), temp_results(&app->temp_result_structure), connections(&app->connection_structure),
+	results(&app->result_structure, 1), kept_results(&app->kept_result_structure, 1), temp_results(&app->temp_result_structure), connections(&app->connection_structure),
 	additional_series(&app->additional_series_structure), index_counts(&app->index_counts_structure) {
 }
 
@@ -1284,8 +1317,17 @@ Model_Data::copy(bool copy_results, bool copy_series) {
 	Model_Data *cpy = new Model_Data(app);
 	
 	cpy->parameters.copy_from(&this->parameters);
-	if(copy_results)
+	cpy->results.window = results.window;
+	cpy->checkpoint_step = checkpoint_step;
+	cpy->resume_from = resume_from;
+	cpy->profile_run = profile_run;
+	cpy->rand_seed = rand_seed;
+	cpy->has_full_results = copy_results && has_full_results;
+	if(copy_results) {
 		cpy->results.copy_from(&this->results);
+		if(app->kept_result_structure.has_been_set_up)
+			cpy->kept_results.copy_from(&this->kept_results);
+	}
 	if(copy_series) {
 		cpy->series.copy_from(&this->series);
 		cpy->additional_series.copy_from(&this->additional_series);
@@ -1299,6 +1341,47 @@ Model_Data::copy(bool copy_results, bool copy_series) {
 	return cpy;
 }
 
+void
+Model_Data::set_result_window(s64 window, const std::vector<Var_Id> &kept_vars) {
+	if(!app->is_compiled)
+		fatal_error(Mobius_Error::api_usage, "Tried to set a result window before the model was compiled.");
+	
+	if(window <= 0) {
+		if(results.window > 0) results.free_data();
+		results.window = 0;
+		kept_results.free_data();
+		return;
+	}
+	if(window < 2)
+		fatal_error(Mobius_Error::api_usage, "The result window must be at least 2 time steps so that the previous step is available.");
+	
+	app->set_up_kept_result_structure(kept_vars);
+	
+	if(window != results.window) {
+		results.free_data();
+		results.window = window;
+	}
+}
+
+void
+Model_Data::map_to_file(Var_Id::Type type, const std::string &file_name) {
+	if(type == Var_Id::Type::temp_var || type == Var_Id::Type::assertion)
+		fatal_error(Mobius_Error::api_usage, "Only results and series can be stored in a file.");
+	get_storage(type).map_to_file(file_name);
+}
+
+void
+Model_Data::open_mapped_file(Var_Id::Type type, const std::string &file_name) {
+	if(type == Var_Id::Type::temp_var || type == Var_Id::Type::assertion)
+		fatal_error(Mobius_Error::api_usage, "Only results and series can be stored in a file.");
+	auto &storage = get_storage(type);
+	if(!storage.structure->has_been_set_up)
+		fatal_error(Mobius_Error::api_usage, "Tried to open a data file before the model was compiled.");
+	storage.open_mapped_file(file_name);
+	if(type == Var_Id::Type::state_var)
+		has_full_results = false;
+}
+
 inline void
 serialize_loc(Mobius_Model *model, std::stringstream &ss, const Var_Location &loc) {
 	for(int idx = 0; idx < loc.n_components; ++idx) {
@@ -9,6 +9,8 @@
 
 #include <functional>
 #include <memory>
+#include <thread>
+#include <atomic>
 
 
 constexpr Index_T invalid_index = Index_T::no_index(); // TODO: Maybe we don't need the invalid_index alias..
@@ -200,9 +202,11 @@ struct Multi_Array_Structure {
 	
 	std::unordered_map<Handle_T, s32, Hash_Fun<Handle_T>> handle_location;
 	s64 begin_offset;
+	s64 block_size;          // The number of values for each handle. This is the instance_count, possibly padded (see Storage_Structure::set_up).
+	bool contiguous = false; // If the handles must be stored right after one another (and after the previous array if that is also contiguous).
 	
 	s64 get_offset_base(Handle_T handle, Model_Application *app) {
-		return begin_offset + handle_location[handle]*instance_count(app);
+		return begin_offset + handle_location[handle]*block_size;
 	}
 	
 	s64 get_stride(Handle_T handle);
@@ -221,7 +225,7 @@ struct Multi_Array_Structure {
 	get_special_offset_stride_code(Handle_T handle, Index_Exprs &index_exprs, Model_Application *app);
 	
 	s64 total_count(Model_Application *app) {
-		return (s64)handles.size() * instance_count(app);
+		return (s64)handles.size() * block_size;
 	}
 	
 	void finalize() {
@@ -245,7 +249,8 @@ struct Storage_Structure {
 	std::unordered_map<Handle_T, s32, Hash_Fun<Handle_T>> handle_is_in_array;
 	std::vector<Multi_Array_Structure<Handle_T>> structure;
 	
-	void set_up(std::vector<Multi_Array_Structure<Handle_T>> &&structure);
+	// If pad is true and the model is configured with aligned_storage, the data for each handle starts on a data_alignment boundary.
+	void set_up(std::vector<Multi_Array_Structure<Handle_T>> &&structure, bool pad = false);
 	
 	s64 get_offset_base(Handle_T handle);
 	s64 get_stride(Handle_T handle);
@@ -267,6 +272,22 @@ struct Storage_Structure {
 	Storage_Structure(Model_Application *parent) : parent(parent), has_been_set_up(false), total_count(0) {}
 };
 
+// Data_Storage can be put in a memory mapped file. The file starts with this header, and the data follows at mapped_storage_data_offset.
+struct
+Mapped_Storage_Header {
+	char      magic[8];
+	s64       value_size;
+	s64       total_count;
+	s64       time_steps;
+	s64       initial_step;
+	s64       window;
+	s64       steps_written;  // Steps that were flushed so far. Another process can use this to see how far a run has come.
+	Date_Time start_date;
+};
+
+constexpr char   mapped_storage_magic[8]    = "MOBIUS2";
+constexpr size_t mapped_storage_data_offset = 4096;
+
 template<typename Val_T, typename Handle_T>
 struct Data_Storage {
 	Data_Storage(Storage_Structure<Handle_T> *structure, s64 initial_step = 0)
@@ -279,17 +300,36 @@ struct Data_Storage {
 	Date_Time     start_date = {};
 	bool          is_owning = false;
 	
+	// If window > 0, at most 'window' steps are allocated, and they are reused as a ring buffer. Slot 0 is then reserved for a copy of the
+	// step preceding the one in slot 1 so that the step before the current one is always directly behind it in memory (needed for last()).
+	// This means that only the last window-1 steps can be looked up.
+	s64           window = 0;
+	
+	// If file_name is set, the data is allocated in a memory mapped file instead of on the heap. This lets the OS page it out, so a run can be larger
+	// than the available memory, and the file can later be opened read-only with open_mapped_file (for instance by another process).
+	std::string   file_name;
+	Mapped_File  *mapped = nullptr;
+	
 	void free_data();
 	
 	//TODO: there should be a version of this one that checks for out of bounds indexing (or non-allocated data). But we also want the fast one that doesn't
 	Val_T  *
 	get_value(s64 offset, s64 time_step = 0) {
 		s64 step = std::max(time_step + initial_step, (s64)0);
+		if(window > 0 && step >= window)
+			step = 1 + (step - 1) % (window - 1);
 		return data + offset + step*structure->total_count;
 	}
 	
+	s64
+	alloc_steps() {
+		s64 steps = time_steps + initial_step;
+		if(window > 0) steps = std::min(steps, window);
+		return steps;
+	}
+	
 	size_t
-	alloc_size() { return sizeof(Val_T) * structure->total_count * (time_steps + initial_step); }
+	alloc_size() { return sizeof(Val_T) * structure->total_count * alloc_steps(); }
 	
 	void
 	allocate(s64 time_steps = 1, Date_Time start_date = {});
@@ -301,9 +341,29 @@ struct Data_Storage {
 	void
 	copy_from(Data_Storage<Val_T, Handle_T> *source, bool size_only = false);
 	
+	// If the data is already allocated, it is moved to the file (or back to the heap if file_name is empty).
+	void
+	map_to_file(const std::string &file_name);
+	
+	void
+	open_mapped_file(const std::string &file_name);
+	
+	// Write back the time steps in [from_step, to_step) to the file if the data is mapped. Does nothing otherwise.
+	void
+	flush(s64 from_step, s64 to_step, bool wait = false);
+	
 	~Data_Storage() { free_data(); }
 };
 
+// Where the time went in a model run. There is one of these per Run_Batch.
+struct
+Batch_Profile {
+	s64 nanoseconds     = 0;
+	s64 calls           = 0;
+	s64 rhs_evaluations = 0;  // Only for solver batches.
+	s64 rejected_steps  = 0;  // Only for solver batches, and only counted by some solvers.
+};
+
 struct Model_Data {
 	Model_Data(Model_Application *app);
 
@@ -312,13 +372,31 @@ struct Model_Data {
 	Data_Storage<Parameter_Value, Entity_Id>  parameters;
 	Data_Storage<double, Var_Id>              series;
 	Data_Storage<double, Var_Id>              results;
+	Data_Storage<double, Var_Id>              kept_results;  // Only used if results.window > 0
 	Data_Storage<double, Var_Id>              temp_results;
 	Data_Storage<double, Var_Id>              additional_series;
 	Data_Storage<s32, Connection_T>           connections;
 	Data_Storage<s32, Entity_Id>              index_counts;
 	
+	// If checkpoint_step >= 0, the full run state after that time step (or the last step if the run is shorter) is saved to 'checkpoint' during the run.
+	// If resume_from is not empty, runs continue from the checkpoint in it instead of starting at the start date. See run_model.cpp
+	s64                                       checkpoint_step = -1;
+	std::string                               checkpoint;
+	std::string                               resume_from;
+	
+	// Set when a run finished with the full results stored in 'results'. Only then can a run with changed_pars reuse them (see run_model).
+	bool                                      has_full_results = false;
+	
+	// If profile_run is set, the time spent in each batch is recorded in run_profile during the following runs. This makes the run a bit slower.
+	bool                                      profile_run = false;
+	std::vector<Batch_Profile>                run_profile;
+	
+	// If rand_seed >= 0, the random draws in the model (uniform_real etc.) are the same every run. Otherwise every run gets a new random seed. See random_stream.h
+	s64                                       rand_seed = -1;
+	
+	// NOTE: If the results are windowed, the full history of state variables is only available for the kept ones.
 	Data_Storage<double, Var_Id> &get_storage(Var_Id::Type type) {
-		if(type == Var_Id::Type::state_var)         return results;
+		if(type == Var_Id::Type::state_var)         return results.window > 0 ? kept_results : results;
 		if(type == Var_Id::Type::temp_var)          return temp_results;
 		if(type == Var_Id::Type::series)            return series;
 		if(type == Var_Id::Type::additional_series) return additional_series;
@@ -326,6 +404,14 @@ struct Model_Data {
 	}
 	
 	Model_Data *copy(bool copy_results = true, bool copy_series = false);
+	
+	// Only keep 'window' steps of the full result vector during the run, but the full history of the kept_vars. window <= 0 turns it off again.
+	void set_result_window(s64 window, const std::vector<Var_Id> &kept_vars);
+	
+	// Put the data of this type in a memory mapped file (back on the heap if file_name is empty), or open a file that was written earlier.
+	void map_to_file(Var_Id::Type type, const std::string &file_name);
+	void open_mapped_file(Var_Id::Type type, const std::string &file_name);
+	
 	Date_Time get_start_date_parameter();
 	Date_Time get_end_date_parameter();
 };
@@ -336,11 +422,51 @@ Run_Batch {
 	s64              first_ode_offset;
 	s64              h_address;
 	int              n_ode;
+	Jacobian_Sparsity jacobian_sparsity; // Only computed if the solver uses the Jacobian.
 	
+	// The compiled functions for these are in Model_Application::compiled_functions.
 	Math_Expr_FT    *run_code;
-	batch_function  *compiled_code;
 	
-	Run_Batch() : run_code(nullptr), solver_id(invalid_entity_id), compiled_code(nullptr) {}
+	// Computes the derivatives in a given direction instead (see differentiation.cpp). Only if the solver uses the Jacobian, and if the code
+	// could be differentiated.
+	Math_Expr_FT    *jacobian_run_code = nullptr;
+	
+	// Computes the derivatives of a range of instances of the outer index set if the solver integrates each instance separately (see
+	// generate_instance_code). Then there are instance_count instances with instance_n_ode ODEs each.
+	Math_Expr_FT    *instance_run_code = nullptr;
+	s64              instance_count    = 0;
+	int              instance_n_ode    = 0;
+	
+	std::string      description;  // Which solver the batch is on, and what it computes. Used to identify it in e.g. the run profile.
+	std::vector<int> depends_on;  // Earlier batches that read or write something this batch writes or reads, i.e. that have to be run before this one.
+	bool             uses_random = false;
+	
+	// What the code of the batch reads and writes. This is used to find which batches have to be run again if only some parameters changed (see run_model.cpp).
+	std::vector<Var_Id>    reads;
+	std::vector<Var_Id>    writes;
+	std::vector<Entity_Id> parameters;
+	bool                   external = false; // The batch has external computations, so we don't know what it reads and writes.
+	
+	Run_Batch() : run_code(nullptr), solver_id(invalid_entity_id) {}
+};
+
+// The compiled functions of the batches, indexed the same way as Model_Application::batches. A table is not modified after it is put in
+// Model_Application::compiled_functions. If the functions change (see use_optimized_code), a new table is made instead.
+struct
+Compiled_Functions {
+	batch_function                        *initial_code = nullptr;
+	std::vector<batch_function *>          batch_code;
+	std::vector<batch_function *>          jacobian_code;  // nullptr for a batch without Jacobian code.
+	std::vector<parallel_loop_function *>  instance_code;  // nullptr for a batch that is not integrated one instance at a time.
+	step_loop_function                    *step_loop = nullptr; // Only if model->config.jit_step_loop
+};
+
+// What the initial value of a state variable is computed from. There can be several of these for the same variable (e.g. for aggregates).
+struct
+Initial_Value_Source {
+	Var_Id                 var_id;
+	std::vector<Var_Id>    reads;
+	std::vector<Entity_Id> parameters;
 };
 
 struct
@@ -408,7 +534,12 @@ Model_Application {
 	
 	~Model_Application() {
 		// TODO: should probably free more stuff.
-		free_llvm_module(llvm_data);
+		if(optimizing_thread.joinable())
+			optimizing_thread.join();
+#if !MOBIUS_NO_LLVM
+		for(auto llvm_data : llvm_modules)
+			free_llvm_module(llvm_data);
+#endif
 	}
 	
 	Mobius_Model                                            *model;
@@ -423,6 +554,7 @@ Model_Application {
 	Storage_Structure<Connection_T>                          connection_structure;
 	Storage_Structure<Var_Id>                                result_structure;
 	Storage_Structure<Var_Id>                                temp_result_structure;
+	Storage_Structure<Var_Id>                                kept_result_structure;
 	Storage_Structure<Var_Id>                                series_structure;
 	Storage_Structure<Var_Id>                                additional_series_structure;
 	Storage_Structure<Var_Id>                                assert_structure;
@@ -443,14 +575,26 @@ Model_Application {
 	
 	All_Connection_Components                                connection_components;
 	
-	LLVM_Module_Data                                        *llvm_data;
+	std::vector<LLVM_Module_Data *>                          llvm_modules; // One for the initial batch, one per batch and one for the step loop, so that they can be compiled in parallel.
 	
 	Run_Batch                                                initial_batch;
 	std::vector<Run_Batch>                                   batches;
+	std::vector<std::vector<int>>                            batch_levels;  // Only if model->config.concurrent_batches. The batches in a level don't depend on each other and can be run at the same time.
+	std::vector<Initial_Value_Source>                        initial_value_sources;
 	
 	bool                                                     is_compiled = false;
 	std::vector<Entity_Id>                                   baked_parameters;
 	
+	// Only if model->config.tiered_compilation. The functions are first set to unoptimized code while the optimized code is compiled on this thread.
+	std::thread                                              optimizing_thread;
+	std::atomic<bool>                                        optimized_ready { false };
+	int                                                      optimized_instance = -1;
+	
+	// A run loads this once when it starts, and uses that table for the whole run. The tables are kept until the application is deleted, since
+	// a run that is still going can use one that has been replaced.
+	std::atomic<const Compiled_Functions *>                  compiled_functions { nullptr };
+	std::vector<std::unique_ptr<Compiled_Functions>>         compiled_function_tables;
+	
 	bool        is_baked_parameter(Entity_Id par_id) {
 		return std::find(baked_parameters.begin(), baked_parameters.end(), par_id) != baked_parameters.end();
 	}
@@ -485,11 +629,14 @@ Model_Application {
 	void set_up_index_count_structure();
 	
 	void set_up_series_structure(Var_Id::Type type, Series_Metadata *metadata);
+	void set_up_kept_result_structure(const std::vector<Var_Id> &kept_vars);
 	
 	// TODO: this one should maybe be on the Model_Data struct instead
 	void allocate_series_data(s64 time_steps, Date_Time start_date);
 	
 	void compile(bool store_code_strings = false);
+	// If tiered compilation is on and the optimized code is done, swap it in. This should only be called between runs.
+	void use_optimized_code();
 	void compose_and_resolve();
 	
 	std::string serialize  (Var_Id id);
@@ -602,8 +749,15 @@ Storage_Structure<Handle_T>::get_special_offset_stride_code(Handle_T handle, Ind
 	return structure[array_idx].get_special_offset_stride_code(handle, indexes, parent);
 }
 
+inline size_t
+round_up(int align, size_t size) {
+	int rem = size % align;
+	if(rem == 0) return size;
+	return size + (align - rem);
+}
+
 template<typename Handle_T> void
-Storage_Structure<Handle_T>::set_up(std::vector<Multi_Array_Structure<Handle_T>> &&structure) {
+Storage_Structure<Handle_T>::set_up(std::vector<Multi_Array_Structure<Handle_T>> &&structure, bool pad) {
 	//TODO: check that index_counts are properly set up in parent.
 	
 	if(has_been_set_up)
@@ -611,16 +765,31 @@ Storage_Structure<Handle_T>::set_up(std::vector<Multi_Array_Structure<Handle_T>>
 	
 	this->structure = structure;
 	
+	// NOTE: With padding, the base of each handle is aligned (given that the data is), so that loops over the instances of a handle can be
+	// vectorized with aligned loads and stores. The total count is also padded so that every time step of the data starts aligned.
+	// The padded values are never read or written by the model.
+	s64 pad_to = 1;
+	if(pad && parent->model->config.aligned_storage)
+		pad_to = data_alignment / sizeof(double);
+	
 	s64 offset = 0;
 	s32 array_idx = 0;
+	bool prev_contiguous = false;
 	for(auto &multi_array : this->structure) {
+		bool padded = !multi_array.contiguous;
+		if(padded || !prev_contiguous)
+			offset = round_up(pad_to, offset);
 		multi_array.begin_offset = offset;
+		multi_array.block_size   = multi_array.instance_count(parent);
+		if(padded)
+			multi_array.block_size = round_up(pad_to, multi_array.block_size);
 		offset += multi_array.total_count(parent);
 		for(Handle_T handle : multi_array.handles)
 			handle_is_in_array[handle] = array_idx;
+		prev_contiguous = multi_array.contiguous;
 		++array_idx;
 	}
-	total_count = offset;
+	total_count = round_up(pad_to, offset);
 	
 	has_been_set_up = true;
 }
@@ -636,26 +805,50 @@ Storage_Structure<Handle_T>::for_each(Handle_T handle, const std::function<void(
 	});
 }
 
-inline size_t
-round_up(int align, size_t size) {
-	int rem = size % align;
-	if(rem == 0) return size;
-	return size + (align - rem);
-}
-
 template<typename Val_T, typename Handle_T> void 
 Data_Storage<Val_T, Handle_T>::allocate(s64 time_steps, Date_Time start_date) {
 	if(!structure->has_been_set_up)
 		fatal_error(Mobius_Error::internal, "Tried to allocate data before structure was set up.");
 	this->start_date = start_date;
-	if(this->time_steps != time_steps || !is_owning) {
+	if(!file_name.empty()) {
+		// NOTE: Truncating the file clears it without touching every page, so it stays sparse until it is written to.
+		if(mapped && !mapped->read_only) {
+			// The file is already ours (see map_to_file), so we just resize it to the new step count instead of opening it again.
+			this->time_steps = time_steps;
+			resize_mapped_file(mapped, 0);
+			resize_mapped_file(mapped, mapped_storage_data_offset + alloc_size());
+		} else {
+			free_data();
+			this->time_steps = time_steps;
+			mapped = map_file(file_name, mapped_storage_data_offset + alloc_size(), false, true);
+		}
+		data = (Val_T *)(mapped->data + mapped_storage_data_offset);
+		is_owning = true;
+		
+		auto header = (Mapped_Storage_Header *)mapped->data;
+		memcpy(header->magic, mapped_storage_magic, sizeof(mapped_storage_magic));
+		header->value_size    = sizeof(Val_T);
+		header->total_count   = structure->total_count;
+		header->time_steps    = time_steps;
+		header->initial_step  = initial_step;
+		header->window        = window;
+		header->steps_written = 0;
+		header->start_date    = start_date;
+		return;
+	}
+	// NOTE: If the data was opened read-only with open_mapped_file, we can't write to it, so it is moved back to the heap.
+	if(this->time_steps != time_steps || !is_owning || mapped) {
 		free_data();
 		this->time_steps = time_steps;
 		size_t sz = alloc_size();
 		if(sz > 0) {
-			data = (Val_T *) malloc(sz);
-			//auto sz2 = round_up(data_alignment, sz);
-			//data = (Val_T *) _aligned_malloc(sz2, data_alignment);  // should be replaced with std::aligned_alloc(data_alignment, sz2) when that is available.
+			// NOTE: The generated code can assume that the data is aligned if the model is configured with aligned_storage (see jit_add_batch).
+			auto sz2 = round_up(data_alignment, sz);
+#ifdef _WIN32
+			data = (Val_T *) _aligned_malloc(sz2, data_alignment);
+#else
+			data = (Val_T *) aligned_alloc(data_alignment, sz2);
+#endif
 			if(!data)
 				fatal_error(Mobius_Error::internal, "Failed to allocated data (", sz, " bytes).");
 		} else
@@ -668,8 +861,16 @@ Data_Storage<Val_T, Handle_T>::allocate(s64 time_steps, Date_Time start_date) {
 
 template<typename Val_T, typename Handle_T> void 
 Data_Storage<Val_T, Handle_T>::free_data() {
-	//if(data && is_owning) _aligned_free(data);
-	if(data && is_owning) free(data); 
+	if(mapped) {
+		unmap_file(mapped);
+		mapped = nullptr;
+	} else if(data && is_owning) {
+#ifdef _WIN32
+		_aligned_free(data);
+#else
+		free(data);
+#endif
+	}
 	data = nullptr;
 	time_steps = 0;
 	is_owning = false;
@@ -683,6 +884,7 @@ Data_Storage<Val_T, Handle_T>::refer_to(Data_Storage<Val_T, Handle_T> *source) {
 	data = source->data;
 	time_steps = source->time_steps;
 	start_date = source->start_date;
+	window = source->window;
 	is_owning = false;
 }
 
@@ -691,6 +893,7 @@ Data_Storage<Val_T, Handle_T>::copy_from(Data_Storage<Val_T, Handle_T> *source,
 	if(structure != source->structure)
 		fatal_error(Mobius_Error::internal, "Tried to make a data storage copy from another one that belongs to a different storage structure.");
 	free_data();
+	window = source->window;
 	if(source->time_steps > 0) {
 		allocate(source->time_steps, source->start_date);
 		if(!size_only)
@@ -701,4 +904,82 @@ Data_Storage<Val_T, Handle_T>::copy_from(Data_Storage<Val_T, Handle_T> *source,
 }
 
 
+template<typename Val_T, typename Handle_T> void
+Data_Storage<Val_T, Handle_T>::map_to_file(const std::string &file_name) {
+	if(mapped && !mapped->read_only && this->file_name == file_name)
+		return;
+	if(mapped && mapped->read_only)
+		free_data();
+	if(!data || !is_owning) {
+		this->file_name = file_name;
+		return;
+	}
+	// Make a new allocation in the new place and move the data over.
+	Data_Storage<Val_T, Handle_T> moved(structure, initial_step);
+	moved.window = window;
+	moved.file_name = file_name;
+	moved.allocate(time_steps, start_date);
+	memcpy(moved.data, data, alloc_size());
+	moved.flush(-initial_step, time_steps, true);
+	
+	free_data();
+	this->file_name = file_name;
+	this->time_steps = moved.time_steps;
+	data   = moved.data;
+	mapped = moved.mapped;
+	is_owning = true;
+	moved.data = nullptr;
+	moved.mapped = nullptr;
+	moved.is_owning = false;
+}
+
+template<typename Val_T, typename Handle_T> void
+Data_Storage<Val_T, Handle_T>::open_mapped_file(const std::string &file_name) {
+	if(!structure->has_been_set_up)
+		fatal_error(Mobius_Error::internal, "Tried to open a data file before structure was set up.");
+	free_data();
+	
+	auto file = map_file(file_name, 0, true);
+	auto header = (Mapped_Storage_Header *)file->data;
+	bool correct = file->size >= mapped_storage_data_offset
+		&& !memcmp(header->magic, mapped_storage_magic, sizeof(mapped_storage_magic))
+		&& header->value_size == sizeof(Val_T)
+		&& header->total_count == structure->total_count
+		&& header->initial_step == initial_step;
+	if(correct) {
+		s64 steps = header->time_steps + header->initial_step;
+		if(header->window > 0) steps = std::min(steps, header->window);
+		correct = file->size >= mapped_storage_data_offset + sizeof(Val_T)*structure->total_count*steps;
+	}
+	if(!correct) {
+		unmap_file(file);
+		fatal_error(Mobius_Error::api_usage, "The file \"", file_name, "\" does not contain data with the same layout as this model application.");
+	}
+	
+	mapped     = file;
+	data       = (Val_T *)(file->data + mapped_storage_data_offset);
+	time_steps = header->time_steps;
+	window     = header->window;
+	start_date = header->start_date;
+	is_owning  = true;
+	// NOTE: We don't set this->file_name, so if this storage is allocated again, that happens on the heap and we don't overwrite the file.
+}
+
+template<typename Val_T, typename Handle_T> void
+Data_Storage<Val_T, Handle_T>::flush(s64 from_step, s64 to_step, bool wait) {
+	if(!mapped || mapped->read_only) return;
+	size_t step_size = sizeof(Val_T) * structure->total_count;
+	size_t from = mapped_storage_data_offset + step_size*std::max(from_step + initial_step, (s64)0);
+	size_t to   = mapped_storage_data_offset + step_size*std::max(to_step + initial_step, (s64)0);
+	if(window > 0) {
+		from = mapped_storage_data_offset;
+		to = mapped->size;
+	}
+	flush_mapped_file(mapped, from, to, wait);
+	
+	auto header = (Mapped_Storage_Header *)mapped->data;
+	header->steps_written = std::max(header->steps_written, std::min(to_step, time_steps));
+	flush_mapped_file(mapped, 0, sizeof(Mapped_Storage_Header), wait);
+}
+
 #endif // MOBIUS_MODEL_APPLICATION_H
\ No newline at end of file
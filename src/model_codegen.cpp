@@ -2,6 +2,8 @@
 #include "model_codegen.h"
 #include "model_application.h"
 
+#include <map>
+
 
 Math_Expr_FT *
 make_possibly_time_scaled_ident(Model_Application *app, Var_Id var_id) {
@@ -958,6 +960,105 @@ generate_external_computation_code(Model_Application *app, External_Computation_
 
 
 
+bool
+reads_instance_of(Math_Expr_FT *expr, std::set<Var_Id> &written) {
+	// Check if the code looks up any of the given variables using a restriction (i.e. at another index than the current one), or if it uses the random generator.
+	if(expr->expr_type == Math_Expr_Type::identifier) {
+		auto ident = static_cast<Identifier_FT *>(expr);
+		if(ident->is_computed_series() && written.find(ident->var_id) != written.end()
+			&& (ident->restriction.r1.type != Restriction::none || ident->restriction.r2.type != Restriction::none))
+			return true;
+	} else if(expr->expr_type == Math_Expr_Type::function_call) {
+		auto &name = static_cast<Function_Call_FT *>(expr)->fun_name;
+		if(name == "uniform_real" || name == "normal" || name == "uniform_int")
+			return true;
+	}
+	for(auto arg : expr->exprs)
+		if(reads_instance_of(arg, written)) return true;
+	return false;
+}
+
+bool
+instances_are_independent(Model_Application *app, const std::vector<const Batch_Array *> &arrays, std::vector<Model_Instruction> &instructions, Entity_Id index_set) {
+	// Determine if the iterations over the given index set (the outer loop of the arrays) can be run in any order (or at the same time), i.e.
+	// every instance only writes to values that are indexed over this index set, and never reads values written by another instance.
+	// NOTE: The arrays must be all the ones that are run together, since a value can be read in another array than the one it is written in
+	// (for instance a flux reading the ODE state of a neighbour instance).
+	
+	std::set<Var_Id> written;
+	for(auto array : arrays) for(int instr_id : array->instr_ids) {
+		auto &instr = instructions[instr_id];
+		
+		// These write to or read from other instances through a connection.
+		if(instr.type == Model_Instruction::Type::add_to_connection_aggregate || instr.type == Model_Instruction::Type::external_computation)
+			return false;
+		if(is_valid(instr.restriction.r1.connection_id) || is_valid(instr.restriction.r2.connection_id))
+			return false;
+		
+		Var_Id write_id = instr.var_id;
+		if(instr.type == Model_Instruction::Type::subtract_discrete_flux_from_source)
+			write_id = instr.source_id;
+		else if(instr.type == Model_Instruction::Type::add_discrete_flux_to_target || instr.type == Model_Instruction::Type::add_to_aggregate
+			|| instr.type == Model_Instruction::Type::add_to_parameter_aggregate)
+			write_id = instr.target_id;
+		
+		if(is_valid(write_id)) {
+			auto &index_sets = app->get_storage_structure(write_id.type).get_index_sets(write_id);
+			if(std::find(index_sets.begin(), index_sets.end(), index_set) == index_sets.end())
+				return false;
+			written.insert(write_id);
+		}
+	}
+	
+	for(auto array : arrays) for(int instr_id : array->instr_ids) {
+		auto &instr = instructions[instr_id];
+		if(instr.code && reads_instance_of(instr.code, written))
+			return false;
+	}
+	
+	return true;
+}
+
+void
+maybe_make_parallel(Model_Application *app, Math_Block_FT *top_scope, Batch_Array &array, std::vector<Model_Instruction> &instructions) {
+	
+	if(!app->model->config.parallel_instances || array.index_sets.empty() || top_scope->exprs.empty()) return;
+	
+	// create_nested_for_loops put the loop over the first index set last in the top scope.
+	Entity_Id index_set = *array.index_sets.begin();
+	auto loop = static_cast<Math_Block_FT *>(top_scope->exprs.back());
+	if(instances_are_independent(app, { &array }, instructions, index_set))
+		loop->is_parallel = true;
+}
+
+Math_Expr_FT *
+interpolate_other_solver_values(Model_Application *app, Math_Expr_FT *expr, std::vector<Model_Instruction> &instructions, Entity_Id solver) {
+	// The batches of other solvers are run before this one (if this one reads their values), so what we read from them is the value at the end of
+	// the time step. Instead use x_prev + time.fractional_step*(x - x_prev), so that the values change smoothly while this solver integrates over
+	// the step, no matter what step size the other solver used.
+	for(int idx = 0; idx < expr->exprs.size(); ++idx)
+		expr->exprs[idx] = interpolate_other_solver_values(app, expr->exprs[idx], instructions, solver);
+	
+	if(expr->expr_type != Math_Expr_Type::identifier) return expr;
+	auto ident = static_cast<Identifier_FT *>(expr);
+	if(!ident->is_stored_computed_series() || ident->flags != Identifier_FT::none) return expr;
+	
+	auto &instr = instructions[ident->var_id.id];
+	if(!is_valid(instr.solver) || instr.solver == solver || instr.type != Model_Instruction::Type::compute_state_var
+		|| !app->vars[ident->var_id]->is_mass_balance_quantity())
+		return expr;
+	
+	auto prev = static_cast<Identifier_FT *>(copy(ident));
+	prev->set_flag(Identifier_FT::last_result);
+	auto prev2 = copy(prev);
+	
+	auto frac = new Identifier_FT();
+	frac->variable_type = Variable_Type::time_fractional_step;
+	frac->value_type    = Value_Type::real;
+	
+	return make_binop('+', prev, make_binop('*', frac, make_binop('-', ident, prev2)));
+}
+
 Math_Expr_FT *
 generate_run_code(Model_Application *app, Batch *batch, std::vector<Model_Instruction> &instructions, bool initial) {
 	auto model = app->model;
@@ -965,9 +1066,12 @@ generate_run_code(Model_Application *app, Batch *batch, std::vector<Model_Instru
 	
 	Index_Exprs indexes(app->model);
 	
+	bool interpolate = is_valid(batch->solver) && model->solvers[batch->solver]->interpolate;
+	
 	for(auto &array : batch->arrays) {
 		
 		Math_Expr_FT *scope = create_nested_for_loops(top_scope, app, array.index_sets, indexes);
+		maybe_make_parallel(app, top_scope, array, instructions);
 		
 		for(int instr_id : array.instr_ids) {
 			
@@ -978,6 +1082,8 @@ generate_run_code(Model_Application *app, Batch *batch, std::vector<Model_Instru
 			try {
 				if(instr.code) {
 					fun = copy(instr.code);
+					if(interpolate)
+						fun = interpolate_other_solver_values(app, fun, instructions, batch->solver);
 					fun = put_var_lookup_indexes(fun, app, indexes, &instr);
 				} else if (instr.type != Model_Instruction::Type::clear_state_var) {
 					//NOTE: Some instructions are placeholders that give the order of when a value is 'ready' for use by other instructions, but they are not themselves computing the value they are placeholding for. This for instance happens with aggregation variables that are computed by other add_to_aggregate instructions. So it is OK that their 'fun' is nullptr.
@@ -1117,6 +1223,7 @@ generate_run_code(Model_Application *app, Batch *batch, std::vector<Model_Instru
 		s64 init_pos = app->result_structure.get_offset_base(instructions[batch->arrays_ode[0].instr_ids[0]].var_id);
 		for(auto &array : batch->arrays_ode) {
 			Math_Expr_FT *scope = create_nested_for_loops(top_scope, app, array.index_sets, indexes);
+			maybe_make_parallel(app, top_scope, array, instructions);
 					
 			for(int instr_id : array.instr_ids) {
 				auto &instr = instructions[instr_id];
@@ -1131,8 +1238,10 @@ generate_run_code(Model_Application *app, Batch *batch, std::vector<Model_Instru
 					fatal_error(Mobius_Error::internal, "ODE variables should always be provided with generated code in instruction_codegen, but we got one without.");
 				
 				fun = copy(fun);
+				if(interpolate)
+					fun = interpolate_other_solver_values(app, fun, instructions, batch->solver);
 				
-				put_var_lookup_indexes(fun, app, indexes);
+				fun = put_var_lookup_indexes(fun, app, indexes);
 				
 				auto offset_var = app->result_structure.get_offset_code(instr.var_id, indexes);
 				auto offset_deriv = make_binop('-', offset_var, make_literal(init_pos));
@@ -1163,3 +1272,85 @@ generate_run_code(Model_Application *app, Batch *batch, std::vector<Model_Instru
 	
 	return result;
 }
+
+static void
+set_instance_derivative_offsets(Math_Expr_FT *expr, std::map<Var_Id, s64> &positions) {
+	// Inside the per-instance code the derivatives of one instance are written to solver_workspace[0..H-1].
+	if(expr->expr_type == Math_Expr_Type::derivative_assignment) {
+		auto assignment = static_cast<Assignment_FT *>(expr);
+		delete expr->exprs[0];
+		expr->exprs[0] = make_literal(positions[assignment->var_id]);
+	}
+	for(auto arg : expr->exprs)
+		set_instance_derivative_offsets(arg, positions);
+}
+
+Math_Expr_FT *
+generate_instance_code(Model_Application *app, Batch *batch, std::vector<Model_Instruction> &instructions, Math_Expr_FT *run_code, s64 *instance_count_out, int *instance_n_ode_out) {
+	
+	if(!is_valid(batch->solver) || !run_code) return nullptr;
+	
+	// Every array has to loop over the same index set at the outer level, and the instances of that one must not interact.
+	Entity_Id index_set = invalid_entity_id;
+	std::vector<const Batch_Array *> all_arrays;
+	for(auto arrays : { &batch->arrays, &batch->arrays_ode }) {
+		for(auto &array : *arrays) {
+			if(array.index_sets.empty()) return nullptr;
+			Entity_Id first = *array.index_sets.begin();
+			if(!is_valid(index_set))
+				index_set = first;
+			else if(first != index_set)
+				return nullptr;
+			all_arrays.push_back(&array);
+		}
+	}
+	if(!instances_are_independent(app, all_arrays, instructions, index_set))
+		return nullptr;
+	
+	// The ODE variables must be indexed over only this index set. Since they are stored handle-major, the values of instance i are then at
+	// init_pos + h*count + i for h = 0..H-1 (see Multi_Array_Structure).
+	s64 init_pos = app->result_structure.get_offset_base(instructions[batch->arrays_ode[0].instr_ids[0]].var_id);
+	s64 count = app->result_structure.instance_count(instructions[batch->arrays_ode[0].instr_ids[0]].var_id);
+	if(count <= 1) return nullptr;
+	
+	std::map<Var_Id, s64> positions;
+	s64 n_ode = 0;
+	for(auto &array : batch->arrays_ode) {
+		Index_Set_Tuple only;
+		only.insert(index_set);
+		if(array.index_sets != only) return nullptr;
+		for(int instr_id : array.instr_ids) {
+			Var_Id var_id = instructions[instr_id].var_id;
+			s64 rel = app->result_structure.get_offset_base(var_id) - init_pos;
+			if(app->result_structure.instance_count(var_id) != count || rel < 0 || rel % count != 0) return nullptr;
+			positions[var_id] = rel / count;
+			++n_ode;
+		}
+	}
+	for(auto &pair : positions)
+		if(pair.second >= n_ode) return nullptr;
+	
+	// All the top level code must be loops over the instances (not everything was necessarily put in a block if there was only one loop).
+	if(run_code->expr_type != Math_Expr_Type::block) return nullptr;
+	Math_Block_FT *code = nullptr;
+	if(static_cast<Math_Block_FT *>(run_code)->is_for_loop) {
+		code = new Math_Block_FT();
+		code->exprs.push_back(copy(run_code));
+	} else {
+		for(auto expr : run_code->exprs) {
+			if(expr->expr_type != Math_Expr_Type::block || !static_cast<Math_Block_FT *>(expr)->is_for_loop)
+				return nullptr;
+		}
+		code = static_cast<Math_Block_FT *>(copy(run_code));
+	}
+	
+	for(auto expr : code->exprs) {
+		auto loop = static_cast<Math_Block_FT *>(expr);
+		loop->is_parallel = false; // The solver is the one that decides what instance is run.
+		set_instance_derivative_offsets(loop, positions);
+	}
+	
+	*instance_count_out = count;
+	*instance_n_ode_out = (int)n_ode;
+	return code;
+}
@@ -97,5 +97,26 @@ instruction_codegen(Model_Application *app, std::vector<Model_Instruction> &inst
 Math_Expr_FT *
 generate_run_code(Model_Application *app, Batch *batch, std::vector<Model_Instruction> &instructions, bool initial);
 
+// If the instances of the outer index set of an ODE batch are independent, this makes code that computes the derivatives of one instance at a time
+// (see jit_add_instance_batch). The derivatives of the instance are written to the start of the solver workspace. Returns nullptr if the batch
+// can't be split up that way.
+Math_Expr_FT *
+generate_instance_code(Model_Application *app, Batch *batch, std::vector<Model_Instruction> &instructions, Math_Expr_FT *run_code, s64 *instance_count_out, int *instance_n_ode_out);
+
+// Code that computes the derivatives of the ODE system of a solver batch in a given direction, see differentiation.cpp.
+// Returns nullptr if the batch has something we can't differentiate (like external computations).
+Math_Expr_FT *
+generate_jacobian_code(Model_Application *app, Math_Expr_FT *run_code);
+
+struct
+Jacobian_Workspace_Layout {
+	s64 state_offset;
+	s64 temp_offset;
+	s64 output_offset;  // The workspace needs room for n_ode values after this.
+};
+
+Jacobian_Workspace_Layout
+jacobian_workspace_layout(Model_Application *app);
+
 
 #endif // MOBIUS_MODEL_CODEGEN_H
\ No newline at end of file
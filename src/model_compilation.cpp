@@ -9,7 +9,9 @@
 #include "model_application.h"
 #include "function_tree.h"
 #include "model_codegen.h"
+#include "emulate.h"
 #include "grouped_topological_sort.h"
+#include "file_utils.h"
 
 #include <string>
 #include <sstream>
@@ -1743,13 +1745,185 @@ create_batches(Model_Application *app, std::vector<Batch> &batches_out, std::vec
 #endif
 }
 
+std::string
+batch_description(Model_Application *app, Batch &batch, std::vector<Model_Instruction> &instructions) {
+	std::stringstream ss;
+	if(is_valid(batch.solver))
+		ss << "solver(\"" << app->model->solvers[batch.solver]->name << "\") : ";
+	else
+		ss << "discrete : ";
+	
+	// Name a few of the variables so that one can tell which module(s) the batch comes from.
+	constexpr int max_names = 3;
+	int count = 0;
+	for(int instr_id : batch.instrs) {
+		auto &instr = instructions[instr_id];
+		if(instr.type != Model_Instruction::Type::compute_state_var) continue;
+		if(count < max_names)
+			ss << (count ? ", " : "") << "\"" << app->vars[instr.var_id]->name << "\"";
+		++count;
+	}
+	if(count > max_names)
+		ss << " and " << (count - max_names) << " more";
+	return ss.str();
+}
+
+struct
+Batch_Accesses {
+	std::set<Var_Id>    reads;
+	std::set<Var_Id>    writes;
+	std::set<Entity_Id> parameters;
+	bool uses_random  = false;
+	bool external     = false; // External computations can read and write anything they are given, so we don't try to figure out what they touch.
+};
+
+void
+register_access(Math_Expr_FT *expr, Batch_Accesses &accesses) {
+	if(expr->expr_type == Math_Expr_Type::identifier) {
+		auto ident = static_cast<Identifier_FT *>(expr);
+		if(ident->is_computed_series())
+			accesses.reads.insert(ident->var_id);
+		else if(ident->variable_type == Variable_Type::parameter)
+			accesses.parameters.insert(ident->par_id);
+	} else if(expr->expr_type == Math_Expr_Type::state_var_assignment) {
+		accesses.writes.insert(static_cast<Assignment_FT *>(expr)->var_id);
+	} else if(expr->expr_type == Math_Expr_Type::function_call) {
+		auto &name = static_cast<Function_Call_FT *>(expr)->fun_name;
+		if(name == "uniform_real" || name == "normal" || name == "uniform_int")
+			accesses.uses_random = true;
+	} else if(expr->expr_type == Math_Expr_Type::external_computation)
+		accesses.external = true;
+}
+
+void
+register_accesses(Math_Expr_FT *expr, Batch_Accesses &accesses) {
+	for(auto arg : expr->exprs)
+		register_accesses(arg, accesses);
+	register_access(expr, accesses);
+}
+
+void
+register_initial_accesses(Math_Expr_FT *expr, Batch_Accesses &shared, std::vector<std::pair<Var_Id, Batch_Accesses>> &assignments) {
+	if(expr->expr_type == Math_Expr_Type::state_var_assignment) {
+		Batch_Accesses acc;
+		register_accesses(expr, acc);
+		assignments.emplace_back(static_cast<Assignment_FT *>(expr)->var_id, std::move(acc));
+		return;
+	}
+	for(auto arg : expr->exprs)
+		register_initial_accesses(arg, shared, assignments);
+	register_access(expr, shared);
+}
+
+void
+set_up_initial_value_sources(Model_Application *app) {
+	
+	// Find what each initial value is computed from, so that a re-run where only some parameters changed can tell which of them changed.
+	// Anything that is read outside the assignments (like the conditions around them) is counted as read by all of them.
+	Batch_Accesses shared;
+	std::vector<std::pair<Var_Id, Batch_Accesses>> assignments;
+	register_initial_accesses(app->initial_batch.run_code, shared, assignments);
+	
+	app->initial_batch.external    = shared.external;
+	app->initial_batch.uses_random = shared.uses_random;
+	for(auto &assignment : assignments) {
+		auto &acc = assignment.second;
+		if(acc.external)    app->initial_batch.external = true;
+		if(acc.uses_random) app->initial_batch.uses_random = true;
+		acc.reads.insert(shared.reads.begin(), shared.reads.end());
+		acc.parameters.insert(shared.parameters.begin(), shared.parameters.end());
+		
+		Initial_Value_Source source;
+		source.var_id = assignment.first;
+		source.reads.assign(acc.reads.begin(), acc.reads.end());
+		source.parameters.assign(acc.parameters.begin(), acc.parameters.end());
+		app->initial_value_sources.push_back(std::move(source));
+	}
+}
+
+bool
+accesses_conflict(Batch_Accesses &a, Batch_Accesses &b) {
+	if(a.external || b.external) return true;
+	if(a.uses_random && b.uses_random) return true; // The random draws have to happen in the same order every time.
+	auto overlaps = [](std::set<Var_Id> &set1, std::set<Var_Id> &set2) {
+		for(auto var_id : set1)
+			if(set2.find(var_id) != set2.end()) return true;
+		return false;
+	};
+	return overlaps(a.writes, b.reads) || overlaps(a.reads, b.writes) || overlaps(a.writes, b.writes);
+}
+
+void
+schedule_batches(Model_Application *app, std::vector<Batch> &batches, std::vector<Model_Instruction> &instructions) {
+	
+	// Find which batches depend on each other by looking at what the generated code for each batch reads and writes.
+	// This is more conservative than the instruction dependencies, but those don't tell us e.g. if a later batch overwrites something an earlier batch reads.
+	
+	std::vector<Batch_Accesses> accesses(app->batches.size());
+	for(int batch_idx = 0; batch_idx < app->batches.size(); ++batch_idx) {
+		auto &run_batch = app->batches[batch_idx];
+		auto &acc = accesses[batch_idx];
+		register_accesses(run_batch.run_code, acc);
+		
+		// The solver writes the ODE variables and its step size, which don't show up as assignments in the code.
+		if(is_valid(run_batch.solver_id)) {
+			for(auto &array : batches[batch_idx].arrays_ode) {
+				for(int instr_id : array.instr_ids)
+					acc.writes.insert(instructions[instr_id].var_id);
+			}
+			for(auto var_id : app->vars.all_state_vars()) {
+				auto var = app->vars[var_id];
+				if(var->type == State_Var::Type::step_resolution && as<State_Var::Type::step_resolution>(var)->solver_id == run_batch.solver_id)
+					acc.writes.insert(var_id);
+			}
+		}
+		run_batch.uses_random = acc.uses_random;
+		run_batch.external    = acc.external;
+		run_batch.reads.assign(acc.reads.begin(), acc.reads.end());
+		run_batch.writes.assign(acc.writes.begin(), acc.writes.end());
+		run_batch.parameters.assign(acc.parameters.begin(), acc.parameters.end());
+		
+		for(int other_idx = 0; other_idx < batch_idx; ++other_idx) {
+			if(accesses_conflict(accesses[other_idx], acc))
+				run_batch.depends_on.push_back(other_idx);
+		}
+	}
+	
+	if(!app->model->config.concurrent_batches) return;
+	
+	// Put each batch in the first level after all the ones it depends on. Running the levels in order with a barrier between them then respects all dependencies.
+	std::vector<int> level_of(app->batches.size(), 0);
+	std::vector<std::vector<int>> levels;
+	for(int batch_idx = 0; batch_idx < app->batches.size(); ++batch_idx) {
+		int level = 0;
+		for(int dep : app->batches[batch_idx].depends_on)
+			level = std::max(level, level_of[dep] + 1);
+		level_of[batch_idx] = level;
+		if(level >= levels.size()) levels.resize(level+1);
+		
+		// A batch that uses the random generator has to be run with the main run state (see run_level_range in run_model.cpp). There can only be one of them in a level.
+		if(app->batches[batch_idx].uses_random)
+			levels[level].insert(levels[level].begin(), batch_idx);
+		else
+			levels[level].push_back(batch_idx);
+	}
+	
+	// If nothing can be run at the same time, it is better to use the normal sequential loop.
+	bool any_concurrent = false;
+	for(auto &level : levels)
+		if(level.size() > 1) any_concurrent = true;
+	if(any_concurrent)
+		app->batch_levels = std::move(levels);
+}
+
 
 void
 add_array(
 	std::vector<Multi_Array_Structure<Var_Id>> &result_structure, 
 	std::vector<Multi_Array_Structure<Var_Id>> &temp_result_structure,
 	Batch_Array &array, 
-	std::vector<Model_Instruction> &instructions
+	std::vector<Model_Instruction> &instructions,
+	bool is_ode = false
 ) {
 	std::vector<Entity_Id> index_sets;
 	for(auto index_set : array.index_sets)
@@ -1771,6 +1945,7 @@ add_array(
 	if(!result_handles.empty()) {
 		std::vector<Entity_Id> index_sets2 = index_sets;
 		Multi_Array_Structure<Var_Id> arr(std::move(index_sets2), std::move(result_handles));
+		arr.contiguous = is_ode;
 		result_structure.push_back(std::move(arr));
 	}
 	if(!temp_result_handles.empty()) {
@@ -1793,7 +1968,7 @@ set_up_result_structure(Model_Application *app, std::vector<Batch> &batches, std
 	std::vector<Multi_Array_Structure<Var_Id>> temp_result_structure;
 	for(auto &batch : batches) {
 		for(auto &array : batch.arrays)      add_array(result_structure, temp_result_structure, array, instructions);
-		for(auto &array : batch.arrays_ode)  add_array(result_structure, temp_result_structure, array, instructions); // The ODEs will never be added to temp results or asserts in reality, but this is easier for code reuse. A bit inefficient though.
+		for(auto &array : batch.arrays_ode)  add_array(result_structure, temp_result_structure, array, instructions, true); // The ODEs will never be added to temp results or asserts in reality, but this is easier for code reuse. A bit inefficient though.
 	}
 	
 	{
@@ -1807,8 +1982,8 @@ set_up_result_structure(Model_Application *app, std::vector<Batch> &batches, std
 		result_structure.push_back(std::move(arr));
 	}
 	
-	app->result_structure.set_up(std::move(result_structure));
-	app->temp_result_structure.set_up(std::move(temp_result_structure));
+	app->result_structure.set_up(std::move(result_structure), true);
+	app->temp_result_structure.set_up(std::move(temp_result_structure), true);
 }
 
 void
@@ -1895,6 +2070,166 @@ validate_batch_structure(Model_Application *app, const std::vector<Batch> &batch
 
 static int llvm_module_instance = 0; //TODO: This may not be the best way to do it
 
+#if !MOBIUS_NO_LLVM
+static void
+generate_llvm_modules(Model_Application *app, LLVM_Constant_Data *constants, int module_instance, std::vector<LLVM_Module_Data *> &modules, bool single_module = false) {
+	
+	// Each batch goes in a separate module so that they can be compiled in parallel (see jit_compile_modules), unless we want all the code in
+	// one object file (see jit_export_object_file).
+	auto new_llvm_module = [&]() {
+		if(single_module && !modules.empty())
+			return modules[0];
+		auto llvm_data = create_llvm_module(module_instance);
+		jit_add_global_data(llvm_data, constants);
+		modules.push_back(llvm_data);
+		return llvm_data;
+	};
+	
+	jit_add_batch(app->initial_batch.run_code, "initial_values", new_llvm_module());
+	
+	int batch_idx = 0;
+	for(auto &batch : app->batches) {
+		auto llvm_data = new_llvm_module();
+		std::string function_name = std::string("batch_function_") + std::to_string(batch_idx);
+		jit_add_batch(batch.run_code, function_name, llvm_data);
+		if(batch.jacobian_run_code)
+			jit_add_batch(batch.jacobian_run_code, std::string("jacobian_function_") + std::to_string(batch_idx), llvm_data);
+		if(batch.instance_run_code)
+			jit_add_instance_batch(batch.instance_run_code, std::string("instance_function_") + std::to_string(batch_idx), llvm_data);
+		++batch_idx;
+	}
+	
+	if(app->model->config.jit_step_loop) {
+		std::vector<Step_Loop_Batch> loop_batches;
+		batch_idx = 0;
+		for(auto &batch : app->batches) {
+			Step_Loop_Batch loop_batch;
+			loop_batch.function_name = std::string("batch_function_") + std::to_string(batch_idx);
+			loop_batch.on_solver     = is_valid(batch.solver_id);
+			loop_batches.push_back(loop_batch);
+			++batch_idx;
+		}
+		jit_add_step_loop(loop_batches, app->result_structure.total_count, app->series_structure.total_count, std::string("step_loop"), new_llvm_module());
+	}
+}
+
+#endif
+
+static void
+set_compiled_functions(Model_Application *app, bool has_step_loop, const std::function<void *(const std::string &)> &find_function) {
+	
+	// NOTE: The run code is deleted after compile(), so when the optimized code is swapped in we check the current table for which functions exist instead.
+	const Compiled_Functions *current = app->compiled_functions.load();
+	
+	auto functions = new Compiled_Functions();
+	functions->initial_code = (batch_function *)find_function(std::string("initial_values"));
+	int batch_idx = 0;
+	for(auto &batch : app->batches) {
+		std::string function_name = std::string("batch_function_") + std::to_string(batch_idx);
+		functions->batch_code.push_back((batch_function *)find_function(function_name));
+		
+		batch_function *jacobian_code = nullptr;
+		if(batch.jacobian_run_code || (current && current->jacobian_code[batch_idx]))
+			jacobian_code = (batch_function *)find_function(std::string("jacobian_function_") + std::to_string(batch_idx));
+		functions->jacobian_code.push_back(jacobian_code);
+		
+		parallel_loop_function *instance_code = nullptr;
+		if(batch.instance_run_code || (current && current->instance_code[batch_idx]))
+			instance_code = (parallel_loop_function *)find_function(std::string("instance_function_") + std::to_string(batch_idx));
+		functions->instance_code.push_back(instance_code);
+		++batch_idx;
+	}
+	if(has_step_loop)
+		functions->step_loop = (step_loop_function *)find_function(std::string("step_loop"));
+	
+	// NOTE: The table is complete before it is published, so a run that starts on another thread sees either all of the old functions or all of the new ones.
+	app->compiled_function_tables.push_back(std::unique_ptr<Compiled_Functions>(functions));
+	app->compiled_functions.store(functions);
+}
+
+#if !MOBIUS_NO_LLVM
+static void
+set_jitted_functions(Model_Application *app, int module_instance) {
+	
+	// NOTE: The typed lookups all do the same thing, so it doesn't matter which one we use.
+	set_compiled_functions(app, app->model->config.jit_step_loop, [module_instance](const std::string &function_name) {
+		return (void *)get_jitted_batch_function(module_instance, function_name);
+	});
+}
+#endif
+
+static u64
+compiled_code_signature(Model_Application *app) {
+	
+	// Precompiled code can only be used with the model application it was made from, or one that would produce the exact same code. The code
+	// trees have the model equations and the values of baked parameters, but the index counts and connection data are also put into the code
+	// as constants, as are the offsets into the data, so we include the structure sizes too.
+	std::stringstream ss;
+	ss.precision(17);
+	print_tree(app, app->initial_batch.run_code, ss);
+	for(auto &batch : app->batches) {
+		ss << "\n";
+		print_tree(app, batch.run_code, ss);
+		if(batch.jacobian_run_code) {
+			ss << "\n";
+			print_tree(app, batch.jacobian_run_code, ss);
+		}
+		if(batch.instance_run_code) {
+			ss << "\n";
+			print_tree(app, batch.instance_run_code, ss);
+		}
+	}
+	ss << "\n" << app->parameter_structure.total_count << " " << app->series_structure.total_count << " " << app->additional_series_structure.total_count
+		<< " " << app->result_structure.total_count << " " << app->temp_result_structure.total_count << " " << app->model->config.jit_step_loop << " " << app->model->config.aligned_storage << "\n";
+	for(s64 idx = 0; idx < app->index_counts_structure.total_count; ++idx)
+		ss << app->data.index_counts.data[idx] << " ";
+	for(s64 idx = 0; idx < app->connection_structure.total_count; ++idx)
+		ss << app->data.connections.data[idx] << " ";
+	
+	// 64-bit FNV-1a.
+	std::string str = ss.str();
+	u64 hash = 14695981039346656037ull;
+	for(char c : str) {
+		hash ^= (u8)c;
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+static void
+load_precompiled_code(Model_Application *app, const std::string &file_name) {
+	
+	void *library = load_shared_library(file_name);
+	if(!library)
+		fatal_error(Mobius_Error::api_usage, "Unable to load the precompiled model code \"", file_name, "\": ", shared_library_error());
+	
+	auto info = (Compiled_Code_Info *)find_library_symbol(library, "mobius_compiled_code_info");
+	if(!info || info->format != compiled_code_format)
+		fatal_error(Mobius_Error::api_usage, "The library \"", file_name, "\" does not contain model code exported from this version of Mobius2.");
+	if(info->batch_count != app->batches.size() || info->signature != compiled_code_signature(app))
+		fatal_error(Mobius_Error::api_usage, "The precompiled code in \"", file_name, "\" was made from a different model, or from data with a different index structure or different values for baked parameters. It has to be exported again.");
+	
+	set_compiled_functions(app, info->has_step_loop, [&](const std::string &function_name) {
+		void *fun = find_library_symbol(library, function_name);
+		if(!fun)
+			fatal_error(Mobius_Error::api_usage, "The precompiled code in \"", file_name, "\" is missing the function ", function_name, ".");
+		return fun;
+	});
+}
+
+void
+Model_Application::use_optimized_code() {
+	
+	// NOTE: Only one thread gets to swap them in. A run that is starting on another thread at the same time gets either the old or the new
+	// function table (see set_compiled_functions).
+	if(!optimized_ready.exchange(false)) return;
+	
+#if !MOBIUS_NO_LLVM
+	set_jitted_functions(this, optimized_instance);
+	optimizing_thread.join();
+#endif
+}
+
 void
 Model_Application::compile(bool store_code_strings) {
 	
@@ -2030,6 +2365,7 @@ Model_Application::compile(bool store_code_strings) {
 	constants.connection_data_count  = connection_structure.total_count;
 	constants.index_count_data       = data.index_counts.data;
 	constants.index_count_data_count = index_counts_structure.total_count;
+	constants.aligned_data           = model->config.aligned_storage;
 	
 #if 0
 	log_print("****Connection data is:\n");
@@ -2042,17 +2378,12 @@ Model_Application::compile(bool store_code_strings) {
 		log_print(" ", constants.index_count_data[idx]);
 	log_print("\n");
 #endif
-	jit_add_global_data(llvm_data, &constants, llvm_module_instance);
-	
-	std::string instance_sub = std::string("_") + std::to_string(llvm_module_instance);
-	
 	this->initial_batch.run_code = generate_run_code(this, &initial_batch, initial_instructions, true);
-	jit_add_batch(this->initial_batch.run_code, std::string("initial_values") + instance_sub, llvm_data);
 
-	int batch_idx = 0;
 	for(auto &batch : batches) {
 		Run_Batch new_batch;
 		new_batch.run_code = generate_run_code(this, &batch, instructions, false);
+		new_batch.description = batch_description(this, batch, instructions);
 		
 		if(is_valid(batch.solver)) {
 			new_batch.solver_id    = batch.solver;
@@ -2073,16 +2404,31 @@ Model_Application::compile(bool store_code_strings) {
 				new_batch.h_address = result_structure.get_offset_base(var_id);
 				break;
 			}
+			
+			auto solver = model->solvers[batch.solver];
+			if(solver->per_instance) {
+				new_batch.instance_run_code = generate_instance_code(this, &batch, instructions, new_batch.run_code, &new_batch.instance_count, &new_batch.instance_n_ode);
+				if(!new_batch.instance_run_code)
+					log_print("The instances of the batch \"", new_batch.description, "\" are not independent, so it is integrated as a whole even though the solver \"", solver->name, "\" is @per_instance.\n");
+			}
+			
+			auto solver_fun = model->solver_functions[solver->solver_fun];
+			if(solver_fun->uses_jacobian && !new_batch.instance_run_code) {
+				std::vector<std::set<int>> derivative_deps;
+				bool found = emulate_ode_dependencies(new_batch.run_code, new_batch.first_ode_offset, new_batch.n_ode, data.connections.data, connection_structure.total_count,
+					data.index_counts.data, index_counts_structure.total_count, derivative_deps);
+				if(found)
+					set_up_jacobian_sparsity(&new_batch.jacobian_sparsity, derivative_deps);
+				new_batch.jacobian_run_code = generate_jacobian_code(this, new_batch.run_code);
+			}
 		}
 		
-		std::string function_name = std::string("batch_function_") + std::to_string(batch_idx) + instance_sub;
-		jit_add_batch(new_batch.run_code, function_name, llvm_data);
-		
 		this->batches.push_back(new_batch);
-		
-		++batch_idx;
 	}
 	
+	schedule_batches(this, batches, instructions);
+	set_up_initial_value_sources(this);
+	
 	std::string *ir_string = nullptr;
 	if(store_code_strings) {
 		
@@ -2106,16 +2452,53 @@ Model_Application::compile(bool store_code_strings) {
 		ir_string = &this->llvm_ir;
 	}
 	
-	++llvm_module_instance;
+	int module_instance = llvm_module_instance++;
 	
-	jit_compile_module(llvm_data, ir_string);
-	
-	this->initial_batch.compiled_code = get_jitted_batch_function(std::string("initial_values") + instance_sub);
-	batch_idx = 0;
-	for(auto &batch : this->batches) {
-		std::string function_name = std::string("batch_function_") + std::to_string(batch_idx) + instance_sub;
-		batch.compiled_code = get_jitted_batch_function(function_name);
-		++batch_idx;
+	if(!model->config.precompiled_code_file.empty()) {
+		load_precompiled_code(this, model->config.precompiled_code_file);
+	} else {
+#if MOBIUS_NO_LLVM
+		fatal_error(Mobius_Error::api_usage, "This build of Mobius2 can only run models from precompiled code.");
+#else
+		if(!model->config.export_code_file.empty()) {
+			// NOTE: The exported code goes in a single module that is named the same way as the JIT modules, so it has the same function names.
+			std::vector<LLVM_Module_Data *> export_modules;
+			generate_llvm_modules(this, &constants, module_instance, export_modules, true);
+			Compiled_Code_Info info = { compiled_code_format, (s64)batches.size(), model->config.jit_step_loop, compiled_code_signature(this) };
+			jit_export_object_file(export_modules[0], &info, model->config.export_code_file);
+			free_llvm_module(export_modules[0]);
+		}
+		
+		generate_llvm_modules(this, &constants, module_instance, llvm_modules);
+		
+		if(model->config.tiered_compilation && !ir_string) {
+			// Start out with unoptimized code so that the model can be run right away, and optimize the code on a separate thread. The optimized code
+			// is put in use before the first run that starts after it is done (see use_optimized_code).
+			int fast_instance = llvm_module_instance++;
+			std::vector<LLVM_Module_Data *> fast_modules;
+			generate_llvm_modules(this, &constants, fast_instance, fast_modules);
+			jit_compile_modules(fast_modules, nullptr, "", false);
+			set_jitted_functions(this, fast_instance);
+			
+			std::vector<LLVM_Module_Data *> optimized_modules = llvm_modules;
+			llvm_modules.insert(llvm_modules.end(), fast_modules.begin(), fast_modules.end());
+			
+			optimized_instance = module_instance;
+			std::string cache_path = model->config.jit_cache_dir;
+			optimizing_thread = std::thread([this, optimized_modules, cache_path]() {
+				try {
+					// NOTE: We don't use the worker pool here, since it could be needed by model runs that happen in the meantime.
+					jit_compile_modules(optimized_modules, nullptr, cache_path, true, false);
+					optimized_ready = true;
+				} catch(int) {
+					// If it fails for some reason we just keep using the unoptimized code.
+				}
+			});
+		} else {
+			jit_compile_modules(llvm_modules, ir_string, model->config.jit_cache_dir);
+			set_jitted_functions(this, module_instance);
+		}
+#endif
 	}
 	
 	is_compiled = true;
@@ -2155,6 +2538,14 @@ Model_Application::compile(bool store_code_strings) {
 		delete batch.run_code;
 		batch.run_code = nullptr;
 	}
+	for(auto &batch : this->batches) {
+		if(batch.jacobian_run_code)
+			delete batch.jacobian_run_code;
+		batch.jacobian_run_code = nullptr;
+		if(batch.instance_run_code)
+			delete batch.instance_run_code;
+		batch.instance_run_code = nullptr;
+	}
 	
 #endif
 	
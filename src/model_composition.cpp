@@ -28,6 +28,7 @@
 
 #include <sstream>
 #include <map>
+#include <functional>
 
 void
 check_if_var_loc_is_well_formed(Mobius_Model *model, Var_Location &loc, Source_Location &source_loc) {
@@ -1592,6 +1593,174 @@ process_external_computation_code(Model_Application *app, Var_Id var_id, bool in
 		var2->initial_code = owns_code(external_comp);
 }
 
+void
+for_each_identifier(Math_Expr_FT *expr, const std::function<void(Identifier_Data *)> &fun) {
+	if(!expr) return;
+	for(auto child : expr->exprs)
+		for_each_identifier(child, fun);
+	if(expr->expr_type == Math_Expr_Type::identifier)
+		fun(static_cast<Identifier_FT *>(expr));
+	else if(expr->expr_type == Math_Expr_Type::external_computation) {
+		for(auto &arg : static_cast<External_Computation_FT *>(expr)->arguments)
+			fun(&arg);
+	}
+}
+
+void
+for_each_code(State_Var *var, const std::function<void(Math_Expr_FT *)> &fun) {
+	// NOTE: We don't use as<>() here since we also want to visit invalidated variables.
+	fun(var->unit_conversion_tree.get());
+	fun(var->specific_target.get());
+	if(var->type == State_Var::Type::declared) {
+		auto var2 = static_cast<State_Var_Sub<State_Var::Type::declared> *>(var);
+		fun(var2->function_tree.get());
+		fun(var2->initial_function_tree.get());
+	} else if(var->type == State_Var::Type::regular_aggregate) {
+		fun(static_cast<State_Var_Sub<State_Var::Type::regular_aggregate> *>(var)->aggregation_weight_tree.get());
+	} else if(var->type == State_Var::Type::parameter_aggregate) {
+		fun(static_cast<State_Var_Sub<State_Var::Type::parameter_aggregate> *>(var)->aggregation_weight_tree.get());
+	} else if(var->type == State_Var::Type::connection_aggregate) {
+		for(auto &data : static_cast<State_Var_Sub<State_Var::Type::connection_aggregate> *>(var)->conversion_data) {
+			fun(data.weight.get());
+			fun(data.unit_conv.get());
+		}
+	} else if(var->type == State_Var::Type::external_computation) {
+		auto var2 = static_cast<State_Var_Sub<State_Var::Type::external_computation> *>(var);
+		fun(var2->code.get());
+		fun(var2->initial_code.get());
+	}
+}
+
+void
+for_each_var_id_field(State_Var *var, const std::function<void(Var_Id &)> &fun) {
+	fun(var->var_id);
+	if(var->type == State_Var::Type::declared) {
+		auto var2 = static_cast<State_Var_Sub<State_Var::Type::declared> *>(var);
+		fun(var2->conc);
+		fun(var2->external_computation);
+		for(auto &id : var2->conn_source_aggs) fun(id);
+		for(auto &id : var2->conn_target_aggs) fun(id);
+		for(auto &id : var2->no_carry) fun(id);
+	} else if(var->type == State_Var::Type::in_flux_aggregate) {
+		fun(static_cast<State_Var_Sub<State_Var::Type::in_flux_aggregate> *>(var)->in_flux_to);
+	} else if(var->type == State_Var::Type::regular_aggregate) {
+		fun(static_cast<State_Var_Sub<State_Var::Type::regular_aggregate> *>(var)->agg_of);
+	} else if(var->type == State_Var::Type::dissolved_conc) {
+		auto var2 = static_cast<State_Var_Sub<State_Var::Type::dissolved_conc> *>(var);
+		fun(var2->conc_of);
+		fun(var2->conc_in);
+	} else if(var->type == State_Var::Type::dissolved_flux) {
+		fun(static_cast<State_Var_Sub<State_Var::Type::dissolved_flux> *>(var)->flux_of_medium);
+	} else if(var->type == State_Var::Type::connection_aggregate) {
+		auto var2 = static_cast<State_Var_Sub<State_Var::Type::connection_aggregate> *>(var);
+		fun(var2->agg_for);
+		for(auto &data : var2->conversion_data) fun(data.source_id);
+	} else if(var->type == State_Var::Type::external_computation) {
+		auto var2 = static_cast<State_Var_Sub<State_Var::Type::external_computation> *>(var);
+		for(auto &id : var2->targets) fun(id);
+		for(auto &id : var2->initial_targets) fun(id);
+	}
+}
+
+void
+demote_unselected_series(Model_Application *app) {
+	
+	// If the user only wants a few of the series to be stored, we change everything else to be a temp_var (as if it was @no_store).
+	// The type of a Var_Id can't be decided before everything is registered and resolved (since we must know what is looked up using last() etc.),
+	// so we have to patch up all references to the variables afterwards.
+	
+	auto model = app->model;
+	auto &vars = app->vars;
+	
+	std::set<Var_Id> selected;
+	for(auto &name : model->config.store_only_series) {
+		bool found = false;
+		for(auto var_id : vars.all_state_vars()) {
+			if((name.data()[0] == ':' && app->serialize(var_id) == name) || vars[var_id]->name == name) {
+				selected.insert(var_id);
+				found = true;
+			}
+		}
+		if(!found)
+			log_print("Warning: The series \"", name, "\" that was selected to be stored does not exist in the model.\n");
+	}
+	
+	// Values that are looked up using last() must be stored, as must ODE variables (since the solver needs them to be contiguous in the result data).
+	std::set<Var_Id> must_store;
+	auto find_last = [&](Math_Expr_FT *code) {
+		for_each_identifier(code, [&](Identifier_Data *ident) {
+			if(ident->variable_type == Variable_Type::series && ident->has_flag(Identifier_Data::last_result))
+				must_store.insert(ident->var_id);
+		});
+	};
+	for(auto &var : vars.state_vars) for_each_code(var.get(), find_last);
+	for(auto &var : vars.asserts)    for_each_code(var.get(), find_last);
+	
+	std::set<Var_Id> on_solver;
+	for(auto solver_id : model->solvers) {
+		for(auto &pair : model->solvers[solver_id]->locs)
+			on_solver.insert(vars.id_of(pair.first));
+	}
+	
+	std::vector<bool> demote(vars.count(Var_Id::Type::state_var), false);
+	int n_demoted = 0;
+	for(auto var_id : vars.all_state_vars()) {
+		if(var_id.type != Var_Id::Type::state_var) continue;
+		if(selected.find(var_id) != selected.end() || must_store.find(var_id) != must_store.end()) continue;
+		auto var = vars[var_id];
+		if(var->type == State_Var::Type::step_resolution) continue;
+		if(var->is_mass_balance_quantity()) {
+			// Dissolved quantities inherit the solver of what they are dissolved in.
+			Var_Location loc = var->loc1;
+			bool solved = on_solver.find(vars.id_of(loc)) != on_solver.end();
+			while(!solved && loc.is_dissolved()) {
+				loc = remove_dissolved(loc);
+				solved = on_solver.find(vars.id_of(loc)) != on_solver.end();
+			}
+			if(solved) continue;
+		}
+		demote[var_id.id] = true;
+		++n_demoted;
+	}
+	if(!n_demoted) return;
+	
+	auto retype = [&](Var_Id &id) {
+		if(id.type == Var_Id::Type::state_var && demote[id.id])
+			id.type = Var_Id::Type::temp_var;
+	};
+	auto retype_code = [&](Math_Expr_FT *code) {
+		for_each_identifier(code, [&](Identifier_Data *ident) {
+			if(ident->variable_type == Variable_Type::series)
+				retype(ident->var_id);
+		});
+	};
+	
+	// NOTE: additional_series don't have code or references to other variables.
+	for(auto type : { Var_Id::Type::state_var, Var_Id::Type::series, Var_Id::Type::assertion }) {
+		for(auto &var : vars.get_vec(type)) {
+			for_each_var_id_field(var.get(), retype);
+			for_each_code(var.get(), retype_code);
+		}
+	}
+	for(auto &var : vars.state_vars) {
+		if(demote[var->var_id.id])
+			var->store_series = false;
+	}
+	
+	for(auto &pair : vars.location_to_id)
+		retype(pair.second);
+	for(auto &pair : vars.name_to_id) {
+		std::set<Var_Id> ids;
+		for(auto id : pair.second) {
+			retype(id);
+			ids.insert(id);
+		}
+		pair.second = std::move(ids);
+	}
+	
+	log_print(Log_Mode::dev, "Demoted ", n_demoted, " state variables to temporary storage since they were not selected to be stored.\n");
+}
+
 void
 Model_Application::compose_and_resolve() {
 	
@@ -2054,6 +2223,9 @@ Model_Application::compose_and_resolve() {
 			check_valid_distribution_of_dependencies(this, var2->specific_target.get(), var2->allowed_index_sets, loc);
 	}
 	
+	if(!model->config.store_only_series.empty() && !model->config.store_all_series)
+		demote_unselected_series(this);
+	
 	for(auto var_id : vars.all_state_vars()) {
 		auto var = vars[var_id];
 		serial_to_id[serialize(var_id)] = var_id;
@@ -121,9 +121,16 @@ register_intrinsics(Mobius_Model *model) {
 	
 	auto euler_id = model->solver_functions.create_internal(mod_scope, "euler", "Euler", Decl_Type::solver_function);
 	auto dascru_id = model->solver_functions.create_internal(mod_scope, "inca_dascru", "INCADascru", Decl_Type::solver_function);
+	auto rosenbrock_id = model->solver_functions.create_internal(mod_scope, "rosenbrock4", "Rosenbrock4", Decl_Type::solver_function);
+	auto dopri_id = model->solver_functions.create_internal(mod_scope, "dormand_prince", "DormandPrince", Decl_Type::solver_function);
 	
 	model->solver_functions[euler_id]->solver_fun = &euler_solver;
 	model->solver_functions[dascru_id]->solver_fun = &inca_dascru;
+	model->solver_functions[rosenbrock_id]->solver_fun = &rosenbrock4;
+	model->solver_functions[rosenbrock_id]->workspace_size = &rosenbrock4_workspace_size;
+	model->solver_functions[rosenbrock_id]->uses_jacobian = true;
+	model->solver_functions[dopri_id]->solver_fun = &dormand_prince;
+	model->solver_functions[dopri_id]->workspace_size = &dormand_prince_workspace_size;
 	
 	// Create a empty preamble that can be passed to module loads when you don't want to pass an optional preamble
 	// (can be used if the parts of the module that rely on the preamble are ruled out by an option)
@@ -1558,9 +1565,32 @@ Index_Set_Registration::process_declaration(Catalog *catalog) {
 
 void
 Solver_Function_Registration::process_declaration(Catalog *catalog) {
-
-	// TODO: Make it possible to load solver functions dynamically from dlls.
-	fatal_error(Mobius_Error::internal, "Unimplemented: Solver_Function_Registration::process_declaration");
+	
+	// A solver function from a shared library (the built-in ones are set up in register_intrinsics). The library must export the function with
+	// the given name as a Solver_Function (with C linkage), and can also export <name>_workspace_size as a Solver_Workspace_Size.
+	// It has to be compiled against the same version of ode_solvers.h as this.
+	match_declaration(decl, {{Token_Type::quoted_string, Token_Type::quoted_string}});
+	
+	set_serial_name(catalog, this);
+	
+	std::string file_name = single_arg(decl, 0)->string_value;
+	std::string symbol    = single_arg(decl, 1)->string_value;
+	std::string path = make_path_relative_to(file_name, decl->source_loc.filename);
+	
+	void *library = load_shared_library(path);
+	if(!library) {
+		single_arg(decl, 0)->source_loc.print_error_header(Mobius_Error::model_building);
+		fatal_error("Unable to load the shared library \"", path, "\": ", shared_library_error());
+	}
+	
+	solver_fun = (Solver_Function *)find_library_symbol(library, symbol);
+	if(!solver_fun) {
+		single_arg(decl, 1)->source_loc.print_error_header(Mobius_Error::model_building);
+		fatal_error("The shared library \"", path, "\" does not have a function called \"", symbol, "\".");
+	}
+	workspace_size = (Solver_Workspace_Size *)find_library_symbol(library, symbol + "_workspace_size");
+	
+	has_been_processed = true;
 }
 
 void
@@ -1571,7 +1601,7 @@ Solver_Registration::process_declaration(Catalog *catalog) {
 		{Token_Type::quoted_string, Decl_Type::solver_function, Decl_Type::unit, Token_Type::real},
 		{Token_Type::quoted_string, Decl_Type::solver_function, Decl_Type::par_real},
 		{Token_Type::quoted_string, Decl_Type::solver_function, Decl_Type::par_real, Decl_Type::par_real},
-	});
+	}, true, 0, true);
 	
 	set_serial_name(catalog, this);
 	auto scope = catalog->get_scope(scope_id);
@@ -1608,6 +1638,28 @@ Solver_Registration::process_declaration(Catalog *catalog) {
 		}
 	}
 	
+	for(auto note : decl->notes) {
+		auto str = note->decl.string_value;
+		if(str == "tolerance") {
+			match_declaration_base(note, {{Token_Type::real, Token_Type::real}}, 0);
+			rel_tol = single_arg(note, 0)->double_value();
+			abs_tol = single_arg(note, 1)->double_value();
+			if(!(rel_tol > 0.0) || !(abs_tol >= 0.0)) {
+				note->decl.print_error_header();
+				fatal_error("The relative tolerance of a solver must be positive, and the absolute tolerance can not be negative.");
+			}
+		} else if(str == "per_instance") {
+			match_declaration_base(note, {{}}, 0);
+			per_instance = true;
+		} else if(str == "interpolate") {
+			match_declaration_base(note, {{}}, 0);
+			interpolate = true;
+		} else {
+			note->decl.print_error_header();
+			fatal_error("Unrecognized note type '", str, "' for solver declaration.");
+		}
+	}
+	
 	has_been_processed = true;
 }
 
@@ -1785,6 +1837,18 @@ load_config(String_View file_name) {
 				single_arg(decl, 0)->print_error_header();
 				fatal_error("The path \"", config.mobius_base_path, "\" is not a valid directory path.");
 			}
+		} else if(item == "JIT cache path") {
+			match_declaration(decl, {{Token_Type::quoted_string, Token_Type::quoted_string}}, false);
+			
+			config.jit_cache_dir = make_path_relative_to(single_arg(decl, 1)->string_value, file_name);
+		} else if(item == "Export compiled code") {
+			match_declaration(decl, {{Token_Type::quoted_string, Token_Type::quoted_string}}, false);
+			
+			config.export_code_file = make_path_relative_to(single_arg(decl, 1)->string_value, file_name);
+		} else if(item == "Precompiled code") {
+			match_declaration(decl, {{Token_Type::quoted_string, Token_Type::quoted_string}}, false);
+			
+			config.precompiled_code_file = make_path_relative_to(single_arg(decl, 1)->string_value, file_name);
 		} else if(item == "Developer mode") {
 			match_declaration(decl, {{Token_Type::quoted_string, Token_Type::boolean}}, false);
 			
@@ -1797,6 +1861,31 @@ load_config(String_View file_name) {
 			match_declaration(decl, {{Token_Type::quoted_string, Token_Type::boolean}}, false);
 			
 			config.store_transport_fluxes = single_arg(decl, 1)->val_bool;
+		} else if(item == "Compile step loop") {
+			match_declaration(decl, {{Token_Type::quoted_string, Token_Type::boolean}}, false);
+			
+			config.jit_step_loop = single_arg(decl, 1)->val_bool;
+		} else if(item == "Parallel instances") {
+			match_declaration(decl, {{Token_Type::quoted_string, Token_Type::boolean}}, false);
+			
+			config.parallel_instances = single_arg(decl, 1)->val_bool;
+		} else if(item == "Concurrent batches") {
+			match_declaration(decl, {{Token_Type::quoted_string, Token_Type::boolean}}, false);
+			
+			config.concurrent_batches = single_arg(decl, 1)->val_bool;
+		} else if(item == "Tiered compilation") {
+			match_declaration(decl, {{Token_Type::quoted_string, Token_Type::boolean}}, false);
+			
+			config.tiered_compilation = single_arg(decl, 1)->val_bool;
+		} else if(item == "Aligned storage") {
+			match_declaration(decl, {{Token_Type::quoted_string, Token_Type::boolean}}, false);
+			
+			config.aligned_storage = single_arg(decl, 1)->val_bool;
+		} else if(item == "Only store series") {
+			match_declaration(decl, {{Token_Type::quoted_string, {Token_Type::quoted_string, true}}}, false);
+			
+			for(int idx = 1; idx < decl->args.size(); ++idx)
+				config.store_only_series.push_back(single_arg(decl, idx)->string_value);
 		} else {
 			decl->source_loc.print_error_header();
 			fatal_error("Unknown config option \"", item, "\".");
@@ -2132,6 +2221,7 @@ load_model(String_View file_name, Mobius_Config *config, Model_Options *options)
 		Decl_Type::function,
 		Decl_Type::index_set,
 		Decl_Type::solver,
+		Decl_Type::solver_function,
 		Decl_Type::assert,
 	};
 	
@@ -2182,7 +2272,8 @@ load_model(String_View file_name, Mobius_Config *config, Model_Options *options)
 		model->index_sets[id]->process_declaration(model);
 	
 	for(auto id : scope->all_ids) {
-		if(id.reg_type == Reg_Type::component || id.reg_type == Reg_Type::connection || id.reg_type == Reg_Type::par_group || id.reg_type == Reg_Type::constant || id.reg_type == Reg_Type::unit || id.reg_type == Reg_Type::function || id.reg_type == Reg_Type::assert) {
+		if(id.reg_type == Reg_Type::component || id.reg_type == Reg_Type::connection || id.reg_type == Reg_Type::par_group || id.reg_type == Reg_Type::constant || id.reg_type == Reg_Type::unit || id.reg_type == Reg_Type::function || id.reg_type == Reg_Type::assert
+			|| id.reg_type == Reg_Type::solver_function) {
 			auto entity = model->find_entity(id);
 			if(!entity->has_been_processed) // Note: happens if it was internally created.
 				entity->process_declaration(model);
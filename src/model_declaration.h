@@ -264,6 +264,14 @@ Solver_Registration : Registration_Base {
 	double hmin;
 	Entity_Id h_par = invalid_entity_id;
 	Entity_Id hmin_par = invalid_entity_id;
+	// Error tolerances from the @tolerance note. Not all solver functions use them. The defaults give the same tolerance as the fixed one in
+	// inca_dascru for values that are not close to 0.
+	double rel_tol = 0.0005;
+	double abs_tol = 5e-7;
+	// From the @per_instance note. Integrate each instance of the batch separately with its own step size if the instances are independent.
+	bool per_instance = false;
+	// From the @interpolate note. Quantities solved by other solvers are interpolated over the time step when this solver reads them.
+	bool interpolate = false;
 	std::vector<std::pair<Specific_Var_Location, Source_Location>> locs; // NOTE: We use a specific_var_location to merge some functionality in model_composition.cpp, but all the data we need is really just in Var_Location
 	
 	void process_declaration(Catalog *catalog);
@@ -281,6 +289,8 @@ Assert_Registration : Registration_Base {
 struct
 Solver_Function_Registration : Registration_Base {
 	Solver_Function *solver_fun = nullptr;
+	Solver_Workspace_Size *workspace_size = nullptr; // If this is not set, the solver needs 4*n doubles of workspace.
+	bool                   uses_jacobian  = false;   // If the solver calls estimate_jacobian(), we find the sparsity pattern of the Jacobian and generate code for it when compiling the model.
 	
 	void process_declaration(Catalog *catalog);
 };
@@ -290,14 +300,46 @@ Mobius_Base_Config {
 	bool store_transport_fluxes = false;
 	bool store_all_series = false;
 	bool developer_mode   = false;
+	bool jit_step_loop    = false;  // Compile the entire time step loop into one function instead of calling each batch function from run_model.
+	bool parallel_instances = false; // Split loops over index sets between threads when the instances don't interact (see Math_Block_FT::is_parallel).
+	bool concurrent_batches = false; // Run batches that don't depend on each other at the same time (see Model_Application::batch_levels).
+	bool tiered_compilation = false; // Start with unoptimized code and swap in the optimized code when it is done (see Model_Application::compile).
+	bool aligned_storage    = false; // Pad the data so that each variable starts on an aligned address, which helps the vectorization of the generated code (see Storage_Structure::set_up).
+	
+	// If store_only_count > 0, only these series (given as serial names or variable names) are stored. Everything else is demoted to temp storage if possible.
+	// NOTE: This is only read when the Mobius_Config is constructed, so the strings don't need to outlive that.
+	char **store_only = nullptr;
+	s64    store_only_count = 0;
+	
+	char  *jit_cache_path = nullptr;  // Directory for compiled model code (see Mobius_Config::jit_cache_dir).
+	char  *export_code_path = nullptr;
+	char  *precompiled_code_path = nullptr;
 };
 
 struct
 Mobius_Config : Mobius_Base_Config {
 	std::string mobius_base_path;
+	std::string jit_cache_dir;   // If this is set, compiled model code is stored here and reused if the same model is built again.
+	std::string export_code_file;       // If this is set, the compiled model code is also written to this object file (see jit_export_object_file).
+	std::string precompiled_code_file;  // If this is set, the model code is loaded from this shared library instead of being compiled with LLVM.
+	std::vector<std::string> store_only_series;
 	
 	Mobius_Config() = default;
-	Mobius_Config(const Mobius_Base_Config &c) : Mobius_Base_Config(c) {}
+	Mobius_Config(const Mobius_Base_Config &c) : Mobius_Base_Config(c) {
+		for(s64 idx = 0; idx < store_only_count; ++idx)
+			store_only_series.push_back(store_only[idx]);
+		store_only = nullptr;
+		store_only_count = 0;
+		if(jit_cache_path)
+			jit_cache_dir = jit_cache_path;
+		jit_cache_path = nullptr;
+		if(export_code_path)
+			export_code_file = export_code_path;
+		export_code_path = nullptr;
+		if(precompiled_code_path)
+			precompiled_code_file = precompiled_code_path;
+		precompiled_code_path = nullptr;
+	}
 };
 
 struct
@@ -2,6 +2,8 @@
 #include "ode_solvers.h"
 
 #include <cmath>
+#include <limits>
+#include <algorithm>
 
 bool euler_solver(double *try_h, double hmin, int n, double *x0, Model_Run_State *run_state, batch_function ode_fun) {
 	double t = 0.0;
@@ -18,6 +20,7 @@ bool euler_solver(double *try_h, double hmin, int n, double *x0, Model_Run_State
 		}
 		
 		call_fun(ode_fun, run_state, t);
+		++run_state->rhs_evaluations;
 		t += h;
 		
 		for(int var_idx = 0; var_idx < n; ++var_idx)
@@ -70,6 +73,8 @@ bool inca_dascru(double *try_h, double hmin, int n, double *x0, Model_Run_State
 				// TODO: If h is extremely small or 0, shouldn't this just exit immediately?
 			}
 			
+			run_state->rhs_evaluations += 5; // Every attempted step evaluates the right hand side 5 times.
+			
 			call_fun(ode_fun, run_state, t);
 			for(int var_idx = 0; var_idx < n; ++var_idx) {
 				double dx = h * wk[var_idx] / 3.0;
@@ -124,6 +129,7 @@ bool inca_dascru(double *try_h, double hmin, int n, double *x0, Model_Run_State
 					h *= 0.5; // Reduce the step size.
 					run = true; // If we thought we reached the end of the integration, that may no longer be true since we are reducing the step size.
 					step_was_reduced = true;
+					++run_state->rejected_steps;
 
 					if(h < hmin) {
 						h = hmin;
@@ -149,4 +155,331 @@ bool inca_dascru(double *try_h, double hmin, int n, double *x0, Model_Run_State
 	}
 	
 	return true;
-}
\ No newline at end of file
+}
+
+// LU decomposition with partial pivoting of the n*n row major matrix A (in place). Returns false if A is singular.
+static bool
+lu_decompose(double *A, int n, int *pivot) {
+	for(int col = 0; col < n; ++col) {
+		int    max_row = col;
+		double max_val = std::abs(A[col*n + col]);
+		for(int row = col+1; row < n; ++row) {
+			double val = std::abs(A[row*n + col]);
+			if(val > max_val) { max_val = val; max_row = row; }
+		}
+		if(!(max_val > 0.0)) return false; // Also catches NaN
+		
+		pivot[col] = max_row;
+		if(max_row != col) {
+			for(int idx = 0; idx < n; ++idx)
+				std::swap(A[col*n + idx], A[max_row*n + idx]);
+		}
+		
+		double inv = 1.0 / A[col*n + col];
+		for(int row = col+1; row < n; ++row) {
+			double factor = (A[row*n + col] *= inv);
+			if(factor == 0.0) continue;
+			for(int idx = col+1; idx < n; ++idx)
+				A[row*n + idx] -= factor*A[col*n + idx];
+		}
+	}
+	return true;
+}
+
+// Solve A*x = b where A was decomposed by lu_decompose. b is overwritten with x.
+static void
+lu_solve(const double *A, int n, const int *pivot, double *b) {
+	for(int row = 0; row < n; ++row) {
+		if(pivot[row] != row) std::swap(b[row], b[pivot[row]]);
+		for(int idx = 0; idx < row; ++idx)
+			b[row] -= A[row*n + idx]*b[idx];
+	}
+	for(int row = n-1; row >= 0; --row) {
+		for(int idx = row+1; idx < n; ++idx)
+			b[row] -= A[row*n + idx]*b[idx];
+		b[row] /= A[row*n + row];
+	}
+}
+
+s64
+rosenbrock4_workspace_size(s64 n) {
+	// Derivatives, f0, backup of x0, 4 stages, the pivots (stored as ints in n doubles), the Jacobian and the LU decomposition.
+	// NOTE: The matrices are dense and indexed with ints, so n*n has to fit in an int. Long before that they would take more memory than we want
+	// to allocate anyway.
+	if(n*n > (s64)std::numeric_limits<int>::max()) return -1;
+	return 8*n + 2*n*n;
+}
+
+bool
+rosenbrock4(double *try_h, double hmin, int n, double *x0, Model_Run_State *run_state, batch_function ode_fun) {
+	// A Kaps-Rentrop type 4th order Rosenbrock method with an embedded 3rd order error estimate, using the parameters from
+	// Shampine, L.F. (1982) Implementation of Rosenbrock methods, ACM Trans. Math. Softw. 8, 93-113.
+	// See also Press et. al. Numerical Recipes, section 16.6 (Stiff sets of equations).
+	// Rosenbrock methods are implicit (they are stable for stiff systems where explicit methods like inca_dascru have to take tiny steps), but they
+	// only need one Jacobian and LU decomposition per step instead of solving a nonlinear system.
+	// NOTE: The batch functions don't depend on the time within the step (the fractional step) in any interesting way, so we treat the system as
+	// autonomous and skip the df/dt terms.
+	
+	constexpr double gam = 0.5;
+	constexpr double a21 = 2.0,           a31 = 48.0/25.0,     a32 = 6.0/25.0;
+	constexpr double a2x = 1.0,           a3x = 3.0/5.0;
+	constexpr double c21 = -8.0,          c31 = 372.0/25.0,    c32 = 12.0/5.0;
+	constexpr double c41 = -112.0/125.0,  c42 = -54.0/125.0,   c43 = -2.0/5.0;
+	constexpr double b1  = 19.0/9.0,      b2  = 1.0/2.0,       b3  = 25.0/108.0,  b4 = 125.0/108.0;
+	constexpr double e1  = 17.0/54.0,     e2  = 7.0/36.0,      e3  = 0.0,         e4 = 125.0/108.0;
+	
+	constexpr double safety = 0.9, grow = 1.5, shrink = 0.5;
+	double rel_tol = run_state->rel_tol;
+	double abs_tol = run_state->abs_tol;
+	
+	double *wk = run_state->solver_workspace;
+	// Divide up the workspace. See rosenbrock4_workspace_size.
+	double *f0    = wk + n;
+	double *x_bk  = f0 + n;
+	double *g1    = x_bk + n;
+	double *g2    = g1 + n;
+	double *g3    = g2 + n;
+	double *g4    = g3 + n;
+	int    *pivot = reinterpret_cast<int *>(g4 + n);
+	double *J     = g4 + 2*n;
+	double *A     = J + n*n;
+	
+	double h = std::max(*try_h, hmin);
+	double t = 0.0;
+	bool run = true;
+	
+	while(run) {
+		
+		// Derivatives and Jacobian at the start of the step. These are reused if the step has to be retried with a smaller h.
+		call_fun(ode_fun, run_state, t);
+		++run_state->rhs_evaluations;
+		for(int var_idx = 0; var_idx < n; ++var_idx) {
+			f0[var_idx]   = wk[var_idx];
+			x_bk[var_idx] = x0[var_idx];
+		}
+		estimate_jacobian(J, f0, n, x0, run_state, ode_fun, t);
+		
+		while(true) {
+			double h_step = h;
+			bool last = (t + h >= 1.0);
+			if(last)
+				h_step = 1.0 - t;
+			
+			// A = I/(gam*h) - J
+			for(int idx = 0; idx < n*n; ++idx)
+				A[idx] = -J[idx];
+			for(int idx = 0; idx < n; ++idx)
+				A[idx*n + idx] += 1.0/(gam*h_step);
+			
+			double err = std::numeric_limits<double>::infinity();
+			if(lu_decompose(A, n, pivot)) {
+				
+				for(int var_idx = 0; var_idx < n; ++var_idx)
+					g1[var_idx] = f0[var_idx];
+				lu_solve(A, n, pivot, g1);
+				
+				for(int var_idx = 0; var_idx < n; ++var_idx)
+					x0[var_idx] = x_bk[var_idx] + a21*g1[var_idx];
+				call_fun(ode_fun, run_state, t + a2x*h_step);
+				for(int var_idx = 0; var_idx < n; ++var_idx)
+					g2[var_idx] = wk[var_idx] + c21*g1[var_idx]/h_step;
+				lu_solve(A, n, pivot, g2);
+				
+				for(int var_idx = 0; var_idx < n; ++var_idx)
+					x0[var_idx] = x_bk[var_idx] + a31*g1[var_idx] + a32*g2[var_idx];
+				call_fun(ode_fun, run_state, t + a3x*h_step);
+				run_state->rhs_evaluations += 2;
+				for(int var_idx = 0; var_idx < n; ++var_idx)
+					g3[var_idx] = wk[var_idx] + (c31*g1[var_idx] + c32*g2[var_idx])/h_step;
+				lu_solve(A, n, pivot, g3);
+				
+				// The 4th stage uses the same derivatives as the 3rd.
+				for(int var_idx = 0; var_idx < n; ++var_idx)
+					g4[var_idx] = wk[var_idx] + (c41*g1[var_idx] + c42*g2[var_idx] + c43*g3[var_idx])/h_step;
+				lu_solve(A, n, pivot, g4);
+				
+				err = 0.0;
+				for(int var_idx = 0; var_idx < n; ++var_idx) {
+					x0[var_idx] = x_bk[var_idx] + b1*g1[var_idx] + b2*g2[var_idx] + b3*g3[var_idx] + b4*g4[var_idx];
+					double est = std::abs(e1*g1[var_idx] + e2*g2[var_idx] + e3*g3[var_idx] + e4*g4[var_idx]);
+					double tol = std::max(rel_tol*std::abs(x0[var_idx]), abs_tol);
+					err = std::max(err, est/tol);
+				}
+				if(std::isnan(err)) err = std::numeric_limits<double>::infinity();
+			}
+			
+			if(err <= 1.0 || h_step <= std::max(hmin, 1e-10)) { // The 1e-10 is so that it can't get stuck if hmin is 0.
+				// Accept the step. If it could not be made smaller, we have to accept it even if the error is too large (same as inca_dascru).
+				t += h_step;
+				if(last) {
+					// Write h out again so that it can be used for the next time the function is entered. Like in inca_dascru, this is the desired step
+					// size, not the one that is capped to reach 1.0 exactly.
+					run = false;
+					if(err <= 1.0 && h_step < h) break;
+				}
+				if(err <= 1.0)
+					h = h_step*std::min(grow, safety*std::pow(std::max(err, 1e-8), -0.25));
+				break;
+			}
+			
+			// Reject the step, reset the state and try again with a smaller step.
+			++run_state->rejected_steps;
+			for(int var_idx = 0; var_idx < n; ++var_idx)
+				x0[var_idx] = x_bk[var_idx];
+			
+			if(std::isfinite(err))
+				h = std::max(safety*h_step*std::pow(err, -1.0/3.0), shrink*h_step);
+			else
+				h = shrink*h_step;
+			h = std::max(h, hmin);
+		}
+	}
+	
+	// The last evaluation was at an intermediate stage. Evaluate again at the end so that the stored values of fluxes and other variables that
+	// are computed in the batch match the final state.
+	call_fun(ode_fun, run_state, 1.0);
+	++run_state->rhs_evaluations;
+	
+	*try_h = std::min(h, 1.0);
+	return true;
+}
+
+s64
+dormand_prince_workspace_size(s64 n) {
+	// Derivatives, backup of x0 and 6 stages.
+	return 8*n;
+}
+
+bool
+dormand_prince(double *try_h, double hmin, int n, double *x0, Model_Run_State *run_state, batch_function ode_fun) {
+	// The explicit 5th order Runge-Kutta method with an embedded 4th order error estimate from
+	// Dormand, J.R., Prince, P.J. (1980) A family of embedded Runge-Kutta formulae, J. Comp. Appl. Math. 6, 19-26.
+	// The step size control follows Hairer, Norsett and Wanner, Solving Ordinary Differential Equations I, section II.4 (the DOPRI5 code):
+	// The error is measured in a weighted RMS norm using the tolerances of the solver, and the step size is adjusted using a PI controller,
+	// which avoids the oscillation between accepted and rejected steps that you can get when the step is only adjusted based on the current error.
+	// The last stage is evaluated at the new state, so it can be reused as the first stage of the next step (FSAL).
+	
+	constexpr double c2  = 1.0/5.0,          c3  = 3.0/10.0,          c4  = 4.0/5.0,          c5  = 8.0/9.0;
+	constexpr double a21 = 1.0/5.0;
+	constexpr double a31 = 3.0/40.0,         a32 = 9.0/40.0;
+	constexpr double a41 = 44.0/45.0,        a42 = -56.0/15.0,        a43 = 32.0/9.0;
+	constexpr double a51 = 19372.0/6561.0,   a52 = -25360.0/2187.0,   a53 = 64448.0/6561.0,   a54 = -212.0/729.0;
+	constexpr double a61 = 9017.0/3168.0,    a62 = -355.0/33.0,       a63 = 46732.0/5247.0,   a64 = 49.0/176.0,    a65 = -5103.0/18656.0;
+	constexpr double a71 = 35.0/384.0,       a73 = 500.0/1113.0,      a74 = 125.0/192.0,      a75 = -2187.0/6784.0, a76 = 11.0/84.0;
+	constexpr double e1  = 71.0/57600.0,     e3  = -71.0/16695.0,     e4  = 71.0/1920.0,      e5  = -17253.0/339200.0, e6 = 22.0/525.0, e7 = -1.0/40.0;
+	
+	// The PI controller. The step is multiplied with safety*err^-alpha*err_prev^beta, but it is not allowed to change by more than the min and max factors.
+	constexpr double safety = 0.9, beta = 0.04, alpha = 0.2 - 0.75*beta;
+	constexpr double min_factor = 0.2, max_factor = 10.0;
+	
+	double rel_tol = run_state->rel_tol;
+	double abs_tol = run_state->abs_tol;
+	
+	double *wk = run_state->solver_workspace;
+	// Divide up the workspace. See dormand_prince_workspace_size.
+	double *x_bk = wk + n;
+	double *k1   = x_bk + n;
+	double *k2   = k1 + n;
+	double *k3   = k2 + n;
+	double *k4   = k3 + n;
+	double *k5   = k4 + n;
+	double *k6   = k5 + n;
+	
+	double h = std::max(*try_h, hmin);
+	double t = 0.0;
+	double err_prev = 1e-4;
+	bool prev_rejected = false;
+	bool run = true;
+	
+	call_fun(ode_fun, run_state, t);
+	++run_state->rhs_evaluations;
+	for(int var_idx = 0; var_idx < n; ++var_idx) {
+		k1[var_idx]   = wk[var_idx];
+		x_bk[var_idx] = x0[var_idx];
+	}
+	
+	while(run) {
+		double h_step = h;
+		bool last = (t + h >= 1.0);
+		if(last)
+			h_step = 1.0 - t;
+		
+		for(int var_idx = 0; var_idx < n; ++var_idx)
+			x0[var_idx] = x_bk[var_idx] + h_step*a21*k1[var_idx];
+		call_fun(ode_fun, run_state, t + c2*h_step);
+		for(int var_idx = 0; var_idx < n; ++var_idx) {
+			k2[var_idx] = wk[var_idx];
+			x0[var_idx] = x_bk[var_idx] + h_step*(a31*k1[var_idx] + a32*k2[var_idx]);
+		}
+		call_fun(ode_fun, run_state, t + c3*h_step);
+		for(int var_idx = 0; var_idx < n; ++var_idx) {
+			k3[var_idx] = wk[var_idx];
+			x0[var_idx] = x_bk[var_idx] + h_step*(a41*k1[var_idx] + a42*k2[var_idx] + a43*k3[var_idx]);
+		}
+		call_fun(ode_fun, run_state, t + c4*h_step);
+		for(int var_idx = 0; var_idx < n; ++var_idx) {
+			k4[var_idx] = wk[var_idx];
+			x0[var_idx] = x_bk[var_idx] + h_step*(a51*k1[var_idx] + a52*k2[var_idx] + a53*k3[var_idx] + a54*k4[var_idx]);
+		}
+		call_fun(ode_fun, run_state, t + c5*h_step);
+		for(int var_idx = 0; var_idx < n; ++var_idx) {
+			k5[var_idx] = wk[var_idx];
+			x0[var_idx] = x_bk[var_idx] + h_step*(a61*k1[var_idx] + a62*k2[var_idx] + a63*k3[var_idx] + a64*k4[var_idx] + a65*k5[var_idx]);
+		}
+		call_fun(ode_fun, run_state, t + h_step);
+		for(int var_idx = 0; var_idx < n; ++var_idx) {
+			k6[var_idx] = wk[var_idx];
+			x0[var_idx] = x_bk[var_idx] + h_step*(a71*k1[var_idx] + a73*k3[var_idx] + a74*k4[var_idx] + a75*k5[var_idx] + a76*k6[var_idx]);
+		}
+		// The 7th stage is at the new state.
+		call_fun(ode_fun, run_state, t + h_step);
+		run_state->rhs_evaluations += 6;
+		
+		double err = 0.0;
+		for(int var_idx = 0; var_idx < n; ++var_idx) {
+			double est = h_step*(e1*k1[var_idx] + e3*k3[var_idx] + e4*k4[var_idx] + e5*k5[var_idx] + e6*k6[var_idx] + e7*wk[var_idx]);
+			double scale = abs_tol + rel_tol*std::max(std::abs(x_bk[var_idx]), std::abs(x0[var_idx]));
+			err += (est/scale)*(est/scale);
+		}
+		err = std::sqrt(err / (double)n);
+		if(std::isnan(err)) err = std::numeric_limits<double>::infinity();
+		
+		if(err <= 1.0 || h_step <= std::max(hmin, 1e-10)) { // The 1e-10 is so that it can't get stuck if hmin is 0.
+			// Accept the step. If it could not be made smaller, we have to accept it even if the error is too large (same as inca_dascru).
+			t += h_step;
+			for(int var_idx = 0; var_idx < n; ++var_idx) {
+				k1[var_idx]   = wk[var_idx];
+				x_bk[var_idx] = x0[var_idx];
+			}
+			
+			if(last) {
+				run = false;
+				// Like in the other solvers, we want to write out the desired step size for the next time the function is entered, not the one
+				// that was capped to reach 1.0 exactly.
+				if(err <= 1.0 && h_step < h) break;
+			}
+			if(err <= 1.0) {
+				double factor = safety*std::pow(std::max(err, 1e-10), -alpha)*std::pow(err_prev, beta);
+				factor = std::max(min_factor, std::min(factor, prev_rejected ? 1.0 : max_factor));
+				h = h_step*factor;
+				err_prev = std::max(err, 1e-4);
+			}
+			prev_rejected = false;
+		} else {
+			// Reject the step, reset the state and try again with a smaller step.
+			++run_state->rejected_steps;
+			for(int var_idx = 0; var_idx < n; ++var_idx)
+				x0[var_idx] = x_bk[var_idx];
+			
+			h = h_step*std::max(min_factor, safety*std::pow(err, -alpha));
+			h = std::max(h, hmin);
+			prev_rejected = true;
+		}
+	}
+	
+	// NOTE: Since the last stage was evaluated at the final state, the stored values of fluxes and other variables that are computed in the batch
+	// already match it.
+	
+	*try_h = std::min(h, 1.0);
+	return true;
+}
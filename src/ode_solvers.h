@@ -5,17 +5,54 @@
 
 #include "run_model.h"
 
+#include <vector>
+#include <set>
+
 //typedef void ODE_Function(double t, void *run_state);
 //typedef bool Solver_Function(double *try_h, double hmin, int n, double *x0, double *wk, ODE_Function ode_fun, void *run_state);
 
 
 typedef bool Solver_Function(double *try_h, double hmin, int n, double *x0, Model_Run_State *state, batch_function fun);
 
+// The number of doubles the solver needs in run_state->solver_workspace for a system of n ODEs. The first n of them always receive the derivatives
+// from the batch function. A negative size means that the solver can't be used for a system this large.
+typedef s64 Solver_Workspace_Size(s64 n);
+
 
 // Specific solvers:
 
 bool inca_dascru(double *try_h, double hmin, int n, double *x0, Model_Run_State *run_state, batch_function ode_fun);
 bool euler_solver(double *try_h, double hmin, int n, double *x0, Model_Run_State *run_state, batch_function ode_fun);
+bool rosenbrock4(double *try_h, double hmin, int n, double *x0, Model_Run_State *run_state, batch_function ode_fun);
+bool dormand_prince(double *try_h, double hmin, int n, double *x0, Model_Run_State *run_state, batch_function ode_fun);
+
+s64 rosenbrock4_workspace_size(s64 n);
+s64 dormand_prince_workspace_size(s64 n);
+
+// The nonzero pattern of the Jacobian of the ODE system of a batch. This is found when the model is compiled (see emulate_ode_dependencies).
+struct
+Jacobian_Sparsity {
+	// The rows that can be nonzero in column j are rows[col_start[j]] to rows[col_start[j+1]-1].
+	std::vector<int> col_start;
+	std::vector<int> rows;
+	
+	// The columns are grouped so that no two columns in the same group have a nonzero in the same row. This means that they can be estimated from the
+	// same evaluation. The columns of group g are group_cols[group_start[g]] to group_cols[group_start[g+1]-1].
+	std::vector<int> group_start;
+	std::vector<int> group_cols;
+	
+	bool empty() const { return col_start.empty(); }
+};
+
+void
+set_up_jacobian_sparsity(Jacobian_Sparsity *sparsity, const std::vector<std::set<int>> &derivative_deps);
+
+// Estimate the Jacobian matrix of the ODE system at x0 using finite differences. J is n*n and row major (J[i*n + j] = d(dx_i/dt)/dx_j).
+// f0 must contain the derivatives at x0. x0 is perturbed during the estimation, but is the same again at the end.
+// If run_state->jacobian_sparsity is set, only the entries in the pattern are estimated, and the rest are set to 0.
+// If run_state->jacobian_fun is set, the exact Jacobian is computed using that instead.
+void
+estimate_jacobian(double *J, const double *f0, int n, double *x0, Model_Run_State *run_state, batch_function ode_fun, double t);
 
 
 #endif // MOBIUS_ODE_SOLVERS_H
\ No newline at end of file
@@ -0,0 +1,106 @@
+
+#ifndef MOBIUS_RANDOM_STREAM_H
+#define MOBIUS_RANDOM_STREAM_H
+
+#include "mobius_common.h"
+
+#include <cmath>
+
+/*
+	A counter based random generator (Philox4x32-10, from Salmon et. al. (2011) Parallel random numbers: as easy as 1, 2, 3).
+
+	Every draw is computed directly from (seed, run id, step, draw index within the step), so there is no state to carry along except the counter.
+	This means that
+		- The same seed and run id give the same numbers whatever order the steps and runs are computed in, and on whatever thread.
+		- Different runs (e.g. ensemble members or MCMC walkers) get independent streams just by giving them different run ids.
+		- A run that is resumed from a checkpoint at a given step draws the same numbers as if it was never interrupted.
+		- It is cheap to copy (as opposed to a std::mt19937, which is about 5KB).
+*/
+
+struct
+Random_Stream {
+	u64 seed   = 0;
+	u32 run_id = 0;
+	s64 step   = 0;
+	u32 draw   = 0;
+
+	Random_Stream(u64 seed = 0, u32 run_id = 0, s64 step = 0) : seed(seed), run_id(run_id), step(step) {}
+
+	// The draw index restarts every time the step changes.
+	void
+	set_step(s64 new_step) {
+		if(new_step == step) return;
+		step = new_step;
+		draw = 0;
+	}
+
+	// Compute the 4 random words of the current counter, and move on to the next draw.
+	void
+	next_block(u32 *out) {
+		u32 ctr[4] = { draw, run_id, (u32)(u64)step, (u32)((u64)step >> 32) };
+		u32 key[2] = { (u32)seed, (u32)(seed >> 32) };
+		++draw;
+
+		for(int round = 0; round < 10; ++round) {
+			u64 prod0 = (u64)0xD2511F53 * ctr[0];
+			u64 prod1 = (u64)0xCD9E8D57 * ctr[2];
+			u32 next[4] = {
+				(u32)(prod1 >> 32) ^ ctr[1] ^ key[0],
+				(u32)prod1,
+				(u32)(prod0 >> 32) ^ ctr[3] ^ key[1],
+				(u32)prod0,
+			};
+			for(int idx = 0; idx < 4; ++idx) ctr[idx] = next[idx];
+			key[0] += 0x9E3779B9;
+			key[1] += 0xBB67AE85;
+		}
+		for(int idx = 0; idx < 4; ++idx) out[idx] = ctr[idx];
+	}
+
+	u64
+	next_u64() {
+		u32 block[4];
+		next_block(block);
+		return ((u64)block[1] << 32) | block[0];
+	}
+
+	// Uniform in [mn, mx)
+	double
+	uniform(double mn = 0.0, double mx = 1.0) {
+		return mn + (mx - mn)*to_unit(next_u64());
+	}
+
+	double
+	normal(double mean = 0.0, double std_dev = 1.0) {
+		// Box-Muller using both halves of one block. We only use one of the two values it makes so that every normal draw is a single draw.
+		u32 block[4];
+		next_block(block);
+		double u1 = 1.0 - to_unit(((u64)block[1] << 32) | block[0]); // In (0, 1], so that the log is finite.
+		double u2 = to_unit(((u64)block[3] << 32) | block[2]);
+		return mean + std_dev*std::sqrt(-2.0*std::log(u1))*std::cos(6.283185307179586*u2);
+	}
+
+	// Uniform in [mn, mx] (both inclusive).
+	s64
+	uniform_int(s64 mn, s64 mx) {
+		if(mx < mn) return mn;
+		u64 range = (u64)mx - (u64)mn + 1;
+		if(range == 0) return (s64)next_u64(); // The full 64 bit range.
+
+		// Reject the lowest (2^64 mod range) values so that all remainders are equally likely.
+		u64 threshold = (0 - range) % range;
+		u64 value;
+		do
+			value = next_u64();
+		while(value < threshold);
+		return (s64)((u64)mn + value % range);
+	}
+
+private:
+	static double
+	to_unit(u64 bits) {
+		return (double)(bits >> 11) * 0x1.0p-53;
+	}
+};
+
+#endif // MOBIUS_RANDOM_STREAM_H
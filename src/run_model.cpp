@@ -3,14 +3,24 @@
 #include "model_application.h"
 #include "emulate.h"
 #include "run_model.h"
+#include "model_codegen.h"
+#include "worker_pool.h"
+#include "external_computations.h"
+
+#include <memory>
+#include <random>
+#include <map>
+#include <set>
 
 
 struct
 Batch_Data {
 #if MOBIUS_EMULATE
 	Math_Expr_FT    *run_code;
+	Math_Expr_FT    *jacobian_run_code = nullptr;
 #else
 	batch_function  *compiled_code;
+	batch_function  *jacobian_code = nullptr;
 #endif
 	Solver_Function *solver_fun = nullptr;
 	//double           h;
@@ -18,21 +28,306 @@ Batch_Data {
 	double           hmin;
 	s64              first_ode_offset;
 	int              n_ode;
+	double           rel_tol;
+	double           abs_tol;
+	const Jacobian_Sparsity *jacobian_sparsity = nullptr;
+	
+	// If the solver integrates the instances separately (see generate_instance_code). Each instance keeps its own step size.
+	parallel_loop_function *instance_code = nullptr;
+	s64              instance_count = 0;
+	int              instance_n_ode = 0;
+	std::vector<double> instance_h;
+};
+
+#if MOBIUS_EMULATE
+	#define BATCH_FUNCTION(batch) reinterpret_cast<batch_function *>(batch.run_code)
+	#define JACOBIAN_FUNCTION(batch) reinterpret_cast<batch_function *>(batch.jacobian_run_code)
+#else
+	#define BATCH_FUNCTION(batch) batch.compiled_code
+	#define JACOBIAN_FUNCTION(batch) batch.jacobian_code
+#endif
+
+inline void
+set_solver_state(Model_Run_State *run_state, Batch_Data &batch) {
+	// Tell the solver about the batch it is going to run on.
+	run_state->jacobian_sparsity = batch.jacobian_sparsity;
+	run_state->jacobian_fun      = JACOBIAN_FUNCTION(batch);
+	run_state->rel_tol           = batch.rel_tol;
+	run_state->abs_tol           = batch.abs_tol;
+}
+
+
+static void
+run_solver_batch(Batch_Data &batch, Model_Run_State *run_state) {
+	
+	set_solver_state(run_state, batch);
+	double *x0 = run_state->state_vars + batch.first_ode_offset;
+	
+#if !MOBIUS_EMULATE
+	if(batch.instance_code) {
+		// Integrate one instance at a time, each with its own step size. The Jacobian sparsity and code are for the batch as a whole, so they
+		// can't be used here.
+		run_state->jacobian_sparsity = nullptr;
+		run_state->jacobian_fun      = nullptr;
+		
+		auto &inst = run_state->instance;
+		inst.fun    = batch.instance_code;
+		inst.stride = batch.instance_count;
+		inst.x.resize(batch.instance_n_ode);
+		double min_h = 1.0;
+		for(s64 idx = 0; idx < batch.instance_count; ++idx) {
+			inst.index = idx;
+			inst.state = x0 + idx;
+			for(int var_idx = 0; var_idx < batch.instance_n_ode; ++var_idx)
+				inst.x[var_idx] = inst.state[var_idx*inst.stride];
+			
+			batch.solver_fun(&batch.instance_h[idx], batch.hmin, batch.instance_n_ode, inst.x.data(), run_state, batch.compiled_code);
+			
+			for(int var_idx = 0; var_idx < batch.instance_n_ode; ++var_idx)
+				inst.state[var_idx*inst.stride] = inst.x[var_idx];
+			min_h = std::min(min_h, batch.instance_h[idx]);
+		}
+		inst.fun = nullptr;
+		
+		// NOTE: This is only for information (the step size is part of the results). The solver uses the ones in instance_h.
+		run_state->state_vars[batch.h_address] = min_h;
+		return;
+	}
+#endif
+	
+	//NOTE: h is kept around for the next time step (trying an initial h that we ended up with from the previous step)
+	batch.solver_fun(run_state->state_vars + batch.h_address, batch.hmin, batch.n_ode, x0, run_state, BATCH_FUNCTION(batch));
+}
+
+extern "C" void
+_solver_batch_step_(Model_Run_State *run_state, void *batch_data, s64 batch_idx, double *state_vars, double *series) {
+	// This does the same as the solver branch of the step loop in run_model.
+#if !MOBIUS_EMULATE
+	auto &batch = reinterpret_cast<Batch_Data *>(batch_data)[batch_idx];
+	run_state->state_vars = state_vars;
+	run_state->series     = series;
+	run_solver_batch(batch, run_state);
+#endif
+}
+
+extern "C" void
+_advance_date_time_(Expanded_Date_Time *date_time) {
+	date_time->advance();
+}
+
+// NOTE: The draws are keyed on the time step, so the generated code passes the date_time along with the random stream.
+inline Random_Stream *
+random_stream_at(void *rand_state, Expanded_Date_Time *date_time) {
+	auto stream = reinterpret_cast<Random_Stream *>(rand_state);
+	stream->set_step(date_time->step);
+	return stream;
+}
+
+extern "C" DLLEXPORT double
+_uniform_random_real_(void *rand_state, Expanded_Date_Time *date_time, double mn, double mx) {
+	return random_stream_at(rand_state, date_time)->uniform(mn, mx);
+}
+
+extern "C" DLLEXPORT double
+_normal_random_real_(void *rand_state, Expanded_Date_Time *date_time, double m, double s) {
+	return random_stream_at(rand_state, date_time)->normal(m, s);
+}
+
+extern "C" DLLEXPORT s64
+_uniform_random_int_(void *rand_state, Expanded_Date_Time *date_time, s64 mn, s64 mx) {
+	return random_stream_at(rand_state, date_time)->uniform_int(mn, mx);
+}
+
+struct
+Parallel_Loop {
+	parallel_loop_function *fun;
+	#define BATCH_FUN_ARG(name, llvm_ty, cpp_ty) cpp_ty name;
+	#include "batch_fun_args.incl"
+	#undef BATCH_FUN_ARG
+};
+
+static void
+run_parallel_loop_range(void *context, s64 first, s64 last) {
+	auto loop = reinterpret_cast<Parallel_Loop *>(context);
+	#define BATCH_FUN_ARG(name, llvm_ty, cpp_ty) loop->name,
+	loop->fun(
+		#include "batch_fun_args.incl"
+		first, last
+	);
+	#undef BATCH_FUN_ARG
+}
+
+#define BATCH_FUN_ARG(name, llvm_ty, cpp_ty) cpp_ty name,
+extern "C" void
+_parallel_for_(parallel_loop_function *fun,
+	#include "batch_fun_args.incl"
+	s64 count) {
+#undef BATCH_FUN_ARG
+	
+	Parallel_Loop loop;
+	loop.fun = fun;
+	#define BATCH_FUN_ARG(name, llvm_ty, cpp_ty) loop.name = name;
+	#include "batch_fun_args.incl"
+	#undef BATCH_FUN_ARG
+	
+	global_worker_pool()->parallel_for(run_parallel_loop_range, &loop, count);
+}
+
+struct
+Kept_Span {
+	s64 from_offset;
+	s64 to_offset;
+	s64 count;
+};
+
+void
+make_kept_spans(Model_Application *app, std::vector<Kept_Span> &spans) {
+	// Each variable has all its instances stored contiguously, so we can copy them in one go. Neighbouring ones are merged if possible.
+	for(auto &array : app->kept_result_structure.structure) {
+		for(Var_Id var_id : array.handles) {
+			Kept_Span span;
+			span.from_offset = app->result_structure.get_offset_base(var_id);
+			span.to_offset   = app->kept_result_structure.get_offset_base(var_id);
+			span.count       = app->kept_result_structure.instance_count(var_id);
+			if(!spans.empty()) {
+				auto &prev = spans.back();
+				if(prev.from_offset + prev.count == span.from_offset && prev.to_offset + prev.count == span.to_offset) {
+					prev.count += span.count;
+					continue;
+				}
+			}
+			spans.push_back(span);
+		}
+	}
+}
+
+inline void
+copy_kept_spans(Model_Data *data, const std::vector<Kept_Span> &spans, double *state_vars, s64 step) {
+	double *to = data->kept_results.get_value(0, step);
+	for(auto &span : spans)
+		memcpy(to + span.to_offset, state_vars + span.from_offset, sizeof(double)*span.count);
+}
+
+// A checkpoint is this header followed by the state values, the temp values and the step sizes of the solver instances (Batch_Data::instance_h) of
+// each batch in order. The random stream only needs its key since the draws are computed from the step (see random_stream.h), so the resumed run
+// draws the same numbers as an uninterrupted run would.
+// NOTE: The step sizes (h) of the solver batches are stored among the state values, but when the instances are integrated separately, that one is
+// only the smallest of them, so the step size of each instance has to be stored too.
+struct
+Checkpoint_Header {
+	char           magic[8];
+	s64            var_count;
+	s64            temp_count;
+	s64            instance_h_count;
+	u64            rand_seed;
+	u32            run_id;
+	Date_Time      next_date;      // The date of the time step after the checkpoint. This is where a resumed run starts.
+	s64            next_step;      // The resumed run continues the step count (time.step) from here.
+	Time_Step_Size time_step;
 };
 
+constexpr char checkpoint_magic[8] = "MOBCHK3";
+
+static s64
+instance_h_count(const std::vector<Batch_Data> &batch_data) {
+	s64 count = 0;
+	for(auto &batch : batch_data)
+		count += batch.instance_h.size();
+	return count;
+}
+
+void
+make_checkpoint(Model_Data *data, Model_Run_State *run_state, const std::vector<Batch_Data> &batch_data, Date_Time next_date, s64 next_step) {
+	auto app = data->app;
+	
+	Checkpoint_Header header = {};
+	memcpy(header.magic, checkpoint_magic, sizeof(checkpoint_magic));
+	header.var_count        = app->result_structure.total_count;
+	header.temp_count       = app->temp_result_structure.total_count;
+	header.instance_h_count = instance_h_count(batch_data);
+	header.rand_seed        = run_state->rand_state.seed;
+	header.run_id           = run_state->rand_state.run_id;
+	header.next_date        = next_date;
+	header.next_step        = next_step;
+	header.time_step        = app->time_step_size;
+	
+	auto &checkpoint = data->checkpoint;
+	checkpoint.resize(sizeof(Checkpoint_Header) + sizeof(double)*(header.var_count + header.temp_count + header.instance_h_count));
+	char *at = &checkpoint[0];
+	memcpy(at, &header, sizeof(Checkpoint_Header));
+	at += sizeof(Checkpoint_Header);
+	memcpy(at, run_state->state_vars, sizeof(double)*header.var_count);
+	at += sizeof(double)*header.var_count;
+	memcpy(at, run_state->temp_vars, sizeof(double)*header.temp_count);
+	at += sizeof(double)*header.temp_count;
+	for(auto &batch : batch_data) {
+		memcpy(at, batch.instance_h.data(), sizeof(double)*batch.instance_h.size());
+		at += sizeof(double)*batch.instance_h.size();
+	}
+}
+
+Checkpoint_Header
+read_checkpoint_header(Model_Data *data) {
+	auto app = data->app;
+	auto &checkpoint = data->resume_from;
+	
+	Checkpoint_Header header;
+	bool correct = checkpoint.size() >= sizeof(Checkpoint_Header);
+	if(correct) {
+		memcpy(&header, checkpoint.data(), sizeof(Checkpoint_Header));
+		correct = !memcmp(header.magic, checkpoint_magic, sizeof(checkpoint_magic))
+			&& header.var_count  == app->result_structure.total_count
+			&& header.temp_count == app->temp_result_structure.total_count
+			&& header.time_step.unit == app->time_step_size.unit
+			&& header.time_step.multiplier == app->time_step_size.multiplier
+			&& checkpoint.size() == sizeof(Checkpoint_Header) + sizeof(double)*(header.var_count + header.temp_count + header.instance_h_count);
+	}
+	if(!correct)
+		fatal_error(Mobius_Error::api_usage, "The checkpoint the run was set to resume from was not made by this model application.");
+	return header;
+}
+
+void
+resume_from_checkpoint(Model_Data *data, Model_Run_State *run_state, std::vector<Batch_Data> &batch_data, const Checkpoint_Header &header) {
+	// NOTE: The rest of the header was checked in read_checkpoint_header, but this can only be checked after the batches are set up.
+	if(header.instance_h_count != instance_h_count(batch_data))
+		fatal_error(Mobius_Error::api_usage, "The checkpoint the run was set to resume from was not made by this model application.");
+	
+	const char *at = data->resume_from.data() + sizeof(Checkpoint_Header);
+	memcpy(run_state->state_vars, at, sizeof(double)*header.var_count);
+	at += sizeof(double)*header.var_count;
+	memcpy(run_state->temp_vars, at, sizeof(double)*header.temp_count);
+	at += sizeof(double)*header.temp_count;
+	for(auto &batch : batch_data) {
+		memcpy(batch.instance_h.data(), at, sizeof(double)*batch.instance_h.size());
+		at += sizeof(double)*batch.instance_h.size();
+	}
+	// Continue the random stream of the run that made the checkpoint instead of the one this run was given.
+	run_state->rand_state = Random_Stream(header.rand_seed, header.run_id);
+}
+
+inline bool
+all_finite(const double *vals, s64 count) {
+	// Look at the exponent bits directly (they are all set for inf and nan). Doing it on integers without branching lets the compiler vectorize the loop.
+	constexpr u64 exponent_mask = 0x7ff0000000000000;
+	u64 found = 0;
+	for(s64 idx = 0; idx < count; ++idx) {
+		u64 bits;
+		memcpy(&bits, vals + idx, sizeof(u64));
+		found |= (u64)((bits & exponent_mask) == exponent_mask);
+	}
+	return !found;
+}
 
 bool
-check_for_nans(Model_Data *data, Model_Run_State *run_state) {
-	// TODO: This is awfully inefficient. Could we just scan the results vector for NaN first, and then do this if a NaN occurs at all?
-	// TODO: Only works for stored results, not temp_results.
-	auto &structure = *data->results.structure;
+report_non_finite(Model_Data *data, Storage_Structure<Var_Id> &structure, double *values, Model_Run_State *run_state) {
 	for(auto &array : structure.structure) {
 		for(Var_Id var_id : array.handles) {
 			bool error = false;
-			structure.for_each(var_id, [var_id, data, run_state, &error](Indexes &idxs, s64 offset) {
-				double val = run_state->state_vars[offset];
+			structure.for_each(var_id, [var_id, data, values, run_state, &error](Indexes &idxs, s64 offset) {
+				if(error) return;
+				double val = values[offset];
 				if(!std::isfinite(val)) {
-					// TODO: Also print indexes.
 					begin_error(Mobius_Error::numerical);
 					error_print("Got a non-finite value for \"", data->app->vars[var_id]->name, "\" at time step ", run_state->date_time.step, ". Indexes: [");
 					int i = 0;
@@ -46,13 +341,25 @@ check_for_nans(Model_Data *data, Model_Run_State *run_state) {
 					}
 					error_print("]\n");
 					error = true;
-					return;
 				}
 			});
-			if(error) return false;
+			if(error) return true;
 		}
 	}
-	return true;
+	return false;
+}
+
+bool
+check_for_nans(Model_Data *data, Model_Run_State *run_state) {
+	// Scan the entire step first, and only figure out what variable (and indexes) it was if we found something.
+	auto app = data->app;
+	if(all_finite(run_state->state_vars, app->result_structure.total_count)
+		&& all_finite(run_state->temp_vars, app->temp_result_structure.total_count))
+		return true;
+	
+	if(!report_non_finite(data, app->result_structure, run_state->state_vars, run_state))
+		report_non_finite(data, app->temp_result_structure, run_state->temp_vars, run_state);
+	return false;
 }
 
 void
@@ -76,21 +383,255 @@ assert_was_triggered(Model_Application *app, Data_Storage<s64, Var_Id> *assert_d
 	mobius_error_exit();
 }
 
-bool
-run_model(Model_Data *data, s64 ms_timeout, bool check_for_nan, run_callback_type callback, void *callback_data) {
+// The state of one model run that is in progress, so that it can be advanced a chunk of time steps at a time (see run_model).
+struct
+Model_Run {
+	Model_Data                *data;
+	Model_Run_State            run_state;
+	std::vector<Batch_Data>    batch_data;
+	Data_Storage<s64, Var_Id>  assert_data;
+	std::vector<Kept_Span>     kept_spans;
+	Data_Storage<double, Var_Id> *stored;
+	
+	s64     time_steps;
+	s64     var_count;
+	s64     series_count;
+	s64     checkpoint_step = -1;
+	s64     step            = 0;   // The number of steps done by this run (as opposed to run_state.date_time.step, which continues from a checkpoint).
+	s64     flush_interval;
+	s64     flushed_until   = -1;
+	bool    windowed;
+	bool    check_for_nan;
+	bool    use_step_loop   = false;
+	step_loop_function *step_loop = nullptr;
+	double *last_slot;
+	
+	// Only for partial re-runs (see find_rerun_batches). The state variables that can change are copied in from the previous step every step, the
+	// rest keep the values stored by the last run.
+	bool                   partial = false;
+	std::vector<Kept_Span> changed_spans;
+	std::vector<int>       rerun_batches;
+	
+	// Extra run states for batches that are run at the same time as others (only if app->batch_levels is set up).
+	std::vector<std::unique_ptr<Model_Run_State>> lanes;
+	
+	Batch_Profile *profile = nullptr; // Only if data->profile_run
+	
+	Model_Run(Model_Data *data, bool check_for_nan, u64 rand_seed, u32 run_id = 0, const std::vector<Entity_Id> *changed_pars = nullptr);
+	
+	bool done() { return step >= time_steps; }
+	bool run_steps(s64 n_steps);
+	void run_batch(s64 batch_idx, Model_Run_State *state);
+	void run_batch_levels();
+	void finish() {
+		stored->flush(flushed_until, time_steps, true);
+		data->has_full_results = !windowed;
+	}
+};
+
+u32
+make_rand_seed() {
+	// TODO: Is this an acceptable method for random seeding?
+	std::random_device gen;
+	return gen() ^ (
+		(u32)std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count() +
+		(u32)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now().time_since_epoch()).count()
+	);
+}
+
+static void
+call_batch(Batch_Data &batch, Model_Run_State *run_state) {
+	if(!batch.solver_fun)
+		call_fun(BATCH_FUNCTION(batch), run_state);
+	else
+		run_solver_batch(batch, run_state);
+}
+
+template<typename Id_Type> inline bool
+contains_any(const std::vector<Id_Type> &ids, const std::set<Id_Type> &set) {
+	for(auto &id : ids)
+		if(set.find(id) != set.end()) return true;
+	return false;
+}
+
+// Find the batches that have to be run again if only the given parameters changed since the last run, and the state variables that can get
+// different values because of that. Returns false if everything has to be run again.
+static bool
+find_rerun_batches(Model_Data *data, const std::vector<Entity_Id> &changed_pars, std::vector<int> &rerun_batches, std::vector<Var_Id> &changed_vars) {
+	auto app = data->app;
+	s64 n_batches = app->batches.size();
+	
+	if(app->initial_batch.external) return false;
+	for(auto par_id : changed_pars)
+		if(app->is_baked_parameter(par_id)) return false; // This one needs a recompile anyway.
+	
+	std::map<Var_Id, std::vector<int>> writers;
+	for(int batch_idx = 0; batch_idx < n_batches; ++batch_idx) {
+		for(auto var_id : app->batches[batch_idx].writes)
+			writers[var_id].push_back(batch_idx);
+	}
+	
+	std::set<Entity_Id> pars(changed_pars.begin(), changed_pars.end());
+	std::set<Var_Id>    changed;
+	std::vector<u8>     rerun(n_batches, false);
+	bool any_random = false;
+	
+	// NOTE: The order of the batches doesn't matter for what can change since values are carried over to the next time step, so we just
+	// keep going until nothing more is added.
+	bool added = true;
+	auto mark_batch = [&](int batch_idx) { if(!rerun[batch_idx]) { rerun[batch_idx] = true; added = true; } };
+	auto mark_var   = [&](Var_Id var_id) { if(changed.insert(var_id).second) added = true; };
+	while(added) {
+		added = false;
+		
+		for(auto &source : app->initial_value_sources) {
+			if(contains_any(source.parameters, pars) || contains_any(source.reads, changed))
+				mark_var(source.var_id);
+		}
+		
+		for(int batch_idx = 0; batch_idx < n_batches; ++batch_idx) {
+			auto &batch = app->batches[batch_idx];
+			
+			// If something a batch writes can change, all the batches writing to it have to be run again since they could be adding to it (like fluxes do).
+			if(contains_any(batch.parameters, pars) || contains_any(batch.reads, changed) || contains_any(batch.writes, changed))
+				mark_batch(batch_idx);
+			
+			// The solver step size parameters are not read by the batch code, but by the Model_Run.
+			if(is_valid(batch.solver_id)) {
+				auto solver = app->model->solvers[batch.solver_id];
+				if(pars.find(solver->h_par) != pars.end() || pars.find(solver->hmin_par) != pars.end())
+					mark_batch(batch_idx);
+			}
+			if(!rerun[batch_idx]) continue;
+			
+			if(batch.external) return false;
+			if(batch.uses_random) any_random = true;
+			
+			// The batch recomputes what it writes starting from the values of the previous step, so these have to be copied in.
+			for(auto var_id : batch.writes)
+				mark_var(var_id);
+			
+			for(auto var_id : batch.reads) {
+				for(int writer : writers[var_id]) {
+					// Temp vars are not stored for every step, so if the batch reads one, the batches computing it must be run too.
+					if(var_id.type == Var_Id::Type::temp_var)
+						mark_batch(writer);
+					// In the full run the batch saw the value of the previous step since this var was computed later in the step, but what is
+					// stored is the value at the end of the step.
+					if(writer > batch_idx)
+						mark_var(var_id);
+				}
+			}
+		}
+		
+		// The random draws depend on how many draws were made earlier in the step (see Random_Stream), so these all have to be run if one is.
+		if(any_random) {
+			for(int batch_idx = 0; batch_idx < n_batches; ++batch_idx)
+				if(app->batches[batch_idx].uses_random) mark_batch(batch_idx);
+		}
+	}
+	
+	// Without a fixed seed the stored results were made with different random numbers.
+	if(data->rand_seed < 0 && (any_random || app->initial_batch.uses_random)) return false;
+	
+	for(int batch_idx = 0; batch_idx < n_batches; ++batch_idx)
+		if(rerun[batch_idx]) rerun_batches.push_back(batch_idx);
+	changed_vars.assign(changed.begin(), changed.end());
+	return true;
+}
+
+struct
+Level_Run {
+	Model_Run              *run;
+	const std::vector<int> *level;
+};
+
+static void
+run_level_range(void *context, s64 first, s64 last) {
+	auto level_run = reinterpret_cast<Level_Run *>(context);
+	auto run = level_run->run;
+	
+	// Every range gets its own run state, since the solvers need their own workspace and fractional step. The first range always uses the
+	// main run state, which is also the one that has the random generator (schedule_batches puts the batch that uses it first in the level).
+	Model_Run_State *run_state = &run->run_state;
+	if(first > 0) {
+		run_state = run->lanes[first-1].get();
+		run_state->parameters      = run->run_state.parameters;
+		run_state->state_vars      = run->run_state.state_vars;
+		run_state->temp_vars       = run->run_state.temp_vars;
+		run_state->series          = run->run_state.series;
+		run_state->asserts         = run->run_state.asserts;
+		run_state->connection_info = run->run_state.connection_info;
+		run_state->index_counts    = run->run_state.index_counts;
+		run_state->date_time       = run->run_state.date_time;
+	}
+	for(s64 idx = first; idx < last; ++idx)
+		run->run_batch((*level_run->level)[idx], run_state);
+}
+
+void
+Model_Run::run_batch(s64 batch_idx, Model_Run_State *state) {
+	if(!profile) {
+		call_batch(batch_data[batch_idx], state);
+		return;
+	}
+	auto &prof = profile[batch_idx];
+	s64 rhs_evaluations = state->rhs_evaluations;
+	s64 rejected_steps  = state->rejected_steps;
+	Timer timer;
+	call_batch(batch_data[batch_idx], state);
+	prof.nanoseconds     += timer.get_nanoseconds();
+	prof.calls           += 1;
+	prof.rhs_evaluations += state->rhs_evaluations - rhs_evaluations;
+	prof.rejected_steps  += state->rejected_steps - rejected_steps;
+}
+
+void
+Model_Run::run_batch_levels() {
+	for(auto &level : data->app->batch_levels) {
+		if(level.size() == 1)
+			run_batch(level[0], &run_state);
+		else {
+			Level_Run level_run = { this, &level };
+			global_worker_pool()->parallel_for(run_level_range, &level_run, level.size());
+		}
+	}
+}
+
+Model_Run::Model_Run(Model_Data *data, bool check_for_nan, u64 rand_seed, u32 run_id, const std::vector<Entity_Id> *changed_pars)
+	: data(data), run_state(rand_seed, run_id), assert_data(&data->app->assert_structure), check_for_nan(check_for_nan) {
 	
 	Model_Application *app = data->app;
 	Mobius_Model *model    = app->model;
 	if(!app->is_compiled)
 		fatal_error(Mobius_Error::api_usage, "Tried to run model before it was compiled.");
 	
+	// NOTE: The run takes its own copies of the function pointers, so this doesn't affect runs that are already going.
+	app->use_optimized_code();
+#if !MOBIUS_EMULATE
+	const Compiled_Functions *functions = app->compiled_functions.load();
+#endif
+	
+	bool had_full_results  = data->has_full_results;
+	data->has_full_results = false;
+	
 	Date_Time start_date = data->get_start_date_parameter();
 	Date_Time end_date   = data->get_end_date_parameter();
 	
+	// If we resume from a checkpoint, the run starts right after it instead of at the start date.
+	bool resume = !data->resume_from.empty();
+	Checkpoint_Header checkpoint_header;
+	if(resume) {
+		checkpoint_header = read_checkpoint_header(data);
+		start_date = checkpoint_header.next_date;
+		if(start_date > end_date)
+			fatal_error(Mobius_Error::api_usage, "The checkpoint the run was set to resume from is at or after the end date.\n");
+	}
+	
 	if(start_date > end_date)
 		fatal_error(Mobius_Error::api_usage, "The start date of the model run was set to be later than the end date.\n");
 	
-	s64 time_steps = steps_between(start_date, end_date, app->time_step_size) + 1; // +1 since end date is inclusive.
+	time_steps = steps_between(start_date, end_date, app->time_step_size) + 1; // +1 since end date is inclusive.
 	
 	s64 input_offset = 0;
 	if(data->series.data) {
@@ -106,29 +647,42 @@ run_model(Model_Data *data, s64 ms_timeout, bool check_for_nan, run_callback_typ
 		app->allocate_series_data(time_steps, start_date);
 	}
 	
-	data->results.allocate(time_steps, start_date);
+	// If the run is only redoing what the changed parameters affect, the results of the last run are kept. They must be for the same period.
+	std::vector<Var_Id> changed_vars;
+	partial = changed_pars && had_full_results && !resume && data->checkpoint_step < 0 && data->results.window <= 0
+		&& data->results.time_steps == time_steps && data->results.start_date == start_date
+		&& find_rerun_batches(data, *changed_pars, rerun_batches, changed_vars);
+	
+	if(partial) {
+		for(auto var_id : changed_vars) {
+			if(var_id.type != Var_Id::Type::state_var) continue;
+			Kept_Span span;
+			span.from_offset = span.to_offset = app->result_structure.get_offset_base(var_id);
+			span.count       = app->result_structure.instance_count(var_id);
+			changed_spans.push_back(span);
+		}
+	} else
+		data->results.allocate(time_steps, start_date);
 	data->temp_results.allocate();
 	
+	// If the results are windowed, we only keep a few steps of the full result vector, and copy the kept variables out to their own storage every step.
+	windowed = data->results.window > 0;
+	if(windowed) {
+		data->kept_results.allocate(time_steps, start_date);
+		make_kept_spans(app, kept_spans);
+	}
+	
 	// Could have this in the Model_Data too, but it is a bit unnecessary?
-	Data_Storage<s64, Var_Id> assert_data(&app->assert_structure);
 	assert_data.allocate();
 	
+	var_count    = app->result_structure.total_count;
+	series_count = app->series_structure.total_count;
 	
-	s64 var_count    = app->result_structure.total_count;
-	s64 series_count = app->series_structure.total_count;
-	
-	// TODO: Is this an acceptable method for random seeding?
-	u32 rand_seed;
-	{
-		std::random_device gen;
-		rand_seed = gen() ^ (
-			(u32)std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count() +
-			(u32)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now().time_since_epoch()).count()
-		);
+	if(data->checkpoint_step >= 0) {
+		checkpoint_step = std::min(data->checkpoint_step, time_steps - 1);
+		data->checkpoint.clear();
 	}
 	
-	Model_Run_State run_state(rand_seed);
-	
 	run_state.parameters       = data->parameters.data;
 	run_state.state_vars       = data->results.data;
 	run_state.temp_vars        = data->temp_results.data;
@@ -140,26 +694,53 @@ run_model(Model_Data *data, s64 ms_timeout, bool check_for_nan, run_callback_typ
 	run_state.date_time        = Expanded_Date_Time(start_date, app->time_step_size);
 	run_state.fractional_step  = 0.0;
 	
-	std::vector<Batch_Data>   batch_data(app->batches.size());
+	batch_data.resize(app->batches.size());
 	
-	int solver_workspace_size = 0;
+	s64 solver_workspace_size = 0;
+	auto jac_layout = jacobian_workspace_layout(app);
+	s64 jac_workspace_size = 0;
 	int idx = 0;
 	for(auto &batch : app->batches) {
 		auto &b_data = batch_data[idx];
 
 #if MOBIUS_EMULATE
-		b_data.run_code      = batch.run_code;
+		b_data.run_code          = batch.run_code;
+		b_data.jacobian_run_code = batch.jacobian_run_code;
 #else
-		b_data.compiled_code = batch.compiled_code;
+		b_data.compiled_code     = functions->batch_code[idx];
+		b_data.jacobian_code     = functions->jacobian_code[idx];
 #endif
 		
 		if(is_valid(batch.solver_id)) {
-			solver_workspace_size = std::max(solver_workspace_size, 4*batch.n_ode); // TODO:    the 4*  is INCA-Dascru specific. Make it general somehow.
-			
 			auto solver             = model->solvers[batch.solver_id];
-			b_data.solver_fun       = model->solver_functions[solver->solver_fun]->solver_fun;
+			auto solver_fun         = model->solver_functions[solver->solver_fun];
+			b_data.solver_fun       = solver_fun->solver_fun;
+			
+			// NOTE: If the instances are integrated separately, the solver only sees the ODEs of one instance at a time (see run_solver_batch).
+			s64 solver_n_ode = batch.n_ode;
+#if !MOBIUS_EMULATE
+			if(functions->instance_code[idx]) solver_n_ode = batch.instance_n_ode;
+#endif
+			s64 workspace_size = solver_fun->workspace_size ? solver_fun->workspace_size(solver_n_ode) : 4*solver_n_ode;
+			if(workspace_size < 0) {
+				solver->source_loc.print_error_header(Mobius_Error::model_building);
+				fatal_error("The solver function \"", solver_fun->name, "\" can't be used for this system of ", solver_n_ode, " ODEs since its ",
+					"Jacobian would be too large. Use a solver that doesn't need the Jacobian, or split the system up.");
+			}
+			solver_workspace_size = std::max(solver_workspace_size, workspace_size);
 			b_data.first_ode_offset = batch.first_ode_offset;
 			b_data.n_ode            = batch.n_ode;
+			b_data.rel_tol          = solver->rel_tol;
+			b_data.abs_tol          = solver->abs_tol;
+#if !MOBIUS_EMULATE
+			b_data.instance_code    = functions->instance_code[idx];
+#endif
+			b_data.instance_count   = batch.instance_count;
+			b_data.instance_n_ode   = batch.instance_n_ode;
+			if(!batch.jacobian_sparsity.empty())
+				b_data.jacobian_sparsity = &batch.jacobian_sparsity;
+			if(JACOBIAN_FUNCTION(b_data))
+				jac_workspace_size = std::max(jac_workspace_size, jac_layout.output_offset + batch.n_ode);
 			
 			Standardized_Unit *h_unit = nullptr;
 			
@@ -191,23 +772,55 @@ run_model(Model_Data *data, s64 ms_timeout, bool check_for_nan, run_callback_typ
 			
 			b_data.h_address = batch.h_address;
 			run_state.state_vars[b_data.h_address] = h;
+			b_data.instance_h.assign(b_data.instance_count, h);
 		}
 		++idx;
 	}
 	run_state.set_solver_workspace_size(solver_workspace_size);
-
+	if(solver_workspace_size > 0 && !run_state.solver_workspace)
+		fatal_error(Mobius_Error::model_building, "Unable to allocate ", solver_workspace_size*sizeof(double), " bytes of workspace for the ODE solvers.");
+	run_state.set_jacobian_workspace(jac_workspace_size, jac_layout.state_offset, jac_layout.output_offset);
+	
+	int max_level_size = 0;
+	for(auto &level : app->batch_levels)
+		max_level_size = std::max(max_level_size, (int)level.size());
+	for(int lane = 1; lane < max_level_size; ++lane) {
+		lanes.emplace_back(new Model_Run_State());
+		lanes.back()->set_solver_workspace_size(solver_workspace_size);
+		lanes.back()->set_jacobian_workspace(jac_workspace_size, jac_layout.state_offset, jac_layout.output_offset);
+	}
+	
+	data->run_profile.clear();
+	if(data->profile_run) {
+		data->run_profile.resize(app->batches.size());
+		profile = data->run_profile.data();
+	}
+	
+	// If the results are in a memory mapped file, write them back in chunks so that the amount of dirty memory doesn't build up (this also lets
+	// another process follow the run).
+	constexpr s64 flush_chunk_bytes = 64*1024*1024;
+	stored = &data->get_storage(Var_Id::Type::state_var);
+	flush_interval = std::max(flush_chunk_bytes / std::max((s64)sizeof(double)*stored->structure->total_count, (s64)1), (s64)1);
+	
+	run_state.date_time.step = -1;
+	
+	// Initial values:
+	if(resume)
+		resume_from_checkpoint(data, &run_state, batch_data, checkpoint_header);
+	else
 #if MOBIUS_EMULATE
-	#define BATCH_FUNCTION(batch) reinterpret_cast<batch_function *>(batch.run_code)
+		call_fun(BATCH_FUNCTION(app->initial_batch), &run_state);
 #else
-	#define BATCH_FUNCTION(batch) batch.compiled_code
+		call_fun(functions->initial_code, &run_state);
 #endif
-
-	Timer run_timer;
-	run_state.date_time.step = -1;
-
-	// Initial values:
-	call_fun(BATCH_FUNCTION(app->initial_batch), &run_state);
 	
+	// NOTE: The step counter seen by the model (time.step) continues from the checkpoint if we resumed from one. We keep our own count of steps
+	// since the start of this run.
+	run_state.date_time.step = resume ? checkpoint_header.next_step : 0;
+	
+	if(windowed)
+		copy_kept_spans(data, kept_spans, run_state.state_vars, -1);
+	last_slot = data->results.data + (data->results.alloc_steps() - 1)*var_count;
 	
 	// Check if asserts were triggered.
 	// This just checks if any were triggered at all. If they were, it jumps to a function that checks it better.
@@ -217,48 +830,141 @@ run_model(Model_Data *data, s64 ms_timeout, bool check_for_nan, run_callback_typ
 		}
 	}
 	
-	s64 callback_interval = time_steps / 10; // TODO: Make this customizable.
-	s64 prev_callback_iter = 0;
-	for(run_state.date_time.step = 0; run_state.date_time.step < time_steps; run_state.date_time.advance()) {
-		memcpy(run_state.state_vars+var_count, run_state.state_vars, sizeof(double)*var_count); // Copy in the last step's values as the initial state of the current step
+#if !MOBIUS_EMULATE
+	// The compiled step loop does the same as the loop in run_steps, but we can't use it if something has to be done between every step or batch,
+	// or if batches are run concurrently.
+	step_loop     = functions->step_loop;
+	use_step_loop = step_loop && !windowed && !check_for_nan && !profile && !partial && app->batch_levels.empty();
+#endif
+}
+
+bool
+Model_Run::run_steps(s64 n_steps) {
+	Model_Application *app = data->app;
+	s64 end_step = std::min(step + n_steps, time_steps);
+	
+#if !MOBIUS_EMULATE
+	if(use_step_loop) {
+		while(step < end_step) {
+			s64 n = end_step - step;
+			if(step <= checkpoint_step)
+				n = std::min(n, checkpoint_step + 1 - step);
+			
+			double *state_vars = run_state.state_vars;
+			double *series     = run_state.series;
+			
+			// NOTE: This advances run_state.date_time. It can also move run_state.state_vars and series if there are solver batches.
+			step_loop(
+				reinterpret_cast<double *>(run_state.parameters),
+				run_state.series,
+				run_state.state_vars,
+				run_state.temp_vars,
+				run_state.asserts,
+				run_state.solver_workspace,
+				&run_state.date_time,
+				&run_state.rand_state,
+				&run_state,
+				batch_data.data(),
+				n
+			);
+			run_state.state_vars = state_vars + n*var_count;
+			run_state.series     = series + n*series_count;
+			step += n;
+			
+			if(step == checkpoint_step + 1)
+				make_checkpoint(data, &run_state, batch_data, run_state.date_time.date_time, run_state.date_time.step);
+		}
+	} else
+#endif
+	for(; step < end_step; ++step, run_state.date_time.advance()) {
+		if(windowed && run_state.state_vars == last_slot) {
+			// Wrap the ring around. See the note on Data_Storage::window
+			memcpy(data->results.data, run_state.state_vars, sizeof(double)*var_count);
+			run_state.state_vars = data->results.data;
+		}
+		// Copy in the last step's values as the initial state of the current step
+		if(partial) {
+			for(auto &span : changed_spans)
+				memcpy(run_state.state_vars+var_count+span.to_offset, run_state.state_vars+span.from_offset, sizeof(double)*span.count);
+		} else
+			memcpy(run_state.state_vars+var_count, run_state.state_vars, sizeof(double)*var_count);
 		run_state.state_vars += var_count;
 		
-		//TODO: we *could* also generate code for this for loop to avoid the ifs (but branch prediction should work well since the branches don't change)
-		for(auto &batch : batch_data) {
-			if(!batch.solver_fun)
-				call_fun(BATCH_FUNCTION(batch), &run_state);
-			else {
-				double *x0 = run_state.state_vars + batch.first_ode_offset;
-				//NOTE: h is kept around for the next time step (trying an initial h that we ended up with from the previous step)
-				batch.solver_fun(run_state.state_vars + batch.h_address, batch.hmin, batch.n_ode, x0, &run_state, BATCH_FUNCTION(batch));
-			}
+		// NOTE: If config.jit_step_loop is set, this loop is generated as code instead (see above).
+		if(partial) {
+			for(int batch_idx : rerun_batches)
+				run_batch(batch_idx, &run_state);
+		} else if(!app->batch_levels.empty())
+			run_batch_levels();
+		else {
+			for(s64 batch_idx = 0; batch_idx < batch_data.size(); ++batch_idx)
+				run_batch(batch_idx, &run_state);
 		}
 		
 		run_state.series    += series_count;
 		
+		if(step == checkpoint_step)
+			make_checkpoint(data, &run_state, batch_data, advance(run_state.date_time.date_time, app->time_step_size, 1), run_state.date_time.step + 1);
+		
+		if(windowed)
+			copy_kept_spans(data, kept_spans, run_state.state_vars, step);
+		
 		if(check_for_nan)
 			if(!check_for_nans(data, &run_state)) return false;
-		
-		if(ms_timeout > 0) {
+	}
+	
+	if(stored->mapped && step - flushed_until >= flush_interval) {
+		stored->flush(flushed_until, step);
+		flushed_until = step;
+	}
+	
+	return true;
+}
+
+bool
+run_model(Model_Data *data, s64 ms_timeout, bool check_for_nan, run_callback_type callback, void *callback_data, const std::vector<Entity_Id> *changed_pars,
+	run_check_type check, void *check_data) {
+	
+	Model_Run run(data, check_for_nan, data->rand_seed >= 0 ? (u64)data->rand_seed : make_rand_seed(), 0, changed_pars);
+	s64 time_steps = run.time_steps;
+	
+	Timer run_timer;
+	
+	s64 callback_interval = time_steps / 10; // TODO: Make this customizable.
+	s64 prev_callback_iter = 0;
+	auto report_progress = [&](s64 step) {
+		s64 callback_iter = (step*10) / time_steps;
+		if(callback_iter > prev_callback_iter) {
 			s64 ms = run_timer.get_milliseconds();
-			// NOTE: We don't want to write a log to the error stream (or log stream) here since we could get a lot of these during an optimizer run.
-			if(ms > ms_timeout)
-				return false;
-		}
-		
-		if(callback) {
-			s64 callback_iter = (run_state.date_time.step*10) / time_steps;
-			if(callback_iter > prev_callback_iter) {
-				s64 ms = run_timer.get_milliseconds();
-				if(ms > 500) { // This is to avoid the callback being used for very fast models, as it would slow them down relatively.
-					double percent = 100.0 * ((double)run_state.date_time.step) / ((double)time_steps);
-					callback(callback_data, percent);
-					prev_callback_iter = callback_iter;
-				}
+			if(ms > 500) { // This is to avoid the callback being used for very fast models, as it would slow them down relatively.
+				double percent = 100.0 * ((double)step) / ((double)time_steps);
+				callback(callback_data, percent);
+				prev_callback_iter = callback_iter;
 			}
 		}
+	};
+	
+	// Run it in chunks so that we can still check the timeout, report progress, flush mapped results and let the caller stop the run.
+	s64 chunk = time_steps;
+	if(ms_timeout > 0 || callback || check) chunk = std::max(time_steps / 100, (s64)1);
+	if(run.stored->mapped)         chunk = std::min(chunk, run.flush_interval);
+	
+	while(!run.done()) {
+		if(!run.run_steps(chunk)) return false;
+		
+		// NOTE: We don't want to write a log to the error stream (or log stream) here since we could get a lot of these during an optimizer run.
+		if(ms_timeout > 0 && run_timer.get_milliseconds() > ms_timeout)
+			return false;
+		
+		if(callback)
+			report_progress(run.step);
+		
+		if(check && !check(check_data, run.step))
+			return false;
 	}
 	
+	run.finish();
+	
 	if(callback)
 		callback(callback_data, 100.0);
 	
@@ -3,19 +3,48 @@
 #ifndef MOBIUS_RUN_MODEL_H
 #define MOBIUS_RUN_MODEL_H
 
-#include <random>
-
 #ifndef MOBIUS_EMULATE
 #define MOBIUS_EMULATE 0
 #endif
 
 #include "datetime.h"
 #include "common_types.h"
+#include "random_stream.h"
+
+#include <vector>
 
 #if MOBIUS_EMULATE
 #include "emulate.h"
 #endif
 
+struct Jacobian_Sparsity;
+
+#define BATCH_FUN_ARG(name, llvm_ty, cpp_ty) cpp_ty name,
+#define BATCH_FUN_ARG_LAST(name, llvm_ty, cpp_ty) cpp_ty name
+typedef void batch_function(
+	#include "batch_fun_args.incl"
+);
+#undef BATCH_FUN_ARG
+
+// A loop over independent index instances that was split out of a batch function (see Math_Block_FT::is_parallel). It runs the iterations [first, last).
+#define BATCH_FUN_ARG(name, llvm_ty, cpp_ty) cpp_ty name,
+typedef void parallel_loop_function(
+	#include "batch_fun_args.incl"
+	s64 first, s64 last
+);
+#undef BATCH_FUN_ARG
+
+// The instance a solver is currently integrating if the batch is integrated one instance at a time (see generate_instance_code).
+// The solver works on x, which is copied to the state variables (where the values of the instance are stride apart) before each evaluation.
+struct
+Solver_Instance {
+	parallel_loop_function *fun = nullptr;
+	s64                 index;
+	std::vector<double> x;
+	double             *state;
+	s64                 stride;
+};
+
 struct
 Model_Run_State {
 	Parameter_Value    *parameters;
@@ -26,25 +55,55 @@ Model_Run_State {
 	double             *solver_workspace = nullptr;
 	s32                *connection_info;    //NOTE: this is only used if we are in MOBIUS_EMULATE mode... For llvm we bake these in as constants
 	s32                *index_counts;       //NOTE: same as above.
+	const Jacobian_Sparsity *jacobian_sparsity = nullptr; // Of the batch the solver is currently running on, if it is known.
+	
+	// The exact Jacobian of the batch the solver is currently running on, if it could be generated. See differentiation.cpp for the layout of the workspace.
+	batch_function     *jacobian_fun = nullptr;
+	double             *jacobian_workspace = nullptr;
+	s64                 jacobian_state_offset  = 0;
+	s64                 jacobian_output_offset = 0;
+	
+	// Error tolerances of the solver that is currently running (see Solver_Registration).
+	double              rel_tol = 0.0;
+	double              abs_tol = 0.0;
+	
+	Solver_Instance     instance;
+	
 	Expanded_Date_Time  date_time;
 	double              fractional_step;
 	
-	std::mt19937       rand_state;
+	Random_Stream       rand_state;
 	
-	void set_solver_workspace_size(int size) {
+	// Counted by the ODE solvers. Only used for profiling.
+	s64                 rhs_evaluations = 0;
+	s64                 rejected_steps  = 0;
+	
+	void set_solver_workspace_size(s64 size) {
 		if(size <= 0) return;
 		solver_workspace = (double *)malloc(sizeof(double)*size);
 	}
 	
-	Model_Run_State(u32 rand_seed = std::mt19937::default_seed) : rand_state(rand_seed) {}
+	void set_jacobian_workspace(s64 size, s64 state_offset, s64 output_offset) {
+		if(size <= 0) return;
+		jacobian_workspace     = (double *)calloc(size, sizeof(double)); // NOTE: Parts of it have to be 0.
+		jacobian_state_offset  = state_offset;
+		jacobian_output_offset = output_offset;
+	}
+	
+	Model_Run_State(u64 rand_seed = 0, u32 run_id = 0) : rand_state(rand_seed, run_id) {}
 	
-	~Model_Run_State() { if(solver_workspace) { free(solver_workspace); solver_workspace = nullptr; } }
+	~Model_Run_State() {
+		if(solver_workspace) { free(solver_workspace); solver_workspace = nullptr; }
+		if(jacobian_workspace) { free(jacobian_workspace); jacobian_workspace = nullptr; }
+	}
 };
 
+// A JIT compiled function that runs n_steps time steps of the model (all the batches in order). See jit_add_step_loop.
 #define BATCH_FUN_ARG(name, llvm_ty, cpp_ty) cpp_ty name,
-#define BATCH_FUN_ARG_LAST(name, llvm_ty, cpp_ty) cpp_ty name
-typedef void batch_function(
+#define BATCH_FUN_ARG_LAST(name, llvm_ty, cpp_ty)
+typedef void step_loop_function(
 	#include "batch_fun_args.incl"
+	Model_Run_State *run_state, void *batch_data, s64 n_steps
 );
 #undef BATCH_FUN_ARG
 //double *parameters, double *series, double *state_vars, double *temp_vars, double *solver_workspace, Expanded_Date_Time *date_time, double fractional_step);
@@ -55,6 +114,24 @@ call_fun(batch_function *fun, Model_Run_State *run_state, double t = 0.0) {
 #if MOBIUS_EMULATE
 	emulate_expression(reinterpret_cast<Math_Expr_FT *>(fun), run_state, nullptr);
 #else
+	auto &inst = run_state->instance;
+	if(inst.fun) {
+		for(int idx = 0; idx < inst.x.size(); ++idx)
+			inst.state[idx*inst.stride] = inst.x[idx];
+		inst.fun(
+			reinterpret_cast<double *>(run_state->parameters), 
+			run_state->series, 
+			run_state->state_vars, 
+			run_state->temp_vars,
+			run_state->asserts,
+			run_state->solver_workspace, 
+			&run_state->date_time,
+			&run_state->rand_state,
+			run_state->fractional_step,
+			inst.index, inst.index+1
+		);
+		return;
+	}
 	// Would be nice to use BATCH_FUN_ARG here too, but it is a bit tricky
 	fun(
 		reinterpret_cast<double *>(run_state->parameters), 
@@ -70,13 +147,37 @@ call_fun(batch_function *fun, Model_Run_State *run_state, double t = 0.0) {
 #endif
 }
 
+// Called from batch functions to split a parallel_loop_function between the threads of the global worker pool.
+#define BATCH_FUN_ARG(name, llvm_ty, cpp_ty) cpp_ty name,
+extern "C" void _parallel_for_(parallel_loop_function *fun,
+	#include "batch_fun_args.incl"
+	s64 count);
+#undef BATCH_FUN_ARG
+
+// These are called from the JIT compiled step loop.
+extern "C" void _solver_batch_step_(Model_Run_State *run_state, void *batch_data, s64 batch_idx, double *state_vars, double *series);
+extern "C" void _advance_date_time_(Expanded_Date_Time *date_time);
+
+// These are called from batch functions that draw random numbers.
+extern "C" double _uniform_random_real_(void *rand_state, Expanded_Date_Time *date_time, double mn, double mx);
+extern "C" double _normal_random_real_(void *rand_state, Expanded_Date_Time *date_time, double m, double s);
+extern "C" s64    _uniform_random_int_(void *rand_state, Expanded_Date_Time *date_time, s64 mn, s64 mx);
+
 struct Model_Application;
 struct Model_Data;
 
 typedef void (run_callback_type)(void *, double);
 
+// Called with the number of steps that are done so far. If it returns false, the run is stopped.
+typedef bool (run_check_type)(void *, s64);
+
+// If changed_pars is given, only the parameters in it were changed since the last run of this Model_Data, and nothing else was. Then only the
+// batches they affect are run again, and the rest of the results from the last run are kept (if possible, otherwise it does a full run).
+// If check is given, it is called regularly during the run (with the results up to that step available), and it can stop the run early. Then
+// run_model returns false.
 bool
-run_model(Model_Data *model_data, s64 ms_timeout = -1, bool check_for_nan = false, run_callback_type callback = nullptr, void *callback_data = nullptr);
+run_model(Model_Data *model_data, s64 ms_timeout = -1, bool check_for_nan = false, run_callback_type callback = nullptr, void *callback_data = nullptr,
+	const std::vector<Entity_Id> *changed_pars = nullptr, run_check_type check = nullptr, void *check_data = nullptr);
 
 bool
 run_model(Model_Application *app, s64 ms_timeout = -1, bool check_for_nan = false, run_callback_type callback = nullptr, void *callback_data = nullptr);
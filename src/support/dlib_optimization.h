@@ -19,7 +19,9 @@ struct Dlib_Optimization_Model : public Optimization_Model {
 	double operator()(const column_vector &par_values) {
 		std::vector<double> par_vals(par_values.size());
 		for(int idx = 0; idx < par_values.size(); ++idx) par_vals[idx] = par_values(idx);
-		double result = evaluate(par_vals);
+		// The run is stopped early if it can't beat the best score so far. The result is then not the exact score, but it is still worse than
+		// the best one, and that is all the optimizer needs to know about this point.
+		double result = evaluate(par_vals, best_score);
 		return maximize ? result : -result;
 	}
 };
@@ -2,13 +2,12 @@
 #include "mcmc.h"
 
 #include <thread>
-#include <random>
 //#include <execution>
 
-typedef double (*sampler_move)(double *, double *, int, int, int, int*, int, MC_Data &, Random_State *rand_state);
+typedef double (*sampler_move)(double *, double *, int, int, int, int*, int, MC_Data &, Random_Stream *rand_state);
 
 double
-affine_stretch_move(double *sampler_params, double *scale, int step, int walker, int ensemble_step, int *ensemble, int n_ensemble, MC_Data &data, Random_State *rand_state) {
+affine_stretch_move(double *sampler_params, double *scale, int step, int walker, int ensemble_step, int *ensemble, int n_ensemble, MC_Data &data, Random_Stream *rand_state) {
 	/*
 	This is a simple C++ implementation of the Affine-invariant ensemble sampler from https://github.com/dfm/emcee
 	
@@ -20,13 +19,8 @@ affine_stretch_move(double *sampler_params, double *scale, int step, int walker,
 	// Draw needed random values
 	double u;
 	int ensemble_walker;
-	{
-		std::uniform_real_distribution<double> distu(0.0, 1.0);
-		std::uniform_int_distribution<>        disti(0, n_ensemble-1);
-		std::lock_guard<std::mutex> lock(rand_state->gen_mutex);
-		u = distu(rand_state->gen); //uniform between 0,1
-		ensemble_walker = ensemble[disti(rand_state->gen)];
-	}
+	u = rand_state->uniform(); //uniform between 0,1
+	ensemble_walker = ensemble[rand_state->uniform_int(0, n_ensemble-1)];
 	
 	double zz = (a - 1.0)*u + 1.0;
 	zz = zz*zz/a;
@@ -41,7 +35,7 @@ affine_stretch_move(double *sampler_params, double *scale, int step, int walker,
 }
 
 double
-affine_walk_move(double *sampler_params, double *scale, int step, int walker, int ensemble_step, int *ensemble, int n_ensemble, MC_Data &data, Random_State *rand_state) {
+affine_walk_move(double *sampler_params, double *scale, int step, int walker, int ensemble_step, int *ensemble, int n_ensemble, MC_Data &data, Random_Stream *rand_state) {
 		
 	// Walk move from sampe paper as stretch move above.
 		
@@ -49,16 +43,10 @@ affine_walk_move(double *sampler_params, double *scale, int step, int walker, in
 	
 	std::vector<double> z(s0);
 	std::vector<int> ens(s0);
-	{
-		std::normal_distribution<double>       distn;
-		std::uniform_int_distribution<>        disti(0, n_ensemble-1);
-		std::lock_guard<std::mutex> lock(rand_state->gen_mutex);
-		
-		for(int s = 0; s < s0; ++s) {
-			// NOTE: Unlike in Differential Evolution, the members of the sub-ensemble could be repeating (or at least it is not otherwise mentioned in the paper).
-			ens[s] = ensemble[disti(rand_state->gen)];
-			z[s]   = distn(rand_state->gen);
-		}
+	for(int s = 0; s < s0; ++s) {
+		// NOTE: Unlike in Differential Evolution, the members of the sub-ensemble could be repeating (or at least it is not otherwise mentioned in the paper).
+		ens[s] = ensemble[rand_state->uniform_int(0, n_ensemble-1)];
+		z[s]   = rand_state->normal();
 	}
 		
 	for(int par = 0; par < data.n_pars; ++par) {
@@ -80,7 +68,7 @@ affine_walk_move(double *sampler_params, double *scale, int step, int walker, in
 }
 
 double
-differential_evolution_move(double *sampler_params, double *scale, int step, int walker, int ensemble_step, int *ensemble, int n_ensemble, MC_Data &data, Random_State *rand_state)
+differential_evolution_move(double *sampler_params, double *scale, int step, int walker, int ensemble_step, int *ensemble, int n_ensemble, MC_Data &data, Random_Stream *rand_state)
 {
 	//Based on
 	
@@ -95,94 +83,85 @@ differential_evolution_move(double *sampler_params, double *scale, int step, int
 	
 	if(c < 0.0) c = 2.38 / std::sqrt(2.0 * (double)data.n_pars); // Default (see paper).
 	
-	{
-		std::uniform_real_distribution<double> distu(0.0, 1.0);
-		std::uniform_int_distribution<>        disti(0, n_ensemble-1);
-		std::lock_guard<std::mutex> lock(rand_state->gen_mutex);
+	int ens_w1 = ensemble[rand_state->uniform_int(0, n_ensemble-1)];
+	int ens_w2;
+	do
+		ens_w2 = ensemble[rand_state->uniform_int(0, n_ensemble-1)];
+	while(ens_w2 == ens_w1);
+
+	for(int par = 0; par < data.n_pars; ++par) {
+		double x_k  = data(walker, par, step-1);
 		
-		int ens_w1 = ensemble[disti(rand_state->gen)];
-		int ens_w2;
-		do
-			ens_w2 = ensemble[disti(rand_state->gen)];
-		while(ens_w2 == ens_w1);
-	
-		for(int par = 0; par < data.n_pars; ++par) {
-			double x_k  = data(walker, par, step-1);
+		double cross = rand_state->uniform();
+		if(cross <= cr) {
+			double bs = b*scale[par];  // scale relative to |max - min| for the parameter.
+			double bb = -bs + rand_state->uniform()*2.0*bs; // Uniform [-BS, BS]
 			
-			double cross = distu(rand_state->gen);
-			if(cross <= cr) {
-				double bs = b*scale[par];  // scale relative to |max - min| for the parameter.
-				double bb = -bs + distu(rand_state->gen)*2.0*bs; // Uniform [-BS, BS]
-				
-				double x_r1 = data(ens_w1, par, ensemble_step);
-				double x_r2 = data(ens_w2, par, ensemble_step);
-				
-				data(walker, par, step) = x_k + c*(x_r1 - x_r2) + bb;
-			}
-			else
-				data(walker, par, step) = x_k;
+			double x_r1 = data(ens_w1, par, ensemble_step);
+			double x_r2 = data(ens_w2, par, ensemble_step);
+			
+			data(walker, par, step) = x_k + c*(x_r1 - x_r2) + bb;
 		}
+		else
+			data(walker, par, step) = x_k;
 	}
 	
 	return 0.0;
 }
 
 double
-metropolis_move(double *sampler_params, double *scale, int step, int walker, int ensemble_step, int *ensemble, int n_ensemble, MC_Data &data, Random_State *rand_state)
+metropolis_move(double *sampler_params, double *scale, int step, int walker, int ensemble_step, int *ensemble, int n_ensemble, MC_Data &data, Random_Stream *rand_state)
 {
 	// Metropolis-Hastings (parallel chains with no crossover).
 	
 	double b = sampler_params[0];   // Std.dev of normal perturbation.
 	
-	{
-		std::normal_distribution<> distn(0.0, 1.0);
-		std::lock_guard<std::mutex> lock(rand_state->gen_mutex);
-		
-		for(int par = 0; par < data.n_pars; ++par) {
-			double x_k = data(walker, par, step-1);
-			double sigma = b*scale[par]; // scale[par] is a scaling relative to the par |max - min|
-			data(walker, par, step) = x_k + sigma*distn(rand_state->gen);
-		}
+	for(int par = 0; par < data.n_pars; ++par) {
+		double x_k = data(walker, par, step-1);
+		double sigma = b*scale[par]; // scale[par] is a scaling relative to the par |max - min|
+		data(walker, par, step) = x_k + sigma*rand_state->normal();
 	}
 	
 	return 0.0;
 }
 
-inline void
+inline bool
 move_or_reject(sampler_move move, double *sampler_params, double *scale, int step, int walker, int ensemble_step, int *ensemble, int n_ensemble, MC_Data &data,
-	Random_State *rand_state, double (*log_likelihood)(void *, int, int), void *ll_state) {
+	u64 seed, double (*log_likelihood)(void *, int, int, double), void *ll_state) {
+	
+	// Every walker has its own random stream for every step, so the walkers don't have to share (and lock) a generator, and the result doesn't
+	// depend on which thread got to run first.
+	Random_Stream rand_state(seed, walker, step);
 	
 	// Make a move proposal.
-	double q0 = move(sampler_params, scale, step, walker, ensemble_step, ensemble, n_ensemble, data, rand_state);
+	double q0 = move(sampler_params, scale, step, walker, ensemble_step, ensemble, n_ensemble, data, &rand_state);
 	
 	double prev_ll = data.score_value(walker, step-1);
-	double ll      = log_likelihood(ll_state, walker, step); // This is the expensive model evaluation call.
+	double r       = rand_state.uniform();
+	
+	// The move is accepted if ll - prev_ll + q0 >= log(r), so the evaluation can be stopped as soon as it is certain that ll will be below the
+	// threshold. The ll is then not exact, but it is below the threshold, and that is all we need to know.
+	double threshold = prev_ll - q0 + std::log(r);
+	double ll        = log_likelihood(ll_state, walker, step, threshold); // This is the expensive model evaluation call.
 	
 	double q = (ll - prev_ll) + q0;
 	
-	{
-		std::lock_guard<std::mutex> lock(rand_state->gen_mutex);
-		
-		std::uniform_real_distribution<double> distu(0.0, 1.0);
-		double r = distu(rand_state->gen);
-		
-		if(!std::isfinite(ll) || q < std::log(r)) {
-			// Didn't pass the test, so reject the move and reset the sample to be equal to the previous one
-			
-			for(int par = 0; par < data.n_pars; ++par)
-				data(walker, par, step) = data(walker, par, step-1);
-			ll = prev_ll;
-		} else {
-			data.n_accepted++;
-		}
+	bool accepted = std::isfinite(ll) && q >= std::log(r);
+	if(!accepted) {
+		// Didn't pass the test, so reject the move and reset the sample to be equal to the previous one
 		
-		data.score_value(walker, step) = ll;
+		for(int par = 0; par < data.n_pars; ++par)
+			data(walker, par, step) = data(walker, par, step-1);
+		ll = prev_ll;
 	}
 	
+	data.score_value(walker, step) = ll;
+	
+	return accepted;
 }
 
 bool
-run_mcmc(MCMC_Sampler method, double *sampler_params, double *scales, double (*log_likelihood)(void *, int, int), void *ll_state, MC_Data &data, bool (*callback)(void *, int), void *callback_state, int callback_interval, int initial_step) {
+run_mcmc(MCMC_Sampler method, double *sampler_params, double *scales, double (*log_likelihood)(void *, int, int, double), void *ll_state, MC_Data &data, bool (*callback)(void *, int), void *callback_state, int callback_interval, int initial_step, u64 seed) {
 	sampler_move move;
 	switch(method) {
 		case MCMC_Sampler::affine_stretch :
@@ -220,22 +199,23 @@ run_mcmc(MCMC_Sampler method, double *sampler_params, double *scales, double (*l
 	// (which is the last step of the previous run) will already have been computed.
 	if(initial_step == 0)
 		for(int walker = 0; walker < data.n_walkers; ++walker)
-			data.score_value(walker, 0) = log_likelihood(ll_state, walker, 0);
+			data.score_value(walker, 0) = log_likelihood(ll_state, walker, 0, -std::numeric_limits<double>::infinity());
 	
-	Random_State rand_state; // TODO: maybe seed the state randomly.
-
 	std::vector<std::thread> workers;
 	workers.reserve(data.n_walkers);
 	
-	std::uniform_int_distribution<> disti(0, data.n_walkers-1);
 	std::vector<int> walkers(data.n_walkers);
 	for(int idx = 0; idx < data.n_walkers; ++idx) walkers[idx] = idx;
 	
+	std::vector<char> accepted(data.n_walkers);
+	
 	for(int step = initial_step + 1; step < data.n_steps; ++step) {
 		
-		// Shuffle the walkers so that they get into different sub-ensembles for each step.
+		// Shuffle the walkers so that they get into different sub-ensembles for each step. The walkers use the random streams 0 to n_walkers-1, so
+		// this one gets the next one.
+		Random_Stream shuffle_state(seed, data.n_walkers, step);
 		for(int idx = 0; idx < data.n_walkers; ++idx) {
-			int swp = disti(rand_state.gen);
+			int swp = shuffle_state.uniform_int(0, data.n_walkers-1);
 			std::swap(walkers[idx], walkers[swp]);
 		}
 		
@@ -244,7 +224,7 @@ run_mcmc(MCMC_Sampler method, double *sampler_params, double *scales, double (*l
 		for(int wk = 0; wk < n_ens1; ++wk) {
 			int walker = walkers[wk];
 			workers.push_back(std::thread([&, walker]() {
-				move_or_reject(move, sampler_params, scales, step, walker, ensemble_step, walkers.data()+n_ens1, n_ens2, data, &rand_state, log_likelihood, ll_state);
+				accepted[walker] = move_or_reject(move, sampler_params, scales, step, walker, ensemble_step, walkers.data()+n_ens1, n_ens2, data, seed, log_likelihood, ll_state);
 			}));
 		}
 		for(auto &worker : workers)
@@ -254,7 +234,7 @@ run_mcmc(MCMC_Sampler method, double *sampler_params, double *scales, double (*l
 		// NOTE: Can't use any of the parallel for_each stuff before upp supports C++20 (or we compile this separately)
 		/*
 		std::for_each(std::execution::par, walkers.begin(), walkers.begin()+n_ens1, [&](int walker) {
-			move_or_reject(move, sampler_params, scales, step, walker, ensemble_step, walkers.data()+n_ens1, n_ens2, data, &rand_state, log_likelihood, ll_state);
+			move_or_reject(move, sampler_params, scales, step, walker, ensemble_step, walkers.data()+n_ens1, n_ens2, data, seed, log_likelihood, ll_state);
 		});
 		*/
 		
@@ -263,7 +243,7 @@ run_mcmc(MCMC_Sampler method, double *sampler_params, double *scales, double (*l
 		for(int wk = n_ens1; wk < data.n_walkers; ++wk) {
 			int walker = walkers[wk];
 			workers.push_back(std::thread([&, walker]() {
-				move_or_reject(move, sampler_params, scales, step, walker, ensemble_step, walkers.data(), n_ens1, data, &rand_state, log_likelihood, ll_state);
+				accepted[walker] = move_or_reject(move, sampler_params, scales, step, walker, ensemble_step, walkers.data(), n_ens1, data, seed, log_likelihood, ll_state);
 			}));
 		}
 		for(auto &worker : workers)
@@ -272,10 +252,13 @@ run_mcmc(MCMC_Sampler method, double *sampler_params, double *scales, double (*l
 		
 		/*
 		std::for_each(std::execution::par, walkers.begin()+n_ens1, walkers.end(), [&](int walker) {
-			move_or_reject(move, sampler_params, scales, step, walker, ensemble_step, walkers.data(), n_ens1, data, &rand_state, log_likelihood, ll_state);
+			move_or_reject(move, sampler_params, scales, step, walker, ensemble_step, walkers.data(), n_ens1, data, seed, log_likelihood, ll_state);
 		});
 		*/
 		
+		for(int walker = 0; walker < data.n_walkers; ++walker)
+			data.n_accepted += accepted[walker];
+		
 		bool halt = false;
 		if(((step-initial_step) % callback_interval == 0) || (step == data.n_steps-1))
 			halt = !callback(callback_state, step);
@@ -1,7 +1,6 @@
 
-#include <mutex>
-#include <random>
 #include "monte_carlo.h"
+#include "../random_stream.h"
 
 enum class
 MCMC_Sampler {
@@ -11,11 +10,8 @@ MCMC_Sampler {
 	metropolis_hastings,
 };
 
-struct
-Random_State {
-	std::mt19937_64 gen;
-	std::mutex      gen_mutex;
-};
-
-bool run_mcmc(MCMC_Sampler method, double *sampler_params, double *scales, double (*log_likelihood)(void *, int, int), void *ll_state,
-		MC_Data &data, bool (*callback)(void *, int), void *callback_state, int callback_interval, int initial_step);
+// The random draws of the run are fully determined by the seed, also when the walkers are run on different threads.
+// The last argument to log_likelihood is a threshold. If the log likelihood is certainly below it, the move is rejected, and log_likelihood may
+// return any value below the threshold instead of the exact one (see Optimization_Model::evaluate).
+bool run_mcmc(MCMC_Sampler method, double *sampler_params, double *scales, double (*log_likelihood)(void *, int, int, double), void *ll_state,
+		MC_Data &data, bool (*callback)(void *, int), void *callback_state, int callback_interval, int initial_step, u64 seed = 0);
@@ -9,19 +9,20 @@ evaluate_target(Model_Data *data, Optimization_Target *target, double *err_param
 	//   We should also have some short-circuit to not compute some of the more expensive statistics if we only need a simple one.
 	
 	Stat_Class typetype = is_stat_class(target->stat_type);
+	auto sim_data = &data->get_storage(Var_Id::Type::state_var); // NOTE: Not necessarily data->results, since the results could be windowed.
 	if(typetype == Stat_Class::stat) {
 		Time_Series_Stats stats;
-		compute_time_series_stats(&stats, nullptr, &data->results, target->sim_offset, target->sim_stat_offset, target->stat_ts);
+		compute_time_series_stats(&stats, nullptr, sim_data, target->sim_offset, target->sim_stat_offset, target->stat_ts);
 		return get_stat(&stats, (Stat_Type)target->stat_type);
 	} else if(typetype == Stat_Class::residual) {
 		Residual_Stats residual_stats;
 		auto obs_data = target->obs_id.type == Var_Id::Type::series ? &data->series : &data->additional_series;
-		compute_residual_stats(&residual_stats, &data->results, target->sim_offset, target->sim_stat_offset, obs_data, target->obs_offset,
+		compute_residual_stats(&residual_stats, sim_data, target->sim_offset, target->sim_stat_offset, obs_data, target->obs_offset,
 			target->obs_stat_offset, target->stat_ts, target->stat_type == (int)Residual_Type::srcc);
 		return get_stat(&residual_stats, (Residual_Type)target->stat_type);
 	} else if(typetype == Stat_Class::log_likelihood) {
 		auto obs_data = target->obs_id.type == Var_Id::Type::series ? &data->series : &data->additional_series;
-		return compute_ll(&data->results, target->sim_offset, target->sim_stat_offset, obs_data, target->obs_offset, target->obs_stat_offset,
+		return compute_ll(sim_data, target->sim_offset, target->sim_stat_offset, obs_data, target->obs_offset, target->obs_stat_offset,
 			target->stat_ts, err_param, (LL_Type)target->stat_type);
 	}
 	return std::numeric_limits<double>::quiet_NaN();
@@ -29,13 +30,139 @@ evaluate_target(Model_Data *data, Optimization_Target *target, double *err_param
 
 void
 Optimization_Target::set_offsets(Model_Data *data) {
-	sim_offset = data->results.structure->get_offset(sim_id, indexes);
+	sim_offset = data->get_storage(Var_Id::Type::state_var).structure->get_offset(sim_id, indexes);
 	if(is_valid(obs_id)) {
 		auto obs_data = obs_id.type == Var_Id::Type::series ? &data->series : &data->additional_series;
 		obs_offset = obs_data->structure->get_offset(obs_id, indexes);
 	}
 }
 
+/*
+	While the model is running, we can compute a bound on the best score the run can still get. If it is already worse than a given threshold (like
+	the best score so far), there is no point in finishing the run.
+	This only works for statistics that are sums over the time steps of terms that can only make them worse, like the sum of squared errors. The
+	normalization (number of observations etc.) can then be computed from the observations before the run. The other ones can get better or worse
+	at any time, so we can't say anything about them before the run is done.
+*/
+
+static bool
+can_bound_stat(int stat_type) {
+	return stat_type == (int)Residual_Type::mae
+		|| stat_type == (int)Residual_Type::rmse
+		|| stat_type == (int)Residual_Type::ns
+		|| stat_type == (int)Residual_Type::log_ns
+		|| stat_type == (int)LL_Type::normal;
+}
+
+static void
+set_up_bound(Model_Data *data, Optimization_Target *target) {
+	auto obs_data = target->obs_id.type == Var_Id::Type::series ? &data->series : &data->additional_series;
+	bool use_log = (target->stat_type == (int)Residual_Type::log_ns);
+	
+	s64 count = 0;
+	double sum = 0.0;
+	for(s64 idx = 0; idx < target->stat_ts; ++idx) {
+		double obs = *obs_data->get_value(target->obs_offset, target->obs_stat_offset + idx);
+		if(!std::isfinite(obs)) continue;
+		sum += use_log ? std::log(obs) : obs;
+		++count;
+	}
+	double mean = sum / (double)count;
+	double ss = 0.0;
+	for(s64 idx = 0; idx < target->stat_ts; ++idx) {
+		double obs = *obs_data->get_value(target->obs_offset, target->obs_stat_offset + idx);
+		if(!std::isfinite(obs)) continue;
+		double val = (use_log ? std::log(obs) : obs) - mean;
+		ss += val*val;
+	}
+	target->obs_count = count;
+	target->obs_ss    = ss;
+}
+
+struct
+Target_Bound {
+	Optimization_Target          *target;
+	Data_Storage<double, Var_Id> *obs_data;
+	double err_var   = 0.0;   // Only for the normal log likelihood.
+	s64    next      = 0;     // The first step of the target interval that is not summed up yet.
+	s64    remaining;         // The number of observations from 'next' on.
+	double sum       = 0.0;
+	bool   valid     = true;  // If a value was left out of the stat (because sim was not finite), the normalization is wrong, and we can't bound it.
+};
+
+struct
+Objective_Bound {
+	Model_Data               *data;
+	std::vector<Target_Bound> targets;
+	bool                      maximize;
+	double                    threshold;
+	double                    value   = 0.0;
+	bool                      stopped = false;
+	
+	void add_steps(s64 steps_done);
+};
+
+void
+Objective_Bound::add_steps(s64 steps_done) {
+	auto sim_data = &data->get_storage(Var_Id::Type::state_var);
+	
+	value = 0.0;
+	for(auto &bound : targets) {
+		auto target = bound.target;
+		s64 end = std::min(target->stat_ts, steps_done - target->sim_stat_offset);
+		bool is_ll = (target->stat_type == (int)LL_Type::normal);
+		
+		for(; bound.next < end; ++bound.next) {
+			double obs = *bound.obs_data->get_value(target->obs_offset, target->obs_stat_offset + bound.next);
+			double sim = *sim_data->get_value(target->sim_offset, target->sim_stat_offset + bound.next);
+			if(is_ll && !std::isfinite(sim)) {
+				bound.sum = -std::numeric_limits<double>::infinity(); // compute_ll gives -inf in this case.
+				continue;
+			}
+			if(!std::isfinite(obs)) continue;
+			--bound.remaining;
+			
+			double term;
+			if(is_ll)
+				term = log_pdf_normal(obs, sim, bound.err_var);
+			else if(target->stat_type == (int)Residual_Type::mae)
+				term = std::abs(obs - sim);
+			else if(target->stat_type == (int)Residual_Type::log_ns)
+				term = (std::log(obs) - std::log(sim))*(std::log(obs) - std::log(sim));
+			else
+				term = (obs - sim)*(obs - sim);
+			
+			if(!std::isfinite(term) && !is_ll)
+				bound.valid = false;
+			bound.sum += term;
+		}
+		
+		if(target->weight == 0.0) continue;
+		
+		double val;
+		if(!bound.valid)
+			val = maximize ? std::numeric_limits<double>::infinity() : 0.0;
+		else if(is_ll)
+			val = bound.sum + (double)bound.remaining * log_pdf_normal(0.0, 0.0, bound.err_var); // The remaining ones can at most be a perfect fit.
+		else if(target->stat_type == (int)Residual_Type::mae)
+			val = bound.sum / (double)target->obs_count;
+		else if(target->stat_type == (int)Residual_Type::rmse)
+			val = std::sqrt(bound.sum / (double)target->obs_count);
+		else
+			val = 1.0 - bound.sum / target->obs_ss;
+		value += target->weight * val;
+	}
+	
+	stopped = maximize ? (value < threshold) : (value > threshold);
+}
+
+static bool
+check_bound(void *state, s64 steps_done) {
+	auto bound = reinterpret_cast<Objective_Bound *>(state);
+	bound->add_steps(steps_done);
+	return !bound->stopped;
+}
+
 Optimization_Model::Optimization_Model(Model_Data *data, Expr_Parameters &parameters, std::vector<Optimization_Target> &targets, const std::vector<double> *initial_pars, const Optim_Callback &callback, s64 ms_timeout)
 	: data(data), parameters(&parameters), targets(&targets), ms_timeout(ms_timeout) {
 	
@@ -79,6 +206,11 @@ Optimization_Model::Optimization_Model(Model_Data *data, Expr_Parameters &parame
 		
 		if(typetype != Stat_Class::stat && !is_valid(target.obs_id))
 			fatal_error(Mobius_Error::api_usage, "A target statistic of this type requires an observed series to compare against");
+		
+		if(can_bound_stat(target.stat_type))
+			set_up_bound(data, &target);
+		else
+			can_bound = false;
 	}
 	
 	this->callback = nullptr; // To not have it call back in initial score computation.
@@ -94,14 +226,52 @@ Optimization_Model::Optimization_Model(Model_Data *data, Expr_Parameters &parame
 }
 
 double
-Optimization_Model::evaluate(const std::vector<double> &values) {//double *values) {
+Optimization_Model::evaluate(const std::vector<double> &values, double threshold) {//double *values) {
 	
 	set_parameters(data, *parameters, values);
 	
+	Objective_Bound bound;
+	bool use_bound = can_bound && std::isfinite(threshold);
+	if(use_bound) {
+		bound.data      = data;
+		bound.maximize  = maximize;
+		bound.threshold = threshold;
+		for(auto &target : *targets) {
+			Target_Bound target_bound;
+			target_bound.target    = &target;
+			target_bound.obs_data  = target.obs_id.type == Var_Id::Type::series ? &data->series : &data->additional_series;
+			target_bound.remaining = target.obs_count;
+			if(target.stat_type == (int)LL_Type::normal) {
+				double std_dev = values[target.err_par_idx[0]];
+				target_bound.err_var = std_dev*std_dev;
+			}
+			bound.targets.push_back(target_bound);
+		}
+	}
+	
+	// If the last evaluation finished, only what the parameters that got new values affect has to be computed again. This helps a lot when
+	// the parameters only affect a part of the model, like when only one parameter is varied at a time.
+	// The ones that are given by expressions could have changed if any other did, so they are always counted.
+	std::vector<Entity_Id> changed_pars;
+	bool rerun = (last_values.size() == values.size());
+	if(rerun) {
+		int active_idx = 0;
+		for(int idx = 0; idx < parameters->parameters.size(); ++idx) {
+			auto &par = parameters->parameters[idx];
+			if(parameters->exprs[idx])
+				changed_pars.push_back(par.id);
+			else {
+				if(!par.virt && values[active_idx] != last_values[active_idx])
+					changed_pars.push_back(par.id);
+				++active_idx;
+			}
+		}
+	}
+	
 	bool run_finished = true;
 	
 	try {
-		run_finished = run_model(data, ms_timeout);
+		run_finished = run_model(data, ms_timeout, false, nullptr, nullptr, rerun ? &changed_pars : nullptr, use_bound ? check_bound : nullptr, &bound);
 	} catch(int) {
 		// Hmm, this is not ideal, because it will still write stuff to the error stream which could clog up the log window
 		// on large optimization runs. We could clear that here, but even better would be if we could tell run_model to not
@@ -110,6 +280,20 @@ Optimization_Model::evaluate(const std::vector<double> &values) {//double *value
 		run_finished = false;
 	}
 	
+	if(run_finished)
+		last_values = values;
+	else
+		last_values.clear();
+	
+	if(!run_finished && bound.stopped) {
+		// It was stopped because it couldn't beat the threshold. This is not an error, but the score is not the exact one.
+		++n_stopped;
+		++n_evals;
+		if(callback)
+			callback(n_evals, n_timeouts, initial_score, best_score, erroneous_pars);
+		return bound.value;
+	}
+	
 	if(!run_finished) {
 		++n_timeouts;
 		if(erroneous_pars.empty()) {// Store one example of ill-formed parameter set.
@@ -141,6 +325,21 @@ Optimization_Model::evaluate(const std::vector<double> &values) {//double *value
 	return agg;
 }
 
+double
+mcmc_log_likelihood(void *state, int walker, int step, double threshold) {
+	
+	auto ll = reinterpret_cast<MCMC_Log_Likelihood *>(state);
+	auto &data = *ll->data;
+	
+	std::vector<double> values(data.n_pars);
+	for(int par = 0; par < data.n_pars; ++par) {
+		values[par] = data(walker, par, step);
+		if(values[par] < ll->min_vals[par] || values[par] > ll->max_vals[par])
+			return -std::numeric_limits<double>::infinity();
+	}
+	return ll->models[walker]->evaluate(values, threshold);
+}
+
 s64
 Optimization_Model::get_n_active() {
 	s64 n_active = 0;
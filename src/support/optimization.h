@@ -5,6 +5,7 @@
 #include "../model_application.h"
 #include "parameter_editing.h"
 #include "statistics.h"
+#include "monte_carlo.h"
 
 struct
 Optimization_Target {
@@ -21,6 +22,11 @@ Optimization_Target {
 	// NOTE: These should be set up based on begin, end and whatever the start and end date of the model run is.
 	s64 sim_stat_offset = -1, obs_stat_offset = -1, stat_ts = -1;
 	
+	// The number of observations in the interval, and their sum of squares around the mean (of the log if it is log N-S). Only used to bound the
+	// score of a run that is not finished (see Optimization_Model::evaluate).
+	s64 obs_count = 0;
+	double obs_ss = 0.0;
+	
 	void set_offsets(Model_Data *data); // This one sets the sim_offset and obs_offset.
 	
 	Optimization_Target(Mobius_Model *model) : indexes(model) {}
@@ -49,7 +55,9 @@ Optimization_Model {
 	
 	Optimization_Model(Model_Data *data, Expr_Parameters &parameters, std::vector<Optimization_Target> &targets, const std::vector<double> *initial_pars = nullptr, const Optim_Callback &callback = nullptr, s64 ms_timeout = -1);
 	
-	double evaluate(const std::vector<double> &values);//const double *values);
+	// If a threshold is given, the run is stopped as soon as it is certain that the score can't be better than the threshold (this is only possible
+	// for some target statistics, see can_bound). The returned value is then not the exact score, but a bound that is worse than the threshold.
+	double evaluate(const std::vector<double> &values, double threshold = std::numeric_limits<double>::quiet_NaN());//const double *values);
 	
 	std::string report_erroneous(Model_Application *app);
 	
@@ -57,6 +65,8 @@ Optimization_Model {
 	
 	bool                              maximize;
 	s64                               ms_timeout, n_timeouts, n_evals;
+	s64                               n_stopped = 0; // The number of evaluations that were stopped early because of the threshold.
+	bool                              can_bound = true;
 	double                            best_score, initial_score;
 	std::vector<double>               initial_pars;
 	Model_Data                       *data;
@@ -65,7 +75,22 @@ Optimization_Model {
 	Optim_Callback                    callback;
 	
 	std::vector<double>               erroneous_pars;
+	std::vector<double>               last_values; // The values of the last evaluation, if its run finished.
+};
+
+// The state for mcmc_log_likelihood.
+struct
+MCMC_Log_Likelihood {
+	MC_Data                          *data;
+	std::vector<Optimization_Model *> models;    // One per walker, since the walkers are run on separate threads.
+	std::vector<double>               min_vals;  // The parameter bounds. Proposals outside of them get a log likelihood of -inf.
+	std::vector<double>               max_vals;
 };
 
+// This can be passed to run_mcmc as the log likelihood function (with an MCMC_Log_Likelihood as the state). It evaluates the parameters of the
+// walker at the given step, and stops the run early if the move will be rejected anyway (see the threshold in Optimization_Model::evaluate).
+double
+mcmc_log_likelihood(void *state, int walker, int step, double threshold);
+
 
 #endif // MOBIUS_OPTIMIZATION_H
\ No newline at end of file
@@ -1,14 +1,6 @@
 
 #include "statistics.h"
 
-
-inline double
-log_pdf_normal(double x, double mu, double sigma_squared) {
-	constexpr double log_2_pi = 1.83787706641;
-	double factor = (x - mu);
-	return 0.5*(-std::log(sigma_squared) - log_2_pi - factor*factor/sigma_squared);
-}
-
 double
 compute_ll(Data_Storage<double, Var_Id> *data_sim, s64 offset_sim, s64 ts_begin_sim, Data_Storage<double, Var_Id> *data_obs, s64 offset_obs, s64 ts_begin_obs, s64 len, double *err_param, LL_Type ll_type) {
 	double result = 0.0;
@@ -181,6 +181,13 @@ quantile_of_sorted(double *data, s64 size, double q) {
 	return data[idx];
 }
 
+inline double
+log_pdf_normal(double x, double mu, double sigma_squared) {
+	constexpr double log_2_pi = 1.83787706641;
+	double factor = (x - mu);
+	return 0.5*(-std::log(sigma_squared) - log_2_pi - factor*factor/sigma_squared);
+}
+
 
 void
 compute_time_series_stats(Time_Series_Stats *stats, Statistics_Settings *settings, Data_Storage<double, Var_Id> *data, s64 offset, s64 ts_begin, s64 len);
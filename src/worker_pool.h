@@ -0,0 +1,107 @@
+
+#ifndef MOBIUS_WORKER_POOL_H
+#define MOBIUS_WORKER_POOL_H
+
+#include "mobius_common.h"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <algorithm>
+
+/*
+	A persistent pool of threads that can split a range of iterations between them.
+	It is made for short jobs that are submitted very often (like once per batch per time step), so the threads are kept around between jobs.
+*/
+
+struct
+Worker_Pool {
+	typedef void work_function(void *context, s64 first, s64 last);
+
+	Worker_Pool(int n_workers) {
+		for(int idx = 0; idx < n_workers; ++idx) {
+			std::thread worker([this]() { work_loop(); });
+			worker.detach();
+		}
+		worker_count = n_workers;
+	}
+
+	// Call fun(context, first, last) on disjoint ranges that together cover [0, count). The calling thread does part of the work too.
+	// If the pool is already busy with a job from another thread, the calling thread just does everything itself.
+	void
+	parallel_for(work_function *fun, void *context, s64 count) {
+		std::unique_lock<std::mutex> in_use(submit_mutex, std::try_to_lock);
+		if(!in_use.owns_lock() || worker_count == 0 || count < 2) {
+			if(count > 0) fun(context, 0, count);
+			return;
+		}
+
+		std::unique_lock<std::mutex> lock(mutex);
+		job_fun     = fun;
+		job_context = context;
+		job_count   = count;
+		job_chunks  = std::min(count, (s64)worker_count + 1);
+		next_chunk  = 0;
+		chunks_done = 0;
+		wake.notify_all();
+
+		do_chunks(lock);
+
+		finished.wait(lock, [this]() { return chunks_done == job_chunks; });
+	}
+
+	int thread_count() { return worker_count + 1; }
+
+private:
+	// NOTE: Chunks are claimed and completed under the mutex. There are only about as many chunks as threads, so this is not a bottleneck, and it makes
+	// sure that a thread can't claim a chunk of one job and run it using the function of another.
+	void
+	do_chunks(std::unique_lock<std::mutex> &lock) {
+		while(next_chunk < job_chunks) {
+			s64 chunk = next_chunk++;
+			work_function *fun = job_fun;
+			void *context      = job_context;
+			s64 first          = (job_count*chunk)/job_chunks;
+			s64 last           = (job_count*(chunk+1))/job_chunks;
+
+			lock.unlock();
+			fun(context, first, last);
+			lock.lock();
+
+			if(++chunks_done == job_chunks)
+				finished.notify_one();
+		}
+	}
+
+	void
+	work_loop() {
+		std::unique_lock<std::mutex> lock(mutex);
+		while(true) {
+			wake.wait(lock, [this]() { return next_chunk < job_chunks; });
+			do_chunks(lock);
+		}
+	}
+
+	std::mutex              submit_mutex;
+	std::mutex              mutex;
+	std::condition_variable wake;
+	std::condition_variable finished;
+	int                     worker_count = 0;
+
+	work_function *job_fun     = nullptr;
+	void          *job_context = nullptr;
+	s64            job_count   = 0;
+	s64            job_chunks  = 0;
+	s64            next_chunk  = 0;
+	s64            chunks_done = 0;
+};
+
+inline Worker_Pool *
+global_worker_pool() {
+	// NOTE: This is never freed. The threads just wait until the process exits.
+	static Worker_Pool *pool = new Worker_Pool(std::max((int)std::thread::hardware_concurrency() - 1, 0));
+	return pool;
+}
+
+#endif // MOBIUS_WORKER_POOL_H
@@ -0,0 +1,64 @@
+// Checks that a run that is split in two with a checkpoint (see make_checkpoint in run_model.cpp) gives exactly the same results as one that
+// goes through in one piece. The model has a solver batch with instances that are coupled, so they are integrated together, and one where each
+// instance is integrated separately with its own step size.
+// Build it with compile_checkpoint_test.sh, and run it from the test folder.
+
+#include "../src/c_abi.h"
+#include "../src/model_application.h"
+
+#include <cstdio>
+#include <vector>
+
+static bool failed = false;
+
+static void
+check(bool condition, const char *what) {
+	printf("%s: %s\n", condition ? "OK" : "FAILED", what);
+	if(!condition) failed = true;
+}
+
+int
+main() {
+	
+	Mobius_Base_Config config = {};
+	Model_Data *data = mobius_build_from_model_and_data_file((char *)"models/coupled_instances_model.txt", (char *)"models/coupled_instances_data.dat", (char *)"../", &config);
+	if(!data) {
+		char buf[4096];
+		while(mobius_encountered_error(buf, sizeof(buf)) > 0)
+			printf("%s", buf);
+		return 1;
+	}
+	
+	auto &results  = data->results;
+	s64 var_count  = data->app->result_structure.total_count;
+	
+	mobius_run_model(data, -1, nullptr);
+	s64 time_steps = results.time_steps;
+	// NOTE: The results start with the initial values (time step -1).
+	std::vector<double> whole(results.get_value(0, -1), results.get_value(0, time_steps));
+	
+	s64 split = time_steps / 3;
+	mobius_set_checkpoint_step(data, split);
+	mobius_run_model(data, -1, nullptr);
+	std::vector<char> checkpoint(mobius_get_checkpoint(data, nullptr, 0));
+	mobius_get_checkpoint(data, checkpoint.data(), checkpoint.size());
+	check(!checkpoint.empty(), "The run makes a checkpoint");
+	
+	mobius_set_checkpoint_step(data, -1);
+	mobius_resume_from_checkpoint(data, checkpoint.data(), checkpoint.size());
+	mobius_run_model(data, -1, nullptr);
+	check(results.time_steps == time_steps - split - 1, "The resumed run starts at the time step after the checkpoint");
+	
+	// The initial values of the resumed run are the values at the checkpoint.
+	bool same = results.time_steps == time_steps - split - 1;
+	for(s64 step = -1; same && step < results.time_steps; ++step)
+		for(s64 offset = 0; offset < var_count; ++offset)
+			same = same && *results.get_value(offset, step) == whole[(split + 2 + step)*var_count + offset];
+	check(same, "The resumed run gives the same results as the run that was not split");
+	
+	mobius_delete_application(data, true);
+	
+	if(failed) return 1;
+	printf("All tests passed.\n");
+	return 0;
+}
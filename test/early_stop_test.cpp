@@ -0,0 +1,160 @@
+// Checks that calibration runs are stopped early when they can't beat a threshold (see Optimization_Model::evaluate), both when the threshold is
+// given directly and when it comes from the acceptance test of an MCMC run (see mcmc_log_likelihood). Stopping the runs early must not change
+// which MCMC moves are accepted.
+// Build it with compile_early_stop_test.sh, and run it from the test folder.
+
+#include "../src/c_abi.h"
+#include "../src/support/optimization.h"
+#include "../src/support/mcmc.h"
+
+#include <cstdio>
+#include <memory>
+
+static bool failed = false;
+
+static void
+check(bool condition, const char *what) {
+	printf("%s: %s\n", condition ? "OK" : "FAILED", what);
+	if(!condition) failed = true;
+}
+
+// The parameters are the four rates of the model and the standard deviation of the error, which is a virtual parameter.
+struct
+Calibration_Setup {
+	Expr_Parameters                  parameters;
+	std::vector<Optimization_Target> targets;
+	std::vector<double>              initial_pars = { 0.2, 0.1, 0.025, 0.05, 0.5 };
+	std::vector<double>              min_vals     = { 0.0, 0.0, 0.0,   0.0,  0.01 };
+	std::vector<double>              max_vals     = { 1.0, 1.0, 1.0,   1.0,  10.0 };
+	
+	Calibration_Setup(Model_Data *data);
+};
+
+Calibration_Setup::Calibration_Setup(Model_Data *data) {
+	
+	auto app   = data->app;
+	auto model = app->model;
+	
+	std::vector<Indexed_Parameter> pars;
+	for(auto par_id : model->parameters) {
+		auto par = model->parameters[par_id];
+		if(par->decl_type != Decl_Type::par_real || par->name.find("rate") == std::string::npos) continue;
+		Indexed_Parameter indexed_par(model);
+		indexed_par.id     = par_id;
+		indexed_par.symbol = "p" + std::to_string(pars.size());
+		pars.push_back(indexed_par);
+	}
+	Indexed_Parameter err_par(model);
+	err_par.virt   = true;
+	err_par.symbol = "err";
+	pars.push_back(err_par);
+	parameters.set(app, pars);
+	
+	Optimization_Target target(model);
+	for(auto var_id : app->vars.all_state_vars())
+		if(app->vars[var_id]->name == "Prey") target.sim_id = var_id;
+	for(auto var_id : app->vars.all_series())
+		if(app->vars[var_id]->name == "Observed prey") target.obs_id = var_id;
+	target.stat_type   = (int)LL_Type::normal;
+	target.weight      = 1.0;
+	target.start       = data->get_start_date_parameter();
+	target.end         = data->get_end_date_parameter();
+	target.err_par_idx = { 4 };
+	targets.push_back(target);
+}
+
+// Evaluates without a threshold, so that the runs are never stopped early.
+static double
+exact_log_likelihood(void *state, int walker, int step, double threshold) {
+	return mcmc_log_likelihood(state, walker, step, std::numeric_limits<double>::quiet_NaN());
+}
+
+static bool
+mcmc_callback(void *state, int step) { return true; }
+
+// Runs a short MCMC with one copy of the model per walker, and returns the number of evaluations that were stopped early.
+static s64
+run_test_mcmc(Model_Data *data, Calibration_Setup &setup, MC_Data &chains, bool stop_early) {
+	
+	constexpr int n_walkers = 10;
+	constexpr int n_steps   = 20;
+	
+	std::vector<std::unique_ptr<Model_Data>>         datas;
+	std::vector<std::unique_ptr<Optimization_Model>> models;
+	MCMC_Log_Likelihood ll;
+	ll.data     = &chains;
+	ll.min_vals = setup.min_vals;
+	ll.max_vals = setup.max_vals;
+	for(int walker = 0; walker < n_walkers; ++walker) {
+		datas.emplace_back(data->copy());
+		models.emplace_back(new Optimization_Model(datas.back().get(), setup.parameters, setup.targets));
+		ll.models.push_back(models.back().get());
+	}
+	
+	// Start the walkers spread out around the initial parameters, so that many of the proposals are clearly worse than where the walkers are.
+	chains.allocate(n_walkers, setup.initial_pars.size(), n_steps);
+	for(int walker = 0; walker < n_walkers; ++walker)
+		for(int par = 0; par < chains.n_pars; ++par)
+			chains(walker, par, 0) = setup.initial_pars[par] * (0.7 + 0.06*walker);
+	
+	double sampler_params[1] = { 2.0 };
+	run_mcmc(MCMC_Sampler::affine_stretch, sampler_params, nullptr, stop_early ? mcmc_log_likelihood : exact_log_likelihood, &ll, chains,
+		mcmc_callback, nullptr, n_steps, 0, 1234);
+	
+	s64 n_stopped = 0;
+	for(auto &model : models)
+		n_stopped += model->n_stopped;
+	return n_stopped;
+}
+
+int
+main() {
+	
+	Mobius_Base_Config config = {};
+	Model_Data *data = mobius_build_from_model_and_data_file((char *)"models/calibration_test_model.txt", (char *)"models/calibration_test_data.dat", (char *)"../", &config);
+	if(!data) {
+		char buf[4096];
+		while(mobius_encountered_error(buf, sizeof(buf)) > 0)
+			printf("%s", buf);
+		return 1;
+	}
+	
+	Calibration_Setup setup(data);
+	
+	{
+		Optimization_Model opt_model(data, setup.parameters, setup.targets, &setup.initial_pars);
+		check(opt_model.can_bound, "The normal log likelihood can be bounded");
+		
+		std::vector<double> worse = setup.initial_pars;
+		worse[0] *= 1.5;
+		double exact = opt_model.evaluate(worse);
+		check(exact < opt_model.initial_score, "The changed parameters give a worse score");
+		
+		double bound = opt_model.evaluate(worse, opt_model.initial_score);
+		check(opt_model.n_stopped == 1, "The run is stopped early when it can't beat the threshold");
+		check(bound < opt_model.initial_score && bound >= exact, "The result of a stopped run is a bound between the exact score and the threshold");
+		
+		double again = opt_model.evaluate(setup.initial_pars, opt_model.initial_score - 1.0);
+		check(opt_model.n_stopped == 1 && again == opt_model.initial_score, "A run that beats the threshold is not stopped");
+	}
+	
+	MC_Data exact_chains, stopped_chains;
+	run_test_mcmc(data, setup, exact_chains, false);
+	s64 n_stopped = run_test_mcmc(data, setup, stopped_chains, true);
+	s64 n_evals   = stopped_chains.n_walkers*(stopped_chains.n_steps-1);
+	printf("%lld of %lld MCMC evaluations were stopped early.\n", (long long)n_stopped, (long long)n_evals);
+	check(2*n_stopped > n_evals, "More than half of the MCMC evaluations are stopped early when the move will be rejected anyway");
+	
+	bool same = exact_chains.n_accepted == stopped_chains.n_accepted;
+	for(int walker = 0; walker < exact_chains.n_walkers; ++walker)
+		for(int step = 0; step < exact_chains.n_steps; ++step)
+			for(int par = 0; par < exact_chains.n_pars; ++par)
+				same = same && exact_chains(walker, par, step) == stopped_chains(walker, par, step);
+	check(same, "The MCMC chains are the same with and without stopping early");
+	
+	mobius_delete_application(data, true);
+	
+	if(failed) return 1;
+	printf("All tests passed.\n");
+	return 0;
+}
@@ -0,0 +1,26 @@
+# Checks that results can be put in a memory mapped file, opened again read-only, and that the model can be rerun after that.
+# Run from the repository root with mobipy installed:  python test/mapped_results_test.py
+
+import os, sys, tempfile
+import numpy as np
+
+sys.path.append(os.path.join(os.path.dirname(__file__), '..'))
+import mobipy as mpy
+
+models = os.path.join(os.path.dirname(__file__), 'models')
+app = mpy.Model_Application.build_from_model_and_data_file(os.path.join(models, 'lv_model.txt'), os.path.join(models, 'lv_data.dat'))
+
+result_file = os.path.join(tempfile.mkdtemp(), 'lv_results.dat')
+
+app.map_results_to_file(result_file)
+app.run()
+before = app.var('Habitat Prey')[()].values.copy()
+
+app.open_result_file(result_file)
+assert np.array_equal(app.var('Habitat Prey')[()].values, before, equal_nan=True), 'The results read from the file are not the same as the ones that were written.'
+
+# The results are read-only now, so this run has to put them somewhere else.
+app.run()
+assert np.array_equal(app.var('Habitat Prey')[()].values, before, equal_nan=True), 'Rerunning after opening a result file gave different results.'
+
+print('OK')
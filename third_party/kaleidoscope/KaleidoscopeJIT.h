@@ -15,6 +15,8 @@
 	This file has been modified by Magnus Dahler Norling after it was obtained from the LLVM project.
 	Modifications:
 		Added the getTargetTriple method.
+		Added the ObjectCache argument and the addObjectFile method.
+		Added the getOrCreateJITDylib method and the lookup in a given JITDylib.
 */
 
 #ifndef LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
@@ -22,6 +24,7 @@
 
 #include "llvm/ADT/StringRef.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/Core.h"
 #include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
@@ -51,12 +54,13 @@ private:
 
 public:
   KaleidoscopeJIT(std::unique_ptr<ExecutionSession> ES,
-                  JITTargetMachineBuilder JTMB, DataLayout DL)
+                  JITTargetMachineBuilder JTMB, DataLayout DL,
+                  ObjectCache *ObjCache = nullptr)
       : ES(std::move(ES)), DL(std::move(DL)), Mangle(*this->ES, this->DL),
         ObjectLayer(*this->ES,
                     []() { return std::make_unique<SectionMemoryManager>(); }),
         CompileLayer(*this->ES, ObjectLayer,
-                     std::make_unique<ConcurrentIRCompiler>(std::move(JTMB))),
+                     std::make_unique<ConcurrentIRCompiler>(std::move(JTMB), ObjCache)),
         MainJD(this->ES->createBareJITDylib("<main>")) {
     MainJD.addGenerator(
         cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
@@ -72,7 +76,7 @@ public:
       ES->reportError(std::move(Err));
   }
 
-  static Expected<std::unique_ptr<KaleidoscopeJIT>> Create() {
+  static Expected<std::unique_ptr<KaleidoscopeJIT>> Create(ObjectCache *ObjCache = nullptr) {
     auto EPC = SelfExecutorProcessControl::Create();
     if (!EPC)
       return EPC.takeError();
@@ -87,23 +91,44 @@ public:
       return DL.takeError();
 
     return std::make_unique<KaleidoscopeJIT>(std::move(ES), std::move(JTMB),
-                                             std::move(*DL));
+                                             std::move(*DL), ObjCache);
   }
 
   const DataLayout &getDataLayout() const { return DL; }
 
   JITDylib &getMainJITDylib() { return MainJD; }
 
+  // The created JITDylib can use the symbols of the main one (including the ones from the current process, which are not all marked as
+  // exported).
+  JITDylib &getOrCreateJITDylib(const std::string &Name) {
+    if (auto *JD = ES->getJITDylibByName(Name))
+      return *JD;
+    auto &JD = ES->createBareJITDylib(Name);
+    JD.addToLinkOrder(MainJD, JITDylibLookupFlags::MatchAllSymbols);
+    return JD;
+  }
+
   Error addModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr) {
     if (!RT)
       RT = MainJD.getDefaultResourceTracker();
     return CompileLayer.add(RT, std::move(TSM));
   }
 
+  Error addObjectFile(std::unique_ptr<MemoryBuffer> Obj, ResourceTrackerSP RT = nullptr) {
+    if (!RT)
+      RT = MainJD.getDefaultResourceTracker();
+    return ObjectLayer.add(RT, std::move(Obj));
+  }
+
   Expected<ExecutorSymbolDef> lookup(StringRef Name) {
 
     return ES->lookup({&MainJD}, Mangle(Name.str()));
   }
+
+  Expected<ExecutorSymbolDef> lookup(JITDylib &JD, StringRef Name) {
+
+    return ES->lookup({&JD}, Mangle(Name.str()));
+  }
   
   llvm::Triple getTargetTriple() {
 	  return ES->getExecutorProcessControl().getTargetTriple();